@@ -2,74 +2,197 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/string.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/capability.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/timekeeping.h>
 #include <linux/types.h>
+#include <linux/uaccess.h>
+#include <linux/wait_bit.h>
+#include <linux/workqueue.h>
+#include <linux/xxhash.h>
 
 #include "include/bcomp.h"
 #include "include/map_common.h"
 #include "include/comp_common.h"
 #include "include/settings.h"
 #include "include/stats.h"
+#include "include/recompress.h"
+#include "include/split_comp.h"
+
+#define CREATE_TRACE_POINTS
+#include "include/bcomp_trace.h"
 
 // ======== initialization ======== //
 
+/* stored-form export/import, see raw_io.h */
+static int bcomp_ioctl(struct block_device *bdev, blk_mode_t mode,
+		       unsigned int cmd, unsigned long arg)
+{
+	struct bcomp_dev *bcdev = bdev->bd_disk->private_data;
+	void __user *uarg = (void __user *)arg;
+	struct bcomp_raw_io io;
+	int ret;
+
+	if (cmd != BCOMP_IOC_EXPORT && cmd != BCOMP_IOC_IMPORT)
+		return -ENOTTY;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (cmd == BCOMP_IOC_IMPORT && !(mode & BLK_OPEN_WRITE))
+		return -EBADF;
+
+	if (bcdev->under_dev->mem)
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&io, uarg, sizeof(io)))
+		return -EFAULT;
+
+	if (cmd == BCOMP_IOC_EXPORT)
+		ret = bcomp_raw_export(bcdev, &io);
+	else
+		ret = bcomp_raw_import(bcdev, &io);
+
+	if (copy_to_user(uarg, &io, sizeof(io)))
+		return -EFAULT;
+
+	return ret;
+}
+
 static const struct block_device_operations bcomp_fops = {
 	.owner = THIS_MODULE,
 	.submit_bio = bcomp_submit_bio,
+	.ioctl = bcomp_ioctl,
+	.compat_ioctl = blkdev_compat_ptr_ioctl,
 };
 
 static void free_under_dev(struct underlying_dev *under_dev)
 {
-	if (under_dev->bdev_fl)
-		bdev_fput(under_dev->bdev_fl);
+	struct under_member *m;
+	u32 i;
+
+	if (under_dev->mem)
+		free_mem_store(under_dev->mem);
+
+	for (i = 0; i < UNDER_MAX_MEMBERS; i++) {
+		m = &under_dev->members[i];
+
+		if (m->bdev_fl)
+			bdev_fput(m->bdev_fl);
 
-	if (under_dev->bset) {
-		bioset_exit(under_dev->bset);
-		kfree(under_dev->bset);
+		if (m->bset) {
+			bioset_exit(m->bset);
+			kfree(m->bset);
+		}
 	}
 
 	kfree(under_dev);
 }
 
-static int init_under_dev(const char *map_disk_path,
-			  struct underlying_dev *under_dev)
+static int init_under_member(const char *path, int len,
+			     struct underlying_dev *under_dev)
 {
+	struct under_member *m = &under_dev->members[under_dev->nr_members];
 	struct file *fbdev;
-	struct block_device *bdev;
 	struct bio_set *bset;
+	char *p;
+	int ret;
 
-	fbdev = bdev_file_open_by_path(
-		map_disk_path, BLK_OPEN_READ | BLK_OPEN_WRITE, under_dev, NULL);
+	if (under_dev->nr_members == UNDER_MAX_MEMBERS) {
+		BCOMP_ERRLOG("too many underlying devices");
+		return -EINVAL;
+	}
+
+	p = kstrndup(path, len, GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	fbdev = bdev_file_open_by_path(p, BLK_OPEN_READ | BLK_OPEN_WRITE,
+				       under_dev, NULL);
+	kfree(p);
 	if (IS_ERR(fbdev)) {
 		BCOMP_ERRLOG("incorrect path");
 		return PTR_ERR(fbdev);
 	}
 
-	bdev = file_bdev(fbdev);
-
-	under_dev->bdev = bdev;
-	under_dev->bdev_fl = fbdev;
+	m->bdev = file_bdev(fbdev);
+	m->bdev_fl = fbdev;
+	under_dev->nr_members++;
 
 	bset = kzalloc(sizeof(*bset), GFP_KERNEL);
 	if (!bset)
 		return -ENOMEM;
 
-	bioset_init(bset, POOL_SIZE, 0, BIOSET_NEED_BVECS);
-	under_dev->bset = bset;
+	ret = bioset_init(bset, POOL_SIZE, 0, BIOSET_NEED_BVECS);
+	if (ret) {
+		kfree(bset);
+		return ret;
+	}
+	m->bset = bset;
 
 	return 0;
 }
 
-static void free_disk(struct gendisk *disk)
+static int init_under_dev(const char *map_disk_path, u32 stripe_blks,
+			  enum w_block_size bs,
+			  struct underlying_dev *under_dev)
 {
-	del_gendisk(disk);
-	put_disk(disk);
+	const char *start = map_disk_path;
+	const char *end;
+	sector_t member_sects = 0;
+	sector_t sects;
+	u32 bs_sects = DIV_ROUND_UP(bs, 512);
+	u32 i;
+	int ret;
+
+	/* the store itself needs bs, see bcomp_init_dev() */
+	if (is_mem_path(map_disk_path))
+		return parse_mem_path(map_disk_path, &under_dev->nr_sects);
+
+	for (;;) {
+		end = strchrnul(start, UNDER_PATH_DELIMITER);
+		ret = init_under_member(start, end - start, under_dev);
+		if (ret)
+			return ret;
+
+		if (*end == '\0')
+			break;
+		start = end + 1;
+	}
+
+	if (under_dev->nr_members == 1) {
+		under_dev->stripe_blks = 1;
+		under_dev->nr_sects = bdev_nr_sectors(under_dev->members[0].bdev);
+		return 0;
+	}
+
+	/* the smallest member bounds all, whole stripes only */
+	under_dev->stripe_blks = stripe_blks ? stripe_blks : 1;
+	for (i = 0; i < under_dev->nr_members; i++) {
+		sects = bdev_nr_sectors(under_dev->members[i].bdev);
+		if (!i || sects < member_sects)
+			member_sects = sects;
+	}
+	member_sects = rounddown(member_sects,
+				 (sector_t)under_dev->stripe_blks * bs_sects);
+	if (!member_sects) {
+		BCOMP_ERRLOG("underlying device is smaller than a stripe");
+		return -EINVAL;
+	}
+
+	under_dev->nr_sects = member_sects * under_dev->nr_members;
+	return 0;
 }
 
-static void init_disk(struct gendisk *disk, struct bcomp_dev *bcdev, int major,
-		      int free_minor)
+static int init_disk(struct gendisk *disk, struct bcomp_dev *bcdev, int major,
+		     int free_minor)
 {
+	struct queue_limits lim;
+
 	disk->major = major;
 	disk->first_minor = free_minor;
 	disk->minors = 1;
@@ -78,9 +201,22 @@ static void init_disk(struct gendisk *disk, struct bcomp_dev *bcdev, int major,
 
 	disk->flags |= GENHD_FL_NO_PART;
 
-	set_capacity(disk, get_capacity(bcdev->under_dev->bdev->bd_disk));
+	set_capacity(disk, bcdev->under_dev->nr_sects);
 
 	snprintf(disk->disk_name, DISK_NAME_LEN, "bcomp%d", disk->first_minor);
+
+	/* flushes and FUA reach bcomp_submit_bio() only with a write cache */
+	if (bcdev->wb)
+		blk_queue_write_cache(disk->queue, true, true);
+
+	if (!map_can_discard(bcdev->map))
+		return 0;
+
+	/* discard releases whole blocks of the map */
+	lim = queue_limits_start_update(disk->queue);
+	lim.max_hw_discard_sectors = UINT_MAX;
+	lim.discard_granularity = bcdev->bs;
+	return queue_limits_commit_update(disk->queue, &lim);
 }
 
 int bcomp_alloc_dev(struct bcomp_dev **dev_pointer)
@@ -91,6 +227,7 @@ int bcomp_alloc_dev(struct bcomp_dev **dev_pointer)
 	struct comp_ctx *cctx;
 	struct map_ctx *mctx;
 	struct stats *stats;
+	struct cpu_acct *acct;
 
 	bcdev = (*dev_pointer) = kzalloc(sizeof(*bcdev), GFP_KERNEL);
 	if (!bcdev)
@@ -112,18 +249,26 @@ int bcomp_alloc_dev(struct bcomp_dev **dev_pointer)
 	if (!mctx)
 		goto map_ctx_alloc_err;
 
-	stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+	stats = alloc_stats();
 	if (!stats)
 		goto stats_alloc_err;
 
+	acct = alloc_cpu_acct();
+	if (!acct)
+		goto acct_alloc_err;
+
 	bcdev->bcomp_disk = disk;
 	bcdev->under_dev = under_dev;
-	bcdev->compress = cctx;
+	kref_init(&cctx->ref);
+	RCU_INIT_POINTER(bcdev->compress, cctx);
 	bcdev->map = mctx;
 	bcdev->stats = stats;
+	bcdev->acct = acct;
 
 	return 0;
 
+acct_alloc_err:
+	free_stats(stats);
 stats_alloc_err:
 	kfree(mctx);
 map_ctx_alloc_err:
@@ -138,11 +283,81 @@ dev_alloc_err:
 	return -ENOMEM;
 }
 
+/*
+DOC:
+	Teardown order: the disk is deleted first, so no bio enters
+	bcomp_submit_bio() while the contexts it uses are freed. The
+	gendisk itself (private_data, part0) is put last.
+ */
 void bcomp_free_dev(struct bcomp_dev *bcdev)
 {
-	if (bcdev->bcomp_disk) {
-		free_disk(bcdev->bcomp_disk);
-		bcdev->bcomp_disk = NULL;
+	/* dirty blocks go through the whole write path of the live disk */
+	if (bcdev->wb)
+		wb_flush(bcdev->wb);
+
+	/* waits for submitters, the disk is not live if init failed */
+	if (bcdev->bcomp_disk && disk_live(bcdev->bcomp_disk))
+		del_gendisk(bcdev->bcomp_disk);
+
+	/* destages what the sync of del_gendisk() dirtied again */
+	if (bcdev->wb) {
+		free_wb(bcdev->wb);
+		bcdev->wb = NULL;
+	}
+
+	/* the last checkpoint walks the map and writes under_dev */
+	if (bcdev->meta) {
+		free_meta(bcdev->meta);
+		bcdev->meta = NULL;
+	}
+
+	if (bcdev->hdr) {
+		free_blk_hdr(bcdev->hdr);
+		bcdev->hdr = NULL;
+	}
+
+	/* background workers do I/O to under_dev and walk the map */
+	if (bcdev->heat) {
+		free_heat(bcdev->heat);
+		bcdev->heat = NULL;
+	}
+
+	if (bcdev->recomp) {
+		free_recomp(bcdev->recomp);
+		bcdev->recomp = NULL;
+	}
+
+	if (bcdev->prefetch) {
+		free_prefetch(bcdev->prefetch);
+		bcdev->prefetch = NULL;
+	}
+
+	/* destages the rest of the log, so while bcdev->wq is alive */
+	if (bcdev->log) {
+		free_log(bcdev->log);
+		bcdev->log = NULL;
+	}
+
+	if (bcdev->wq) {
+		destroy_workqueue(bcdev->wq);
+		bcdev->wq = NULL;
+	}
+
+	/* deferred reads wait for sub-streams, so it goes after bcdev->wq */
+	if (bcdev->split_wq) {
+		destroy_workqueue(bcdev->split_wq);
+		bcdev->split_wq = NULL;
+	}
+
+	if (bcdev->cache) {
+		free_blk_cache(bcdev->cache);
+		bcdev->cache = NULL;
+	}
+
+	/* evicts through under_dev, the map only borrows it */
+	if (bcdev->pager) {
+		free_map_pager(bcdev->pager);
+		bcdev->pager = NULL;
 	}
 
 	if (bcdev->under_dev) {
@@ -150,9 +365,24 @@ void bcomp_free_dev(struct bcomp_dev *bcdev)
 		bcdev->under_dev = NULL;
 	}
 
-	if (bcdev->compress) {
-		free_comp(bcdev->compress);
-		bcdev->compress = NULL;
+	if (rcu_access_pointer(bcdev->compress)) {
+		put_comp(rcu_dereference_protected(bcdev->compress, true));
+		RCU_INIT_POINTER(bcdev->compress, NULL);
+	}
+
+	if (bcdev->ctl) {
+		free_comp_controller(bcdev->ctl);
+		bcdev->ctl = NULL;
+	}
+
+	if (rcu_access_pointer(bcdev->policy)) {
+		kfree(rcu_dereference_protected(bcdev->policy, true));
+		RCU_INIT_POINTER(bcdev->policy, NULL);
+	}
+
+	if (rcu_access_pointer(bcdev->ranges)) {
+		kvfree(rcu_dereference_protected(bcdev->ranges, true));
+		RCU_INIT_POINTER(bcdev->ranges, NULL);
 	}
 
 	if (bcdev->map) {
@@ -161,15 +391,28 @@ void bcomp_free_dev(struct bcomp_dev *bcdev)
 	}
 
 	if (bcdev->stats) {
-		kfree(bcdev->stats);
+		free_stats(bcdev->stats);
 	}
 
+	if (bcdev->acct)
+		free_cpu_acct(bcdev->acct);
+
+	if (bcdev->blk_locks)
+		kvfree(bcdev->blk_locks);
+
+	if (bcdev->written)
+		kvfree(bcdev->written);
+
+	if (bcdev->bcomp_disk)
+		put_disk(bcdev->bcomp_disk);
+
 	kfree(bcdev);
 }
 
 int bcomp_init_dev(struct user_settings *settings, int major, int free_minor,
 		   struct bcomp_dev *bcdev)
 {
+	struct comp_ctx *cctx = rcu_dereference_protected(bcdev->compress, true);
 	int ret;
 
 	ret = init_map_ops(settings->map_prf, bcdev->map);
@@ -178,38 +421,490 @@ int bcomp_init_dev(struct user_settings *settings, int major, int free_minor,
 		return ret;
 	}
 
-	ret = init_comp_ops(settings->cprf, bcdev->compress);
+	ret = init_comp_ops(settings->cprf, cctx);
 	if (ret) {
 		BCOMP_ERRLOG("current compress profile not implemented");
 	}
 
-	ret = init_under_dev(settings->path, bcdev->under_dev);
+	if (settings->adapt) {
+		bcdev->ctl = alloc_comp_controller(
+			settings->adapt_from_id, settings->adapt_to_id,
+			settings->adapt_backlog, settings->adapt_mbps, cctx);
+		if (!bcdev->ctl) {
+			BCOMP_ERRLOG("compression controller init");
+			return -EINVAL;
+		}
+
+		cctx->max_comp_prf_id = comp_controller_max_id(bcdev->ctl);
+	}
+
+	if (settings->policy) {
+		/* workspaces have to fit the strongest id of the policy too */
+		cctx->max_comp_prf_id =
+			max_t(int, cctx->max_comp_prf_id,
+			      comp_policy_max_id(settings->policy));
+		ret = validate_comp_policy(settings->policy, cctx);
+		if (ret)
+			return ret;
+
+		RCU_INIT_POINTER(bcdev->policy, settings->policy);
+		settings->policy = NULL;
+	}
+
+	ret = init_under_dev(settings->path, settings->stripe, settings->bs,
+			     bcdev->under_dev);
 	if (ret) {
 		BCOMP_ERRLOG("underlying dev init");
 		return ret;
 	}
 
-	ret = init_comp(bcdev->compress, settings->cprf_id, settings->dcprf_id);
+	ret = init_comp(cctx, settings->cprf_id, settings->dcprf_id);
 	if (ret) {
 		BCOMP_ERRLOG("compression profile init");
 		return ret;
 	}
+	cctx->min_saving = settings->min_saving;
+	cctx->acct = bcdev->acct;
+
+	/* first: the superblock stays last whatever else takes space */
+	if (settings->hdr || settings->rebuild) {
+		if (is_mem_path(settings->path) ||
+		    settings->map_prf != LINEAR || settings->meta_mb) {
+			BCOMP_ERRLOG("block headers need a block backend and linear map, without meta");
+			return -EINVAL;
+		}
+
+		bcdev->hdr = alloc_blk_hdr(bcdev, settings->bs);
+		if (!bcdev->hdr) {
+			BCOMP_ERRLOG("block headers init");
+			return -EINVAL;
+		}
+	}
+
+	if (settings->meta_mb) {
+		if (is_mem_path(settings->path) ||
+		    settings->map_prf != LINEAR || settings->log_path ||
+		    settings->hot_threshold) {
+			BCOMP_ERRLOG("meta needs a block backend and linear map, without log and hot");
+			return -EINVAL;
+		}
 
-	ret = init_map(bcdev->map,
-		       get_capacity(bcdev->under_dev->bdev->bd_disk),
-		       settings->bs);
+		bcdev->meta = alloc_meta(bcdev, settings->bs, settings->meta_mb);
+		if (!bcdev->meta) {
+			BCOMP_ERRLOG("metadata area init");
+			return -EINVAL;
+		}
+	}
+
+	if (settings->map_mem_mb) {
+		if (is_mem_path(settings->path) ||
+		    settings->map_prf != LINEAR || bcdev->meta) {
+			BCOMP_ERRLOG("map paging needs a block backend and linear map, without meta");
+			return -EINVAL;
+		}
+
+		bcdev->pager = alloc_map_pager(bcdev, settings->bs,
+					       settings->map_mem_mb);
+		if (!bcdev->pager) {
+			BCOMP_ERRLOG("map pager init");
+			return -EINVAL;
+		}
+
+		bcdev->map->cell_ops = get_map_pager_cell_ops();
+		bcdev->map->cell_ctx = bcdev->pager;
+	}
+
+	ret = init_map(bcdev->map, bcdev->under_dev->nr_sects, settings->bs);
 	if (ret) {
 		BCOMP_ERRLOG("map profile init");
 		return ret;
 	}
 
 	bcdev->bs = settings->bs;
+	bcdev->blk_cnt =
+		DIV_ROUND_UP(bcdev->under_dev->nr_sects,
+			     DIV_ROUND_UP(bcdev->bs, 512));
+
+	bcdev->blk_locks = kvzalloc(BITS_TO_LONGS(bcdev->blk_cnt) *
+					    sizeof(unsigned long),
+				    GFP_KERNEL);
+	if (!bcdev->blk_locks)
+		return -ENOMEM;
 
-	init_disk(bcdev->bcomp_disk, bcdev, major, free_minor);
+	bcdev->written = kvzalloc(BITS_TO_LONGS(bcdev->blk_cnt) *
+					  sizeof(unsigned long),
+				  GFP_KERNEL);
+	if (!bcdev->written)
+		return -ENOMEM;
+	bcdev->sparse = settings->sparse;
+
+	if (is_mem_path(settings->path)) {
+		if (settings->map_prf == DEDUP) {
+			BCOMP_ERRLOG("RAM backend doesn't support dedup map");
+			return -EINVAL;
+		}
+
+		bcdev->under_dev->mem = alloc_mem_store(
+			bcdev->bs, bcdev->blk_cnt, settings->mem_limit_mb);
+		if (!bcdev->under_dev->mem) {
+			BCOMP_ERRLOG("RAM backend init");
+			return -ENOMEM;
+		}
+	}
+
+	if (settings->hot_threshold) {
+		/* shared blocks can't be converted in place */
+		if (settings->map_prf == DEDUP) {
+			BCOMP_ERRLOG("hot/cold tracking is not supported by dedup map");
+			return -EINVAL;
+		}
+
+		bcdev->heat = alloc_heat(bcdev, settings->hot_threshold,
+					 settings->hot_age_sec);
+		if (!bcdev->heat) {
+			BCOMP_ERRLOG("hot/cold tracking init");
+			return -EINVAL;
+		}
+	}
+
+	if (settings->cache_mb) {
+		bcdev->cache = alloc_blk_cache(bcdev, settings->cache_mb);
+		if (!bcdev->cache) {
+			BCOMP_ERRLOG("decompressed-block cache init");
+			return -EINVAL;
+		}
+	}
+
+	if (settings->prefetch) {
+		bcdev->prefetch = alloc_prefetch(bcdev, settings->prefetch);
+		if (!bcdev->prefetch) {
+			BCOMP_ERRLOG("sequential prefetch init");
+			return -EINVAL;
+		}
+	}
+
+	if (settings->wb_mb) {
+		bcdev->wb = alloc_wb(bcdev, settings->wb_mb, settings->wb_rate);
+		if (!bcdev->wb) {
+			BCOMP_ERRLOG("write-back cache init");
+			return -EINVAL;
+		}
+	}
+
+	if (settings->log_path) {
+		if (bcdev->under_dev->mem || settings->map_prf == DEDUP) {
+			BCOMP_ERRLOG("log device needs a block backend and linear map");
+			return -EINVAL;
+		}
+
+		bcdev->log = alloc_log(bcdev, settings->log_path);
+		if (!bcdev->log) {
+			BCOMP_ERRLOG("log device init");
+			return -EINVAL;
+		}
+	}
+
+	bcdev->wq = alloc_workqueue("%s", WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+				    BCOMP_NAME);
+	if (!bcdev->wq)
+		return -ENOMEM;
+
+	if (settings->split) {
+		ret = validate_split(settings->split, settings->bs, cctx);
+		if (ret)
+			return ret;
+
+		/*
+		IMPORTANT:
+			Separate per-cpu wq: sub-streams are queued from bcdev->wq
+			works and waited there, so they can't share its pool.
+		*/
+		bcdev->split_wq = alloc_workqueue("%s_split",
+						  WQ_MEM_RECLAIM | WQ_HIGHPRI,
+						  0, BCOMP_NAME);
+		if (!bcdev->split_wq)
+			return -ENOMEM;
+
+		bcdev->split = settings->split;
+	}
+
+	/* the map is rebuilt before the disk is visible */
+	if (bcdev->meta) {
+		ret = meta_load(bcdev->meta);
+		if (ret) {
+			BCOMP_ERRLOG("metadata load");
+			return ret;
+		}
+	}
+
+	if (settings->mapfile_path) {
+		/* the image is a flat copy of one device */
+		if (bcdev->under_dev->mem || settings->map_prf != LINEAR ||
+		    bcdev->under_dev->nr_members > 1 || bcdev->meta ||
+		    settings->rebuild) {
+			BCOMP_ERRLOG("map file needs one block device and linear map, without meta and rebuild");
+			return -EINVAL;
+		}
+
+		ret = map_file_load(bcdev, settings->mapfile_path);
+		if (ret) {
+			BCOMP_ERRLOG("map file load");
+			return ret;
+		}
+	}
+
+	/* a refused image leaves the device as it was */
+	if (bcdev->hdr) {
+		ret = blk_hdr_load(bcdev->hdr, settings->rebuild);
+		if (ret) {
+			BCOMP_ERRLOG("block header superblock");
+			return ret;
+		}
+
+		if (settings->rebuild) {
+			ret = blk_hdr_rebuild(bcdev->hdr);
+			if (ret) {
+				BCOMP_ERRLOG("map rebuild");
+				return ret;
+			}
+
+			/* raw blocks carry nothing, any of them may be data */
+			bitmap_fill(bcdev->written, bcdev->blk_cnt);
+		}
+	}
+
+	ret = init_disk(bcdev->bcomp_disk, bcdev, major, free_minor);
+	if (ret) {
+		BCOMP_ERRLOG("disk limits init");
+		return ret;
+	}
 
 	return add_disk(bcdev->bcomp_disk);
 }
 
+struct comp_ctx *bcomp_get_comp(struct bcomp_dev *bcdev)
+{
+	struct comp_ctx *cctx;
+
+	/*
+	IMPORTANT:
+		Published ctx always holds the initial reference,
+		bcomp_switch_comp() drops it only after synchronize_rcu().
+	*/
+	rcu_read_lock();
+	cctx = rcu_dereference(bcdev->compress);
+	get_comp(cctx);
+	rcu_read_unlock();
+
+	return cctx;
+}
+
+void bcomp_put_comp(struct comp_ctx *cctx)
+{
+	put_comp(cctx);
+}
+
+/* serialized by kernel_param_lock, the old ctx keeps the device's state */
+static void bcomp_publish_comp(struct bcomp_dev *bcdev, struct comp_ctx *cctx)
+{
+	struct comp_ctx *old = rcu_dereference_protected(bcdev->compress, true);
+
+	cctx->min_saving = old->min_saving;
+	cctx->acct = old->acct;
+
+	rcu_assign_pointer(bcdev->compress, cctx);
+	synchronize_rcu();
+
+	/* in-flight writes drain on the old ctx, the last one frees it */
+	put_comp(old);
+}
+
+int bcomp_switch_comp(struct user_settings *settings, struct bcomp_dev *bcdev)
+{
+	struct comp_ctx *cctx;
+	struct comp_range_table *tbl;
+	struct comp_policy *pol;
+	int ret;
+
+	cctx = kzalloc(sizeof(*cctx), GFP_KERNEL);
+	if (!cctx)
+		return -ENOMEM;
+	kref_init(&cctx->ref);
+
+	ret = init_comp_ops(settings->cprf, cctx);
+	if (ret) {
+		BCOMP_ERRLOG("current compress profile not implemented");
+		goto free_cctx;
+	}
+
+	if (bcdev->ctl) {
+		/* controller keeps its ladder, workspaces have to fit it */
+		for (int i = 0; i < bcdev->ctl->ladder_len; i++) {
+			if (comp_strength(bcdev->ctl->ladder[i], cctx) ==
+			    -EINVAL) {
+				BCOMP_ERRLOG("adapt range is invalid for profile");
+				ret = -EINVAL;
+				goto free_cctx;
+			}
+		}
+		cctx->max_comp_prf_id = comp_controller_max_id(bcdev->ctl);
+	}
+
+	/*
+	IMPORTANT:
+		Callers (module parameters) are serialized by kernel_param_lock.
+	*/
+	pol = rcu_dereference_protected(bcdev->policy, true);
+	if (pol) {
+		cctx->max_comp_prf_id = max_t(int, cctx->max_comp_prf_id,
+					      comp_policy_max_id(pol));
+		ret = validate_comp_policy(pol, cctx);
+		if (ret)
+			goto free_cctx;
+	}
+
+	tbl = rcu_dereference_protected(bcdev->ranges, true);
+	if (tbl) {
+		cctx->max_comp_prf_id = max_t(int, cctx->max_comp_prf_id,
+					      comp_ranges_max_id(tbl));
+		ret = validate_comp_ranges(tbl, cctx);
+		if (ret)
+			goto free_cctx;
+	}
+
+	ret = init_comp(cctx, settings->cprf_id, settings->dcprf_id);
+	if (ret) {
+		BCOMP_ERRLOG("compression profile init");
+		goto free_cctx;
+	}
+
+	bcomp_publish_comp(bcdev, cctx);
+	return 0;
+
+free_cctx:
+	free_comp(cctx);
+	return ret;
+}
+
+/*
+DOC:
+	Policies and range tables loaded at runtime may ask for a stronger id
+	than the workspaces of the active ctx fit (a device mapped with a
+	fast LZ4 id, an HC range). The ctx is then rebuilt with the same ids
+	and workspaces for max_id, published like bcomp_switch_comp() does.
+	An id invalid for the profile is left to the validation.
+ */
+static int bcomp_grow_comp(struct bcomp_dev *bcdev, int max_id)
+{
+	struct comp_ctx *old = rcu_dereference_protected(bcdev->compress, true);
+	struct comp_ctx *cctx;
+	int ret;
+
+	if (max_id <= old->max_comp_prf_id ||
+	    comp_strength(max_id, old) == -EINVAL)
+		return 0;
+
+	cctx = kzalloc(sizeof(*cctx), GFP_KERNEL);
+	if (!cctx)
+		return -ENOMEM;
+	kref_init(&cctx->ref);
+
+	ret = init_comp_ops(old->prf, cctx);
+	if (ret)
+		goto free_cctx;
+
+	cctx->max_comp_prf_id = max_id;
+	ret = init_comp(cctx, old->comp_prf_id, old->decomp_prf_id);
+	if (ret) {
+		BCOMP_ERRLOG("compression workspaces for a stronger id");
+		goto free_cctx;
+	}
+
+	bcomp_publish_comp(bcdev, cctx);
+	return 0;
+
+free_cctx:
+	free_comp(cctx);
+	return ret;
+}
+
+int bcomp_set_policy(struct bcomp_dev *bcdev, struct comp_policy *pol)
+{
+	struct comp_policy *old;
+	struct comp_ctx *cctx;
+	int ret = 0;
+
+	if (pol) {
+		ret = bcomp_grow_comp(bcdev, comp_policy_max_id(pol));
+		if (ret)
+			return ret;
+
+		cctx = bcomp_get_comp(bcdev);
+		ret = validate_comp_policy(pol, cctx);
+		bcomp_put_comp(cctx);
+		if (ret)
+			return ret;
+	}
+
+	/* serialized by kernel_param_lock as bcomp_switch_comp() */
+	old = rcu_replace_pointer(bcdev->policy, pol, true);
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return 0;
+}
+
+int bcomp_set_ranges(struct bcomp_dev *bcdev, struct comp_range_table *tbl)
+{
+	struct comp_range_table *old;
+	struct comp_ctx *cctx;
+	int ret = 0;
+
+	if (tbl) {
+		ret = bcomp_grow_comp(bcdev, comp_ranges_max_id(tbl));
+		if (ret)
+			return ret;
+
+		cctx = bcomp_get_comp(bcdev);
+		ret = validate_comp_ranges(tbl, cctx);
+		bcomp_put_comp(cctx);
+		if (ret)
+			return ret;
+	}
+
+	old = rcu_replace_pointer(bcdev->ranges, tbl, true);
+	if (old)
+		kvfree_rcu(old, rcu);
+
+	return 0;
+}
+
+int bcomp_decomp_cell(struct bcomp_dev *bcdev, struct chunk *chnk,
+		      struct map_cell *cell)
+{
+	struct comp_ctx dctx;
+	struct comp_ctx *cur;
+	int decomp_id = -1;
+	int ret;
+
+	rcu_read_lock();
+	cur = rcu_dereference(bcdev->compress);
+	if (cur->prf == cell->cprf)
+		decomp_id = cur->decomp_prf_id;
+	rcu_read_unlock();
+
+	ret = init_decomp_ctx(&dctx, cell->cprf, decomp_id);
+	if (ret)
+		return ret;
+	dctx.acct = bcdev->acct;
+
+	if (cell->nsub > 1)
+		return split_decomp_chunk(bcdev->split_wq, chnk, cell->lsize,
+					  cell->nsub, &dctx);
+
+	return decomp_src_to_dst(chnk, cell->lsize, &dctx);
+}
+
 // ======== data-path ======== //
 
 /* -------- tools -------- */
@@ -287,6 +982,185 @@ int add_buffer_to_bio(struct buffer *buf, u32 part_to_use, struct bio *bio)
 	return 0;
 }
 
+struct under_member *bcomp_under_map(struct bcomp_dev *bcdev, sector_t pba,
+				     sector_t *sector)
+{
+	struct underlying_dev *under_dev = bcdev->under_dev;
+	u32 bs_sects = DIV_ROUND_UP(bcdev->bs, 512);
+	u64 key, stripe, in_stripe;
+	u32 member;
+
+	if (under_dev->nr_members == 1) {
+		*sector = pba;
+		return &under_dev->members[0];
+	}
+
+	key = bcomp_lba_to_key(bcdev, pba);
+	stripe = div_u64_rem(key, under_dev->stripe_blks, &member);
+	in_stripe = member;
+	member = do_div(stripe, under_dev->nr_members);
+
+	*sector = (stripe * under_dev->stripe_blks + in_stripe) * bs_sects +
+		  (pba - key * bs_sects);
+	return &under_dev->members[member];
+}
+
+u64 bcomp_under_key(struct bcomp_dev *bcdev, u32 member, u64 blk)
+{
+	struct underlying_dev *under_dev = bcdev->under_dev;
+	u64 stripe;
+	u32 in_stripe;
+
+	if (under_dev->nr_members == 1)
+		return blk;
+
+	stripe = div_u64_rem(blk, under_dev->stripe_blks, &in_stripe);
+	return (stripe * under_dev->nr_members + member) *
+		       under_dev->stripe_blks +
+	       in_stripe;
+}
+
+int bcomp_under_flush(struct bcomp_dev *bcdev)
+{
+	struct underlying_dev *under_dev = bcdev->under_dev;
+	int ret = 0;
+	u32 i;
+
+	/* RAM backend has nothing to flush */
+	for (i = 0; i < under_dev->nr_members; i++)
+		ret = blkdev_issue_flush(under_dev->members[i].bdev) ?: ret;
+
+	return ret;
+}
+
+int bcomp_alloc_block_bio(struct bcomp_dev *bcdev, enum req_op op,
+			  sector_t pba, struct buffer *buf,
+			  struct bio **bio_ptr)
+{
+	struct block_device *bdev;
+	sector_t sector;
+	u32 len = bcdev->bs;
+	struct log_rec *rec;
+	struct bio *bio;
+	int ret;
+
+	bdev = bcomp_under_map(bcdev, pba, &sector)->bdev;
+
+	/* the newest copy of a logged block is in the log (pba == lba) */
+	rec = bcdev->log && op == REQ_OP_READ ? log_lookup(bcdev->log, pba) :
+						NULL;
+	if (rec) {
+		bdev = bcdev->log->bdev;
+		sector = rec->sect;
+		len = rec->len;
+	}
+
+	bio = bio_alloc(bdev, DIV_ROUND_UP(bcdev->bs, PAGE_SIZE) + 1, op,
+			GFP_NOIO);
+	if (!bio)
+		return -ENOMEM;
+
+	ret = add_buffer_to_bio(buf, len, bio);
+	if (ret) {
+		bio_put(bio);
+		return ret;
+	}
+
+	bio->bi_iter.bi_sector = sector;
+	*bio_ptr = bio;
+	return 0;
+}
+
+int bcomp_rw_block_sync(struct bcomp_dev *bcdev, enum req_op op,
+			sector_t pba, struct buffer *buf)
+{
+	struct mem_store *mem = bcdev->under_dev->mem;
+	struct bio *bio;
+	int ret;
+
+	if (mem && op == REQ_OP_WRITE)
+		return mem_store_write(mem, bcomp_lba_to_key(bcdev, pba),
+				       buf->data, buf->data_sz);
+
+	if (mem)
+		return mem_store_read(mem, bcomp_lba_to_key(bcdev, pba), buf);
+
+	ret = bcomp_alloc_block_bio(bcdev, op, pba, buf, &bio);
+	if (ret)
+		return ret;
+
+	ret = submit_bio_wait(bio);
+
+	/* home location is current now */
+	if (!ret && bcdev->log && op == REQ_OP_WRITE)
+		log_forget(bcdev->log, pba);
+
+	bio_put(bio);
+	return ret;
+}
+
+int bcomp_read_cell_sync(struct bcomp_dev *bcdev, struct map_cell *cell,
+			 struct chunk **stored_ptr)
+{
+	struct chunk *stored;
+	int ret;
+
+	ret = alloc_chunk(&stored, cell->lsize, bcdev->bs, NULL, NULL);
+	if (ret)
+		return ret;
+
+	ret = bcomp_rw_block_sync(bcdev, REQ_OP_READ, cell->pba, &stored->src);
+	if (ret)
+		goto free_stored;
+
+	stored->src.data_sz = cell->psize;
+	ret = bcomp_decomp_cell(bcdev, stored, cell);
+	if (ret)
+		goto free_stored;
+
+	*stored_ptr = stored;
+	return 0;
+
+free_stored:
+	free_chunk(stored);
+	return ret;
+}
+
+static inline unsigned long *__blk_lock_word(struct bcomp_dev *bcdev,
+					     sector_t lba, int *bit)
+{
+	u64 key = bcomp_lba_to_key(bcdev, lba);
+
+	BUG_ON(key >= bcdev->blk_cnt);
+
+	*bit = key % BITS_PER_LONG;
+	return &bcdev->blk_locks[key / BITS_PER_LONG];
+}
+
+void bcomp_lock_block(struct bcomp_dev *bcdev, sector_t lba)
+{
+	int bit;
+	unsigned long *word = __blk_lock_word(bcdev, lba, &bit);
+
+	wait_on_bit_lock_io(word, bit, TASK_UNINTERRUPTIBLE);
+}
+
+bool bcomp_trylock_block(struct bcomp_dev *bcdev, sector_t lba)
+{
+	int bit;
+	unsigned long *word = __blk_lock_word(bcdev, lba, &bit);
+
+	return !test_and_set_bit_lock(bit, word);
+}
+
+void bcomp_unlock_block(struct bcomp_dev *bcdev, sector_t lba)
+{
+	int bit;
+	unsigned long *word = __blk_lock_word(bcdev, lba, &bit);
+
+	clear_and_wake_up_bit(bit, word);
+}
+
 static inline int __init_req_op(enum req_op *req_op_type, enum req_op op_type)
 {
 	switch (op_type) {
@@ -342,7 +1216,16 @@ static void _free_req_with_chunk(struct bcomp_req *req)
 	    req->entity->data != NULL)
 		free_chunk(req->entity->data);
 
-	bcomp_free_req(req);
+	bcomp_free_req(req);
+}
+
+void bcomp_complete_req(struct bcomp_req *req, blk_status_t status)
+{
+	req->original_bio->bi_status = status;
+	lat_done(req->op_type == REQ_OP_READ ? LAT_READ : LAT_WRITE, req->lat);
+	bio_endio(req->original_bio);
+
+	_free_req_with_chunk(req);
 }
 
 static struct bcomp_req *_create_req(enum req_op op_type,
@@ -354,6 +1237,7 @@ static struct bcomp_req *_create_req(enum req_op op_type,
 	if (!req)
 		return NULL;
 
+	trace_bcomp_req_alloc(original_bio, req);
 	req->op_type = op_type;
 	req->bcdev = bcdev;
 	req->original_bio = original_bio;
@@ -371,75 +1255,159 @@ static struct bcomp_req *_create_req(enum req_op op_type,
 static void write_req_update_statistics(struct stats *stats,
 					struct bcomp_req *req)
 {
-	atomic64_t *compressed_reqs_cnt;
-
-	atomic64_inc(&stats->all_reqs_cnt);
-	atomic64_add(req->entity->data->src.data_sz, &stats->data_in_bytes);
+	enum stat_item compressed_reqs_cnt;
 
-	if ((test_bit(ENTITY_CELL_INITED, &req->entity->flags) &&
-	     req->entity->cell == NULL) ||
-	    req->bcdev->compress->prf == EMPTY) {
-		atomic64_inc(&stats->uncompressed_reqs_cnt);
-	} else {
-		if (!test_bit(ENTITY_CELL_INITED, &req->entity->flags)) {
-			pr_err("Impossible ENTITY_CELL_FLAG");
-			goto end;
-		}
+	stats_inc(stats, STAT_ALL_REQS);
+	stats_add(stats, STAT_DATA_IN_BYTES, req->entity->data->src.data_sz);
 
-		atomic64_add(req->entity->data->dst.data_sz,
-			     &stats->compressed_data_in_bytes);
+	if (!test_bit(ENTITY_CELL_INITED, &req->entity->flags)) {
+		pr_err("Impossible ENTITY_CELL_FLAG");
+		return;
+	}
 
-		switch (get_compression_level(req->entity->cell->psize,
-					      req->entity->cell->lsize)) {
-		case LESS_25_P:
-			compressed_reqs_cnt = &stats->compressed_reqs_cnt_25;
-			break;
+	if (!is_data_compressed(req->entity->cell)) {
+		stats_inc(stats, STAT_UNCOMPRESSED_REQS);
+		return;
+	}
 
-		case LESS_50_P:
-			compressed_reqs_cnt = &stats->compressed_reqs_cnt_50;
-			break;
+	stats_add(stats, STAT_COMPRESSED_DATA_IN_BYTES,
+		  req->entity->data->dst.data_sz);
 
-		case LESS_75_P:
-			compressed_reqs_cnt = &stats->compressed_reqs_cnt_75;
-			break;
+	switch (get_compression_level(req->entity->cell->psize,
+				      req->entity->cell->lsize)) {
+	case LESS_25_P:
+		compressed_reqs_cnt = STAT_COMPRESSED_REQS_25;
+		break;
 
-		case LESS_99_P:
-			compressed_reqs_cnt = &stats->compressed_reqs_cnt_99;
-			break;
+	case LESS_50_P:
+		compressed_reqs_cnt = STAT_COMPRESSED_REQS_50;
+		break;
 
-		default:
-			pr_err("Impossible compressed_reqs_cnt in statistic");
-			goto end;
-		}
+	case LESS_75_P:
+		compressed_reqs_cnt = STAT_COMPRESSED_REQS_75;
+		break;
 
-end:
-		atomic64_inc(compressed_reqs_cnt);
+	default:
+		compressed_reqs_cnt = STAT_COMPRESSED_REQS_99;
+		break;
 	}
+
+	stats_inc(stats, compressed_reqs_cnt);
 }
 
-static void write_req_endio(struct bio *bio)
+/* dedup hit, see dedup_hits_cnt: nothing was compressed, no ratio bucket */
+static void write_req_dup_statistics(struct stats *stats,
+				     struct bcomp_req *req)
 {
-	struct bcomp_req *req = bio->bi_private;
+	stats_inc(stats, STAT_ALL_REQS);
+	stats_add(stats, STAT_DATA_IN_BYTES, req->entity->data->src.data_sz);
+}
 
-	req->original_bio->bi_status = bio->bi_status;
+static void write_req_ctl_end(struct bcomp_req *req, u32 bytes)
+{
+	if (req->bcdev->ctl)
+		comp_controller_end(req->bcdev->ctl, bytes);
+}
+
+static void write_req_end(struct bcomp_req *req, blk_status_t status)
+{
+	req->original_bio->bi_status = status;
 
-	if (bio->bi_status == BLK_STS_OK)
+	if (status == BLK_STS_OK) {
 		write_req_update_statistics(req->bcdev->stats, req);
+		commit_mapping(req->entity->cell, req->fp, req->bcdev->map);
+		bcomp_mark_written(req->bcdev, req->entity->lba);
+	}
+
+	write_req_ctl_end(req, status == BLK_STS_OK ?
+				       req->entity->data->src.data_sz :
+				       0);
+
+	if (status == BLK_STS_OK && req->bcdev->meta) {
+		meta_encode(req->bcdev->meta, req);
+		bcomp_unlock_block(req->bcdev, req->entity->lba);
+		/* acknowledged once the journal entry is durable */
+		meta_journal(req->bcdev->meta, req);
+		return;
+	}
 
+	bcomp_unlock_block(req->bcdev, req->entity->lba);
+
+	lat_done(LAT_WRITE, req->lat);
 	bio_endio(req->original_bio);
 
 	_free_req_with_chunk(req);
+}
+
+static void write_req_endio(struct bio *bio)
+{
+	struct bcomp_req *req = bio->bi_private;
+
+	lat_stamp(req->lat, LAT_UNDER_DONE);
+	trace_bcomp_under_complete(req->original_bio, bio, req->entity->lba);
+
+	/* indexed before the block is unlocked */
+	if (req->log_rec)
+		log_commit(req->bcdev->log, req->log_rec,
+			   bio->bi_status == BLK_STS_OK);
+
+	write_req_end(req, bio->bi_status);
 	bio_put(bio);
 }
 
-static int write_req_init_entity(struct bcomp_req *req)
+/*
+DOC:
+	Level of a write, the first rule that applies wins:
+		LBA range -> hot block (raw) -> request class ->
+		controller/fixed comp_prf_id.
+	The controller still accounts every write as a part of the backlog.
+ */
+static int write_req_pick_level(struct bcomp_req *req, struct comp_ctx *cctx)
 {
-	struct chunk *chnk;
+	struct bcomp_dev *bcdev = req->bcdev;
+	sector_t lba = req->original_bio->bi_iter.bi_sector;
+	struct comp_range_table *tbl;
+	struct comp_policy *pol;
+	int action = POLICY_DEFAULT;
+	int comp_id;
+
+	comp_id = bcdev->ctl ? comp_controller_start(bcdev->ctl) :
+			       cctx->comp_prf_id;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(bcdev->ranges);
+	if (tbl)
+		action = comp_ranges_action(tbl, lba);
+
+	if (bcdev->heat) {
+		if (action == POLICY_DEFAULT && heat_write_raw(bcdev->heat, lba))
+			action = POLICY_RAW;
+		else if (action != POLICY_DEFAULT)
+			heat_clear_raw(bcdev->heat, lba);
+	}
+
+	pol = rcu_dereference(bcdev->policy);
+	if (pol && action == POLICY_DEFAULT)
+		action = comp_policy_action(pol, req->original_bio);
+	rcu_read_unlock();
+
+	return action == POLICY_DEFAULT ? comp_id : action;
+}
+
+/* profiles without caller-allocated dst (EMPTY) can be switched to at runtime */
+static bool write_req_use_split(struct bcomp_req *req, struct comp_ctx *cctx)
+{
+	return req->bcdev->split && cctx->ops->get_dst_buf_sz;
+}
+
+static int write_req_compress(struct bcomp_req *req, struct comp_ctx *cctx)
+{
+	struct chunk *chnk = req->entity->data;
 	struct map_cell *cell;
 	struct bcomp_dev *bcdev = req->bcdev;
-	struct bio *original_bio = req->original_bio;
-	unsigned int payload_size = original_bio->bi_iter.bi_size;
-	unsigned int lba = original_bio->bi_iter.bi_sector;
+	sector_t lba = req->entity->lba;
+	u64 start = 0;
+	int comp_id;
 	int ret;
 
 	/*
@@ -452,122 +1420,434 @@ static int write_req_init_entity(struct bcomp_req *req)
 			(combine many cell-chunk into one buffer, then write it)
 	*/
 
-	/* ALLOCATION */
-	ret = allocate_chunk_for_comp(&chnk, payload_size, bcdev->bs,
-				      bcdev->compress);
-	if (ret)
-		return ret;
+	/* LEVEL */
+	comp_id = write_req_pick_level(req, cctx);
+	req->comp_prf_id = comp_id == POLICY_RAW ? cctx->comp_prf_id : comp_id;
 
-	copy_sg_to_buf(&chnk->src, original_bio);
+	/* raw bypass: nothing is useful, the compressor stores the block as is */
+	if (comp_id == POLICY_RAW)
+		chnk->dst_limit = 0;
 
 	/* COMMPRESSION */
-	ret = comp_src_to_dst(chnk, bcdev->compress);
+	if (trace_bcomp_compress_enabled())
+		start = ktime_get_ns();
+
+	if (write_req_use_split(req, cctx))
+		ret = split_comp_chunk(bcdev->split_wq, chnk, req->comp_prf_id,
+				       bcdev->split, cctx);
+	else
+		ret = comp_src_to_dst_id(chnk, req->comp_prf_id, cctx);
+
+	trace_bcomp_compress(req->original_bio, lba, cctx->prf,
+			     req->comp_prf_id, chnk->src.data_sz,
+			     ret ? 0 : chnk->dst.data_sz,
+			     start ? ktime_get_ns() - start : 0, ret);
 	if (ret) {
 		BCOMP_ERRLOG("Compression failed");
-		goto free_chnk;
+		goto end_ctl;
 	}
+	lat_stamp(req->lat, LAT_COMPRESS);
 
 	/* MAPPING */
 	BUG_ON(!test_bit(BFA_INITIALIZED, &(chnk->dst.flags)));
 	ret = update_mapping(&cell, lba, chnk->src.data_sz, chnk->dst.data_sz,
 			     bcdev->map);
+	trace_bcomp_map_update(req->original_bio, lba,
+			       ret ? 0 : map_cell_pba(cell, lba),
+			       !ret && cell ? cell->psize : 0, ret);
 	if (ret) {
 		BCOMP_ERRLOG("compression: Map failed");
-		goto free_chnk;
+		goto end_ctl;
 	}
+	lat_stamp(req->lat, LAT_MAP);
 
 	if (!is_data_compressed(cell)) {
 		link_data(chnk->src.buf_sz, chnk->src.data, false, &chnk->dst);
 		chnk->dst.data_sz = chnk->src.data_sz;
+	} else {
+		cell->cprf = cctx->prf;
+		cell->comp_prf_id = req->comp_prf_id;
+		cell->nsub = write_req_use_split(req, cctx) ? bcdev->split : 0;
+		cell->wtime = ktime_get_seconds();
 	}
 
 	/* MAP_ENTITY INITIALIZATION */
+	add_cell_to_entity(cell, req->entity);
+	return 0;
+
+end_ctl:
+	write_req_ctl_end(req, 0);
+	return ret;
+}
+
+static int write_req_init_entity(struct bcomp_req *req)
+{
+	struct comp_ctx *cctx;
+	struct chunk *chnk;
+	struct bcomp_dev *bcdev = req->bcdev;
+	struct bio *original_bio = req->original_bio;
+	unsigned int payload_size = original_bio->bi_iter.bi_size;
+	unsigned int lba = original_bio->bi_iter.bi_sector;
+	int ret;
+
+	cctx = bcomp_get_comp(bcdev);
+
+	/* ALLOCATION (dst.buf_sz == bs, output bounded by comp_useful_size()) */
+	ret = allocate_chunk_for_comp(&chnk, payload_size, bcdev->bs, cctx);
+	if (ret)
+		goto put_cctx;
+
+	copy_sg_to_buf(&chnk->src, original_bio);
+	lat_stamp(req->lat, LAT_ALLOC);
+
 	req->entity->lba = lba;
 	add_data_to_entity(chnk, req->entity);
-	add_cell_to_entity(cell, req->entity);
 
+	/* DEDUPLICATION (the candidate is verified by write_req_dedup_work) */
+	if (map_has_dedup(bcdev->map)) {
+		req->fp = xxh64(chnk->src.data, chnk->src.data_sz, 0);
+		ret = find_dup_mapping(&req->dup, req->fp, bcdev->map);
+		if (ret)
+			goto free_chnk;
+
+		if (req->dup) {
+			req->cctx = cctx;
+			return 0;
+		}
+	}
+
+	ret = write_req_compress(req, cctx);
+	if (ret)
+		goto free_chnk;
+
+	bcomp_put_comp(cctx);
 	return 0;
 
 free_chnk:
 	free_chunk(chnk);
+put_cctx:
+	bcomp_put_comp(cctx);
 	return ret;
 }
 
+static blk_status_t write_req_submit_entity(struct bcomp_req *req)
+{
+	struct bcomp_dev *bcdev = req->bcdev;
+	struct block_device *bdev;
+	sector_t pba;
+	u32 len = bcdev->bs;
+	struct bio *new_bio;
+	blk_status_t status;
+	int ret;
+
+	/* RAM backend: no bio round-trip, the request completes here */
+	if (bcdev->under_dev->mem) {
+		lat_stamp(req->lat, LAT_UNDER_SUBMIT);
+		ret = bcomp_rw_block_sync(bcdev, REQ_OP_WRITE,
+					  req->entity->cell->pba,
+					  &req->entity->data->dst);
+		lat_stamp(req->lat, LAT_UNDER_DONE);
+		write_req_end(req, errno_to_blk_status(ret));
+		return BLK_STS_OK;
+	}
+
+	bdev = bcomp_under_map(bcdev,
+			       map_cell_pba(req->entity->cell, req->entity->lba),
+			       &pba)->bdev;
+
+	if (bcdev->hdr)
+		blk_hdr_stamp(bcdev->hdr, req->entity->cell,
+			      &req->entity->data->dst);
+
+	/* only the compressed size goes to the log */
+	if (bcdev->log) {
+		req->log_rec = log_reserve(bcdev->log, req->entity->lba,
+					   req->entity->data->dst.data_sz);
+		if (req->log_rec) {
+			bdev = bcdev->log->bdev;
+			pba = req->log_rec->sect;
+			len = req->log_rec->len;
+		}
+	}
+
+	new_bio = bio_alloc(bdev, __bio_size_to_bio_pages(req->original_bio),
+			    req->op_type, GFP_NOIO);
+	if (!new_bio) {
+		status = BLK_STS_RESOURCE;
+		goto cancel_log;
+	}
+
+	if (add_buffer_to_bio(&req->entity->data->dst, len, new_bio)) {
+		bio_put(new_bio);
+		status = BLK_STS_IOERR;
+		goto cancel_log;
+	}
+
+	new_bio->bi_end_io = write_req_endio;
+	new_bio->bi_private = req;
+	new_bio->bi_iter.bi_sector = pba;
+
+	lat_stamp(req->lat, LAT_UNDER_SUBMIT);
+	trace_bcomp_under_submit(req->original_bio, new_bio, req->entity->lba);
+	submit_bio_noacct(new_bio);
+	return BLK_STS_OK;
+
+cancel_log:
+	if (req->log_rec) {
+		log_commit(bcdev->log, req->log_rec, false);
+		req->log_rec = NULL;
+	}
+	return status;
+}
+
+/*
+DOC:
+	Dedup candidate: the stored block is read back and compared byte by
+	byte. It can't be waited for inside submit_bio (bios submitted there
+	are only dispatched after it returns), so it runs on bcdev->wq.
+ */
+static bool bcomp_verify_dup(struct bcomp_dev *bcdev, struct buffer *data,
+			     struct map_cell *cell)
+{
+	struct chunk *stored;
+	bool same = false;
+
+	if (cell->lsize != data->data_sz)
+		return false;
+
+	if (alloc_chunk(&stored, cell->lsize, bcdev->bs, NULL, NULL))
+		return false;
+
+	if (bcomp_rw_block_sync(bcdev, REQ_OP_READ, cell->pba, &stored->src))
+		goto free_stored;
+
+	if (is_data_compressed(cell)) {
+		stored->src.data_sz = cell->psize;
+		if (bcomp_decomp_cell(bcdev, stored, cell))
+			goto free_stored;
+
+		same = !memcmp(stored->dst.data, data->data, cell->lsize);
+	} else {
+		same = !memcmp(stored->src.data, data->data, cell->lsize);
+	}
+
+free_stored:
+	free_chunk(stored);
+	return same;
+}
+
+static void write_req_dedup_work(struct work_struct *work)
+{
+	struct bcomp_req *req = container_of(work, struct bcomp_req, work);
+	struct bcomp_dev *bcdev = req->bcdev;
+	struct bio *original_bio = req->original_bio;
+	struct map_cell *dup = req->dup;
+	struct comp_ctx *cctx = req->cctx;
+	sector_t lba = req->entity->lba;
+	blk_status_t status = BLK_STS_IOERR;
+	int ret;
+
+	req->dup = NULL;
+	req->cctx = NULL;
+
+	if (bcomp_verify_dup(bcdev, &req->entity->data->src, dup)) {
+		/* HIT: neither compression nor the underlying write */
+		ret = link_dup_mapping(lba, dup, bcdev->map);
+		bcomp_put_comp(cctx);
+		if (ret) {
+			put_dup_mapping(dup, bcdev->map);
+			goto free_req;
+		}
+
+		write_req_dup_statistics(bcdev->stats, req);
+		bcomp_mark_written(bcdev, lba);
+		status = BLK_STS_OK;
+		goto free_req;
+	}
+
+	put_dup_mapping(dup, bcdev->map);
+
+	ret = write_req_compress(req, cctx);
+	bcomp_put_comp(cctx);
+	if (ret)
+		goto free_req;
+
+	status = write_req_submit_entity(req);
+	if (status == BLK_STS_OK)
+		return;
+
+	write_req_ctl_end(req, 0);
+free_req:
+	lat_done(LAT_WRITE, req->lat);
+	_free_req_with_chunk(req);
+	bcomp_unlock_block(bcdev, lba);
+	original_bio->bi_status = status;
+	bio_endio(original_bio);
+}
+
 static blk_status_t write_req_submit(enum req_op op_type,
 				     struct bio *original_bio)
 {
 	struct bcomp_dev *bcdev = original_bio->bi_bdev->bd_disk->private_data;
 	struct bcomp_req *req;
-	struct bio *new_bio;
-	sector_t pba;
 	blk_status_t status;
+	u64 submit = lat_now(); // the block lock wait included
+
+	bcomp_lock_block(bcdev, original_bio->bi_iter.bi_sector);
+
+	/* discarded while destaging: the block must stay released */
+	if (bcdev->wb && wb_dropped(bcdev->wb, original_bio)) {
+		bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
+		bio_endio(original_bio);
+		return BLK_STS_OK;
+	}
 
-	new_bio = bio_alloc(bcdev->under_dev->bdev,
-			    __bio_size_to_bio_pages(original_bio), op_type,
-			    GFP_NOIO);
-	if (!new_bio)
-		return BLK_STS_RESOURCE;
+	if (bcdev->pager && map_pager_park(bcdev->pager,
+					   original_bio->bi_iter.bi_sector,
+					   original_bio)) {
+		bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
+		return BLK_STS_OK;
+	}
+
+	if (bcdev->cache)
+		blk_cache_invalidate(bcdev->cache,
+				     original_bio->bi_iter.bi_sector);
 
 	req = _create_req(op_type, bcdev, original_bio, write_req_init_entity);
 	if (!req) {
 		status = BLK_STS_IOERR;
-		goto put_new_bio;
+		goto unlock_block;
 	}
+	req->lat[LAT_SUBMIT] = submit;
 
-	if (add_buffer_to_bio(&req->entity->data->dst, bcdev->bs, new_bio)) {
-		status = BLK_STS_IOERR;
-		goto free_write_req;
+	if (req->dup) {
+		INIT_WORK(&req->work, write_req_dedup_work);
+		queue_work(bcdev->wq, &req->work);
+		return BLK_STS_OK;
 	}
 
-	if (is_data_compressed(req->entity->cell))
-		pba = req->entity->cell->pba;
-	else
-		pba = original_bio->bi_iter.bi_sector;
-
-	new_bio->bi_end_io = write_req_endio;
-	new_bio->bi_private = req;
-	new_bio->bi_iter.bi_sector = pba;
+	status = write_req_submit_entity(req);
+	if (status != BLK_STS_OK)
+		goto free_write_req;
 
-	submit_bio_noacct(new_bio);
 	return BLK_STS_OK;
 
 free_write_req:
+	write_req_ctl_end(req, 0);
 	_free_req_with_chunk(req);
-put_new_bio:
-	bio_put(new_bio);
+unlock_block:
+	bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
 	return status;
 }
 
 /* -------- read-request -------- */
 
+static void read_req_end(struct bcomp_req *req)
+{
+	struct bio *original_bio = req->original_bio;
+	struct stats *stats = req->bcdev->stats;
+
+	if (original_bio->bi_status != BLK_STS_OK)
+		stats_inc(stats, STAT_READ_ERRORS);
+	else if (is_data_compressed(req->entity->cell))
+		stats_inc(stats, STAT_READ_DECOMP_REQS);
+	else
+		stats_inc(stats, STAT_READ_RAW_REQS);
+
+	bcomp_unlock_block(req->bcdev, req->entity->lba);
+	lat_done(LAT_READ, req->lat);
+	bio_endio(original_bio);
+
+	_free_req_with_chunk(req);
+}
+
+static int read_req_decomp(struct bcomp_req *req)
+{
+	struct chunk *chnk = req->entity->data;
+	struct map_cell *cell = req->entity->cell;
+	u64 start = 0;
+	int ret;
+
+	if (trace_bcomp_decompress_enabled())
+		start = ktime_get_ns();
+
+	chnk->src.data_sz = cell->psize;
+	ret = bcomp_decomp_cell(req->bcdev, chnk, cell);
+	trace_bcomp_decompress(req->original_bio, req->entity->lba, cell->cprf,
+			       cell->comp_prf_id, cell->lsize, cell->psize,
+			       start ? ktime_get_ns() - start : 0, ret);
+	if (ret)
+		return -EIO;
+	lat_stamp(req->lat, LAT_DECOMP);
+
+	copy_buf_to_sg(&(chnk->dst), req->original_bio);
+
+	if (req->bcdev->cache)
+		blk_cache_insert(req->bcdev->cache, req->entity->lba,
+				 chnk->dst.data, chnk->dst.data_sz, false);
+	return 0;
+}
+
+/* split blocks wait for sub-streams, that can't be done in end_io */
+static void read_req_split_work(struct work_struct *work)
+{
+	struct bcomp_req *req = container_of(work, struct bcomp_req, work);
+
+	if (read_req_decomp(req))
+		req->original_bio->bi_status = BLK_STS_IOERR;
+
+	read_req_end(req);
+}
+
 static void read_req_endio(struct bio *bio)
 {
 	struct bcomp_req *req = bio->bi_private;
-	struct chunk *chnk = req->entity->data;
 	struct map_cell *cell = req->entity->cell;
 	struct bio *original_bio = req->original_bio;
 
+	lat_stamp(req->lat, LAT_UNDER_DONE);
+	trace_bcomp_under_complete(original_bio, bio, req->entity->lba);
 	original_bio->bi_status = bio->bi_status;
+	bio_put(bio);
 
-	if (bio->bi_status != BLK_STS_OK)
+	if (original_bio->bi_status != BLK_STS_OK ||
+	    !is_data_compressed(cell))
 		goto end_original_bio;
 
-	if (is_data_compressed(cell)) {
-		chnk->src.data_sz = cell->psize;
-		if (decomp_src_to_dst(chnk, cell->lsize,
-				      req->bcdev->compress)) {
-			original_bio->bi_status = BLK_STS_IOERR;
-			goto end_original_bio;
-		}
-
-		copy_buf_to_sg(&(chnk->dst), original_bio);
+	if (cell->nsub > 1) {
+		INIT_WORK(&req->work, read_req_split_work);
+		queue_work(req->bcdev->wq, &req->work);
+		return;
 	}
 
+	if (read_req_decomp(req))
+		original_bio->bi_status = BLK_STS_IOERR;
+
 end_original_bio:
-	bio_endio(original_bio);
+	read_req_end(req);
+}
 
-	_free_req_with_chunk(req);
-	bio_put(bio);
+/* RAM backend: the request completes synchronously */
+static void read_req_mem(struct bcomp_req *req)
+{
+	struct mem_store *mem = req->bcdev->under_dev->mem;
+	struct map_cell *cell = req->entity->cell;
+	u64 key = bcomp_lba_to_key(req->bcdev, cell->pba);
+	int ret;
+
+	lat_stamp(req->lat, LAT_UNDER_SUBMIT);
+	if (is_data_compressed(cell)) {
+		ret = mem_store_read(mem, key, &req->entity->data->src);
+		lat_stamp(req->lat, LAT_UNDER_DONE);
+		if (!ret)
+			ret = read_req_decomp(req);
+	} else {
+		ret = mem_store_read_bio(mem, key, req->original_bio);
+		lat_stamp(req->lat, LAT_UNDER_DONE);
+	}
+
+	req->original_bio->bi_status = errno_to_blk_status(ret);
+	read_req_end(req);
 }
 
 static int read_req_init_entity(struct bcomp_req *req)
@@ -581,10 +1861,21 @@ static int read_req_init_entity(struct bcomp_req *req)
 
 	/* MAPPING */
 	ret = get_mapping(&cell, lba, bcdev->map);
-	if (ret) {
+	trace_bcomp_map_lookup(original_bio, lba,
+			       ret ? 0 : map_cell_pba(cell, lba),
+			       !ret && is_data_compressed(cell) ?
+				       cell->psize :
+				       0,
+			       ret);
+	if (ret == -ENODATA) {
+		/* never written: nothing to read */
+		assign_bit(ENTITY_HOLE, &req->entity->flags, true);
+		cell = NULL;
+	} else if (ret) {
 		BCOMP_ERRLOG("decompression: Map failed");
 		return ret;
 	}
+	lat_stamp(req->lat, LAT_MAP);
 
 	if (is_data_compressed(cell)) {
 		/*
@@ -609,20 +1900,85 @@ static blk_status_t read_req_submit(enum req_op op_type,
 				    struct bio *original_bio)
 {
 	struct bcomp_dev *bcdev = original_bio->bi_bdev->bd_disk->private_data;
+	struct block_device *bdev;
+	struct under_member *m;
+	struct log_rec *rec = NULL;
 	struct bio *new_bio;
 	struct bcomp_req *req;
 	sector_t pba;
 	blk_status_t status;
+	u64 submit = lat_now();
+
+	stats_inc(bcdev->stats, STAT_READ_REQS);
+	stats_add(bcdev->stats, STAT_READ_BYTES, original_bio->bi_iter.bi_size);
+
+	bcomp_lock_block(bcdev, original_bio->bi_iter.bi_sector);
+
+	if ((bcdev->wb && wb_read(bcdev->wb, original_bio->bi_iter.bi_sector,
+				  original_bio)) ||
+	    (bcdev->cache && blk_cache_read(bcdev->cache,
+					    original_bio->bi_iter.bi_sector,
+					    original_bio))) {
+		bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
+		bio_endio(original_bio);
+		return BLK_STS_OK;
+	}
+
+	/* whatever the device holds there was never written through us */
+	if (bcomp_blk_unwritten(bcdev, original_bio->bi_iter.bi_sector)) {
+		bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
+		stats_inc(bcdev->stats, STAT_UNWRITTEN_READS);
+		zero_fill_bio(original_bio);
+		bio_endio(original_bio);
+		return BLK_STS_OK;
+	}
+
+	if (bcdev->pager && map_pager_park(bcdev->pager,
+					   original_bio->bi_iter.bi_sector,
+					   original_bio)) {
+		bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
+		return BLK_STS_OK;
+	}
 
 	req = _create_req(op_type, bcdev, original_bio, read_req_init_entity);
-	if (!req)
+	if (!req) {
+		bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
 		return BLK_STS_IOERR;
+	}
+	req->lat[LAT_SUBMIT] = submit;
 
 	BUG_ON(!test_bit(ENTITY_CELL_INITED, &req->entity->flags));
 
+	if (test_bit(ENTITY_HOLE, &req->entity->flags)) {
+		zero_fill_bio(original_bio);
+		_free_req_with_chunk(req);
+		bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
+		bio_endio(original_bio);
+		return BLK_STS_OK;
+	}
+
+	if (bcdev->under_dev->mem) {
+		read_req_mem(req);
+		return BLK_STS_OK;
+	}
+
+	m = bcomp_under_map(bcdev,
+			    map_cell_pba(req->entity->cell,
+					 original_bio->bi_iter.bi_sector),
+			    &pba);
+	bdev = m->bdev;
+
+	if (bcdev->log) {
+		rec = log_lookup(bcdev->log, original_bio->bi_iter.bi_sector);
+		if (rec) {
+			bdev = bcdev->log->bdev;
+			pba = rec->sect;
+			atomic64_inc(&bcdev->log->read_hits_cnt);
+		}
+	}
+
 	if (is_data_compressed(req->entity->cell)) {
-		new_bio = bio_alloc(bcdev->under_dev->bdev,
-				    __bio_size_to_bio_pages(original_bio),
+		new_bio = bio_alloc(bdev, __bio_size_to_bio_pages(original_bio),
 				    op_type, GFP_NOIO);
 
 		if (!new_bio) {
@@ -630,24 +1986,21 @@ static blk_status_t read_req_submit(enum req_op op_type,
 			goto free_read_req;
 		}
 
-		if (add_buffer_to_bio(&req->entity->data->src, bcdev->bs,
-				      new_bio)) {
+		if (add_buffer_to_bio(&req->entity->data->src,
+				      rec ? rec->len : bcdev->bs, new_bio)) {
 			status = BLK_STS_IOERR;
 			goto free_bio;
 		}
 
-		pba = req->entity->cell->pba;
-
 	} else {
-		new_bio = bio_alloc_clone(bcdev->under_dev->bdev, original_bio,
-					  GFP_NOIO, bcdev->under_dev->bset);
+		new_bio = bio_alloc_clone(bdev, original_bio, GFP_NOIO,
+					  m->bset);
 
 		if (!new_bio) {
 			status = BLK_STS_RESOURCE;
 			goto free_read_req;
 		}
 
-		pba = original_bio->bi_iter.bi_sector;
 		new_bio->bi_iter.bi_size = original_bio->bi_iter.bi_size;
 	}
 
@@ -655,6 +2008,8 @@ static blk_status_t read_req_submit(enum req_op op_type,
 	new_bio->bi_private = req;
 	new_bio->bi_iter.bi_sector = pba;
 
+	lat_stamp(req->lat, LAT_UNDER_SUBMIT);
+	trace_bcomp_under_submit(original_bio, new_bio, req->entity->lba);
 	submit_bio_noacct(new_bio);
 
 	return BLK_STS_OK;
@@ -663,9 +2018,40 @@ free_bio:
 	bio_put(new_bio);
 free_read_req:
 	_free_req_with_chunk(req);
+	bcomp_unlock_block(bcdev, original_bio->bi_iter.bi_sector);
 	return status;
 }
 
+/* -------- discard -------- */
+
+static void bcomp_discard(struct bcomp_dev *bcdev, struct bio *original_bio)
+{
+	sector_t bs_in_sectors = DIV_ROUND_UP(bcdev->bs, SECTOR_SIZE);
+	sector_t lba = round_up(original_bio->bi_iter.bi_sector, bs_in_sectors);
+	sector_t end = bio_end_sector(original_bio);
+	blk_status_t status = BLK_STS_OK;
+
+	end = min_t(sector_t, end, bcdev->blk_cnt * bs_in_sectors);
+
+	/* only whole blocks are released, partial ones keep their data */
+	for (; lba + bs_in_sectors <= end; lba += bs_in_sectors) {
+		bcomp_lock_block(bcdev, lba);
+		if (bcdev->cache)
+			blk_cache_invalidate(bcdev->cache, lba);
+		if (bcdev->log)
+			log_forget(bcdev->log, lba);
+		if (bcdev->wb)
+			wb_discard(bcdev->wb, lba);
+		if (discard_mapping(lba, bcdev->map))
+			status = BLK_STS_IOERR;
+		bcomp_unlock_block(bcdev, lba);
+		cond_resched();
+	}
+
+	original_bio->bi_status = status;
+	bio_endio(original_bio);
+}
+
 /* -------- bio -------- */
 
 void bcomp_submit_bio(struct bio *original_bio)
@@ -673,6 +2059,27 @@ void bcomp_submit_bio(struct bio *original_bio)
 	struct bcomp_dev *bcdev = original_bio->bi_bdev->bd_disk->private_data;
 	enum req_op op_type = bio_op(original_bio);
 
+	trace_bcomp_bio_submit(original_bio);
+
+	if (READ_ONCE(bcdev->last_io) != jiffies)
+		WRITE_ONCE(bcdev->last_io, jiffies);
+
+	if (op_type == REQ_OP_DISCARD && map_can_discard(bcdev->map)) {
+		bcomp_discard(bcdev, original_bio);
+		return;
+	}
+
+	if ((original_bio->bi_opf & REQ_PREFLUSH) &&
+	    !wb_owns_bio(original_bio)) {
+		if (bcdev->wb && wb_flush(bcdev->wb))
+			goto submit_bio_with_err;
+
+		if (!original_bio->bi_iter.bi_size) {
+			bio_endio(original_bio);
+			return;
+		}
+	}
+
 	if (original_bio->bi_iter.bi_size != bcdev->bs) {
 		/*
 		TODO:(#MINDIT) [ implemetation features, SUPPORTED_BS ]
@@ -684,8 +2091,20 @@ void bcomp_submit_bio(struct bio *original_bio)
 		goto submit_bio_with_err;
 	}
 
+	if (bcdev->heat && (op_type == REQ_OP_WRITE || op_type == REQ_OP_READ))
+		heat_touch(bcdev->heat, original_bio->bi_iter.bi_sector);
+
+	if (bcdev->prefetch && op_type == REQ_OP_READ)
+		prefetch_read(bcdev->prefetch, original_bio->bi_iter.bi_sector);
+
 	switch (op_type) {
 	case REQ_OP_WRITE:
+		if (bcdev->wb && !wb_owns_bio(original_bio)) {
+			if (wb_write(bcdev->wb, original_bio))
+				goto submit_bio_with_err;
+			return;
+		}
+
 		if (write_req_submit(op_type, original_bio) == BLK_STS_OK)
 			return;
 		goto submit_bio_with_err;
@@ -4,12 +4,15 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/bio.h>
+#include <linux/debugfs.h>
 #include <linux/blkdev.h>
 #include <linux/types.h>
 
 #include "include/bcomp.h"
 #include "include/settings.h"
 #include "include/stats.h"
+#include "include/recompress.h"
+#include "include/lat_hist.h"
 
 static int bcomp_major;
 
@@ -17,6 +20,8 @@ static int bcomp_free_minor = INIT_MINOR;
 
 static struct bcomp_dev *bcomp_dev = NULL;
 
+static struct dentry *bcomp_debugfs; // latency, cpu_time
+
 // ======== creation ======== //
 
 static int bcomp_disk_create(const char *arg, const struct kernel_param *kp)
@@ -53,6 +58,7 @@ static int bcomp_disk_create(const char *arg, const struct kernel_param *kp)
 
 	++bcomp_free_minor;
 	bcomp_dev = bcdev;
+	cpu_acct_debugfs(bcdev->acct, bcomp_debugfs);
 
 	free_user_settings(settings);
 
@@ -69,13 +75,30 @@ free_settings:
 
 static int bcomp_disk_info(char *buf, const struct kernel_param *kp)
 {
+	struct underlying_dev *under_dev;
+	struct block_device *bdev;
+	int len;
+	u32 i;
+
 	if (bcomp_dev == NULL) {
 		BCOMP_ERRLOG("no mapped device");
 		return -ENODEV;
 	}
 
-	return sysfs_emit(buf, "%s:%s\n", bcomp_dev->bcomp_disk->disk_name,
-			  bcomp_dev->under_dev->bdev->bd_disk->disk_name);
+	under_dev = bcomp_dev->under_dev;
+	if (under_dev->mem)
+		return sysfs_emit(buf, "%s:mem\n",
+				  bcomp_dev->bcomp_disk->disk_name);
+
+	len = sysfs_emit(buf, "%s:", bcomp_dev->bcomp_disk->disk_name);
+	for (i = 0; i < under_dev->nr_members; i++) {
+		bdev = under_dev->members[i].bdev;
+		len += sysfs_emit_at(buf, len, "%s%c", bdev->bd_disk->disk_name,
+				     i + 1 < under_dev->nr_members ?
+					     UNDER_PATH_DELIMITER : '\n');
+	}
+
+	return len;
 }
 
 static const struct kernel_param_ops bcomp_map_ops = {
@@ -107,27 +130,102 @@ static const struct kernel_param_ops bcomp_unmap_ops = {
 static int bcomp_reset_stats(const char *arg, const struct kernel_param *kp)
 {
 	reset_stats(bcomp_dev->stats);
+	reset_cpu_acct_stats(bcomp_dev->acct);
+
+	if (bcomp_dev->ctl)
+		reset_comp_controller_stats(bcomp_dev->ctl);
+
+	if (bcomp_dev->recomp)
+		reset_recomp_stats(bcomp_dev->recomp);
+
+	if (bcomp_dev->heat)
+		reset_heat_stats(bcomp_dev->heat);
+
+	if (bcomp_dev->cache)
+		reset_blk_cache_stats(bcomp_dev->cache);
+
+	if (bcomp_dev->prefetch)
+		reset_prefetch_stats(bcomp_dev->prefetch);
+
+	if (bcomp_dev->under_dev->mem)
+		reset_mem_store_stats(bcomp_dev->under_dev->mem);
+
+	if (bcomp_dev->wb)
+		reset_wb_stats(bcomp_dev->wb);
+
+	if (bcomp_dev->log)
+		reset_log_stats(bcomp_dev->log);
+
+	if (bcomp_dev->meta)
+		reset_meta_stats(bcomp_dev->meta);
+
+	if (bcomp_dev->hdr)
+		reset_blk_hdr_stats(bcomp_dev->hdr);
+
+	if (bcomp_dev->pager)
+		reset_map_pager_stats(bcomp_dev->pager);
+
+	reset_map_stats(bcomp_dev->map);
+
 	return 0;
 }
 
+static int bcomp_get_ctl_stats(char *buf, int at, struct comp_controller *ctl)
+{
+	return sysfs_emit_at(buf, at, PRITTY_CTL_STATS_TEMPLATE,
+			     comp_controller_cur_id(ctl),
+			     atomic_read(&ctl->inflight),
+			     atomic64_read(&ctl->stronger_cnt),
+			     atomic64_read(&ctl->faster_cnt));
+}
+
 static int bcomp_get_stats(char *buf, const struct kernel_param *kp)
 {
-	struct stats *st;
+	int len;
 
 	if (bcomp_dev == NULL || bcomp_dev->stats == NULL) {
 		return -ENODEV;
 	}
 
-	st = bcomp_dev->stats;
-	return sysfs_emit(buf, PRITTY_STATS_TEMPLATE,
-			  atomic64_read(&st->compressed_reqs_cnt_25),
-			  atomic64_read(&st->compressed_reqs_cnt_50),
-			  atomic64_read(&st->compressed_reqs_cnt_75),
-			  atomic64_read(&st->compressed_reqs_cnt_99),
-			  atomic64_read(&st->uncompressed_reqs_cnt),
-			  atomic64_read(&st->all_reqs_cnt),
-			  atomic64_read(&st->data_in_bytes),
-			  atomic64_read(&st->compressed_data_in_bytes));
+	len = stats_emit(buf, 0, bcomp_dev->stats);
+	len += cpu_acct_stats_emit(buf, len, bcomp_dev->acct);
+
+	if (bcomp_dev->ctl)
+		len += bcomp_get_ctl_stats(buf, len, bcomp_dev->ctl);
+
+	if (bcomp_dev->recomp)
+		len += recomp_stats_emit(buf, len, bcomp_dev->recomp);
+
+	if (bcomp_dev->heat)
+		len += heat_stats_emit(buf, len, bcomp_dev->heat);
+
+	if (bcomp_dev->cache)
+		len += blk_cache_stats_emit(buf, len, bcomp_dev->cache);
+
+	if (bcomp_dev->prefetch)
+		len += prefetch_stats_emit(buf, len, bcomp_dev->prefetch);
+
+	if (bcomp_dev->under_dev->mem)
+		len += mem_store_stats_emit(buf, len, bcomp_dev->under_dev->mem);
+
+	if (bcomp_dev->wb)
+		len += wb_stats_emit(buf, len, bcomp_dev->wb);
+
+	if (bcomp_dev->log)
+		len += log_stats_emit(buf, len, bcomp_dev->log);
+
+	if (bcomp_dev->meta)
+		len += meta_stats_emit(buf, len, bcomp_dev->meta);
+
+	if (bcomp_dev->hdr)
+		len += blk_hdr_stats_emit(buf, len, bcomp_dev->hdr);
+
+	if (bcomp_dev->pager)
+		len += map_pager_stats_emit(buf, len, bcomp_dev->pager);
+
+	len += map_stats_emit(bcomp_dev->map, buf, len);
+
+	return len;
 }
 
 static const struct kernel_param_ops bcomp_stats_ops = {
@@ -135,6 +233,186 @@ static const struct kernel_param_ops bcomp_stats_ops = {
 	.get = bcomp_get_stats,
 };
 
+static int bcomp_recompress(const char *arg, const struct kernel_param *kp)
+{
+	if (bcomp_dev == NULL) {
+		BCOMP_ERRLOG("no mapped device");
+		return -ENODEV;
+	}
+
+	return trigger_recomp(bcomp_dev, arg);
+}
+
+static int bcomp_recompress_info(char *buf, const struct kernel_param *kp)
+{
+	if (bcomp_dev == NULL || bcomp_dev->recomp == NULL)
+		return -ENODEV;
+
+	return recomp_stats_emit(buf, 0, bcomp_dev->recomp);
+}
+
+static const struct kernel_param_ops bcomp_recompress_ops = {
+	.set = bcomp_recompress,
+	.get = bcomp_recompress_info,
+};
+
+static int bcomp_reconfig(const char *arg, const struct kernel_param *kp)
+{
+	struct user_settings *settings;
+	int ret;
+
+	if (bcomp_dev == NULL) {
+		BCOMP_ERRLOG("no mapped device");
+		return -ENODEV;
+	}
+
+	settings = kzalloc(sizeof(*settings), GFP_KERNEL);
+	if (!settings) {
+		BCOMP_ERRLOG("can't alloc settings");
+		return -ENOMEM;
+	}
+
+	if (parse_comp_settings(arg, settings) != END_STG) {
+		ret = -EINVAL;
+		goto free_settings;
+	}
+
+	ret = bcomp_switch_comp(settings, bcomp_dev);
+	if (ret)
+		goto free_settings;
+
+	BCOMP_LOG("compression profile switched");
+	BCOMP_LOG(arg);
+
+free_settings:
+	free_user_settings(settings);
+	return ret;
+}
+
+static int bcomp_reconfig_info(char *buf, const struct kernel_param *kp)
+{
+	struct comp_ctx *cctx;
+	int len;
+
+	if (bcomp_dev == NULL) {
+		BCOMP_ERRLOG("no mapped device");
+		return -ENODEV;
+	}
+
+	cctx = bcomp_get_comp(bcomp_dev);
+	len = sysfs_emit(buf, "%s %d %d\n",
+			 get_available_cprf_names()[cctx->prf],
+			 cctx->comp_prf_id, cctx->decomp_prf_id);
+	bcomp_put_comp(cctx);
+
+	return len;
+}
+
+static const struct kernel_param_ops bcomp_reconfig_ops = {
+	.set = bcomp_reconfig,
+	.get = bcomp_reconfig_info,
+};
+
+static int bcomp_policy(const char *arg, const struct kernel_param *kp)
+{
+	struct comp_policy *pol = NULL;
+	int ret;
+
+	if (bcomp_dev == NULL) {
+		BCOMP_ERRLOG("no mapped device");
+		return -ENODEV;
+	}
+
+	if (strcmp(arg, get_none_keyword())) {
+		pol = parse_comp_policy(arg, strlen(arg));
+		if (!pol)
+			return -EINVAL;
+	}
+
+	ret = bcomp_set_policy(bcomp_dev, pol);
+	if (ret) {
+		kfree(pol);
+		return ret;
+	}
+
+	BCOMP_LOG("compression policy updated");
+	return 0;
+}
+
+static int bcomp_policy_info(char *buf, const struct kernel_param *kp)
+{
+	struct comp_policy *pol;
+	int len;
+
+	if (bcomp_dev == NULL) {
+		BCOMP_ERRLOG("no mapped device");
+		return -ENODEV;
+	}
+
+	rcu_read_lock();
+	pol = rcu_dereference(bcomp_dev->policy);
+	len = pol ? comp_policy_emit(buf, 0, pol) :
+		    sysfs_emit(buf, "%s\n", get_none_keyword());
+	rcu_read_unlock();
+
+	return len;
+}
+
+static const struct kernel_param_ops bcomp_policy_ops = {
+	.set = bcomp_policy,
+	.get = bcomp_policy_info,
+};
+
+static int bcomp_ranges(const char *arg, const struct kernel_param *kp)
+{
+	struct comp_range_table *tbl = NULL;
+	int ret;
+
+	if (bcomp_dev == NULL) {
+		BCOMP_ERRLOG("no mapped device");
+		return -ENODEV;
+	}
+
+	if (strcmp(arg, get_none_keyword())) {
+		tbl = parse_comp_ranges(arg, strlen(arg));
+		if (!tbl)
+			return -EINVAL;
+	}
+
+	ret = bcomp_set_ranges(bcomp_dev, tbl);
+	if (ret) {
+		kvfree(tbl);
+		return ret;
+	}
+
+	BCOMP_LOG("LBA-range policy updated");
+	return 0;
+}
+
+static int bcomp_ranges_info(char *buf, const struct kernel_param *kp)
+{
+	struct comp_range_table *tbl;
+	int len;
+
+	if (bcomp_dev == NULL) {
+		BCOMP_ERRLOG("no mapped device");
+		return -ENODEV;
+	}
+
+	rcu_read_lock();
+	tbl = rcu_dereference(bcomp_dev->ranges);
+	len = tbl ? comp_ranges_emit(buf, 0, tbl) :
+		    sysfs_emit(buf, "%s\n", get_none_keyword());
+	rcu_read_unlock();
+
+	return len;
+}
+
+static const struct kernel_param_ops bcomp_ranges_ops = {
+	.set = bcomp_ranges,
+	.get = bcomp_ranges_info,
+};
+
 // ======== module ======== //
 
 static int __init bcomp_init(void)
@@ -146,6 +424,13 @@ static int __init bcomp_init(void)
 		return -EIO;
 	}
 
+	/* debugfs is optional, errors are ignored as debugfs expects */
+	bcomp_debugfs = debugfs_create_dir(BCOMP_NAME, NULL);
+
+	/* the device works without them */
+	if (lat_hist_init(bcomp_debugfs))
+		BCOMP_ERRLOG("latency histograms are off");
+
 	BCOMP_LOG("module loaded");
 	return 0;
 }
@@ -154,12 +439,13 @@ static void __exit bcomp_exit(void)
 {
 	unregister_blkdev(bcomp_major, BCOMP_NAME);
 
-	if (bcomp_dev == NULL) {
-		return;
+	if (bcomp_dev != NULL) {
+		bcomp_free_dev(bcomp_dev);
+		bcomp_dev = NULL;
 	}
 
-	bcomp_free_dev(bcomp_dev);
-	bcomp_dev = NULL;
+	lat_hist_exit();
+	debugfs_remove_recursive(bcomp_debugfs);
 
 	BCOMP_LOG("module unloaded");
 }
@@ -167,6 +453,27 @@ static void __exit bcomp_exit(void)
 MODULE_PARM_DESC(bcomp_stats, "Bcomp dev statistics");
 module_param_cb(bcomp_stats, &bcomp_stats_ops, NULL, S_IRUGO | S_IWUSR);
 
+MODULE_PARM_DESC(
+	bcomp_recompress,
+	"Recompress cold blocks: \"<comp-prfl-id> <blocks-per-sec> <cold-sec> <idle|always>\" or \"stop\"");
+module_param_cb(bcomp_recompress, &bcomp_recompress_ops, NULL,
+		S_IRUGO | S_IWUSR);
+
+MODULE_PARM_DESC(
+	bcomp_reconfig,
+	"Switch compression of new writes: \"<comp-profile> <comp-prfl-id> <decomp-prfl-id>\"");
+module_param_cb(bcomp_reconfig, &bcomp_reconfig_ops, NULL, S_IRUGO | S_IWUSR);
+
+MODULE_PARM_DESC(
+	bcomp_policy,
+	"Per-request compression: \"<meta|fua|sync|rt|be|idle>:<comp-prfl-id|raw|default>[,...]\" or \"none\"");
+module_param_cb(bcomp_policy, &bcomp_policy_ops, NULL, S_IRUGO | S_IWUSR);
+
+MODULE_PARM_DESC(
+	bcomp_ranges,
+	"Per-LBA-range compression: \"<first-sector>-<last-sector>:<comp-prfl-id|raw|default>[,...]\" or \"none\"");
+module_param_cb(bcomp_ranges, &bcomp_ranges_ops, NULL, S_IRUGO | S_IWUSR);
+
 MODULE_PARM_DESC(bcomp_mapper, "Create bcomp dev (map)");
 module_param_cb(bcomp_mapper, &bcomp_map_ops, NULL, S_IRUGO | S_IWUSR);
 
@@ -13,7 +13,7 @@ static inline int __init_buf(unsigned long flgs, struct buffer *buf,
 	char *data;
 
 	if (test_bit(BFA_INITIALIZED, &flgs) && test_bit(BFA_ATTACHED, &flgs)) {
-		data = kzalloc(sizeof(*buf) * buf_sz, GFP_NOIO);
+		data = kzalloc(buf_sz, GFP_NOIO);
 		if (!data)
 			return -ENOMEM;
 		goto init;
@@ -141,6 +141,8 @@ int alloc_chunk(struct chunk **chnk_ptr, u32 dst_sz, u32 src_sz, char *dst_ptr,
 	if (ret)
 		goto err_free_dst;
 
+	chnk->dst_limit = dst_sz;
+
 	*chnk_ptr = chnk;
 	return 0;
 
@@ -167,6 +169,9 @@ int allocate_chunk_for_comp(struct chunk **chnk_ptr, u32 src_sz, u32 min_dst_sz,
 	if (ret)
 		return ret;
 
+	if (dst_size)
+		(*chnk_ptr)->dst_limit = comp_useful_size(src_sz, cctx);
+
 	return 0;
 }
 
@@ -186,3 +191,24 @@ int init_comp_ops(enum comp_profile cprf, struct comp_ctx *cctx)
 	cctx->prf = cprf;
 	return 0;
 }
+
+int init_decomp_ctx(struct comp_ctx *dctx, enum comp_profile cprf,
+		    int decomp_id)
+{
+	int ret;
+
+	memset(dctx, 0, sizeof(*dctx));
+
+	ret = init_comp_ops(cprf, dctx);
+	if (ret)
+		return ret;
+
+	dctx->decomp_prf_id = decomp_id < 0 ? dctx->ops->safe_decomp_id :
+					      decomp_id;
+	return 0;
+}
+
+void release_comp(struct kref *ref)
+{
+	free_comp(container_of(ref, struct comp_ctx, ref));
+}
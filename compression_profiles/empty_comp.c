@@ -1,5 +1,6 @@
 #include <linux/stddef.h>
 #include <linux/fs.h>
+#include <linux/preempt.h>
 
 #include "../include/comp_common.h"
 
@@ -30,17 +31,31 @@ static void _remap_src_to_dst(struct chunk *chnk)
 	chnk->dst.data = chnk->src.data;
 }
 
-static int empty_cmpress_chunk(struct comp_ctx *cctx, struct chunk *chnk)
+static int empty_cmpress_chunk(struct comp_ctx *cctx, struct chunk *chnk,
+			       int comp_id)
 {
+	u64 start;
+
 	BUG_ON(!test_bit(BFA_INITIALIZED, &(chnk->src.flags)));
+
+	preempt_disable();
+	start = local_clock();
 	_remap_src_to_dst(chnk);
+	comp_acct(cctx, CPU_ACCT_COMP, comp_id, start, chnk, 0);
+	preempt_enable();
 	return 0;
 }
 
 static int empty_decmpress_chunk(struct comp_ctx *cctx, struct chunk *chnk,
 				 u32 expexted_sz)
 {
+	u64 start;
+
+	preempt_disable();
+	start = local_clock();
 	_remap_src_to_dst(chnk);
+	comp_acct(cctx, CPU_ACCT_DECOMP, cctx->decomp_prf_id, start, chnk, 0);
+	preempt_enable();
 	return 0;
 }
 
@@ -49,7 +64,9 @@ const struct comp_ops empty_comp_ops = {
 	.put_private_ctx = empty_put_private_ctx,
 	.comp_chunk = empty_cmpress_chunk,
 	.decomp_chunk = empty_decmpress_chunk,
-	.get_dst_buf_sz = NULL
+	.get_dst_buf_sz = NULL,
+	.get_comp_strength = NULL,
+	.safe_decomp_id = 0
 };
 
 const struct comp_ops *get_empty_comp_ops(void)
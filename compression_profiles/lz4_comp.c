@@ -1,6 +1,9 @@
 #include <uapi/linux/stddef.h>
 #include <linux/fs.h>
 #include <linux/lz4.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/preempt.h>
 #include <linux/vmalloc.h>
 
 #include "../include/bcomp_static.h"
@@ -36,10 +39,53 @@ static void *alloc_wrkmem(int profile_id)
 	return NULL;
 }
 
+static void free_streams(struct lz4_stream __percpu *streams)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct lz4_stream *stream = per_cpu_ptr(streams, cpu);
+
+		if (stream->wrkmem)
+			vfree(stream->wrkmem);
+	}
+
+	free_percpu(streams);
+}
+
+/*
+DOC:
+	Compression runs in the submitter's context on any CPU, so every CPU
+	owns a workspace sized for the strongest id this ctx may be asked for.
+ */
+static struct lz4_stream __percpu *alloc_streams(int profile_id)
+{
+	struct lz4_stream __percpu *streams;
+	int cpu;
+
+	streams = alloc_percpu(struct lz4_stream);
+	if (!streams)
+		return NULL;
+
+	for_each_possible_cpu(cpu) {
+		struct lz4_stream *stream = per_cpu_ptr(streams, cpu);
+
+		mutex_init(&stream->lock);
+		stream->wrkmem = alloc_wrkmem(profile_id);
+		if (!stream->wrkmem) {
+			free_streams(streams);
+			return NULL;
+		}
+	}
+
+	return streams;
+}
+
 static int lz4_get_private_ctx(int comp_id, int decomp_id,
 			       struct comp_ctx *cctx)
 {
-	char *wrkmem;
+	struct lz4_stream __percpu *streams;
+	int wrkmem_id;
 	int ret;
 
 	ret = validate_comp_prf_id(comp_id);
@@ -50,25 +96,46 @@ static int lz4_get_private_ctx(int comp_id, int decomp_id,
 	if (ret)
 		return ret;
 
-	wrkmem = alloc_wrkmem(comp_id);
-	if (!wrkmem)
+	wrkmem_id = comp_id;
+	if (validate_comp_prf_id(cctx->max_comp_prf_id) == 0)
+		wrkmem_id = max_t(int, comp_id, cctx->max_comp_prf_id);
+
+	streams = alloc_streams(wrkmem_id);
+	if (!streams)
 		return -ENOMEM;
 
 	cctx->comp_prf_id = comp_id;
 	cctx->decomp_prf_id = decomp_id;
+	cctx->max_comp_prf_id = wrkmem_id;
 	cctx->prf = LZ4;
 	cctx->ops = get_lz4_comp_ops();
-	cctx->private_ctx = wrkmem;
+	cctx->private_ctx = streams;
 
 	return 0;
 }
 
 static int lz4_put_private_ctx(struct comp_ctx *cctx)
 {
-	vfree(cctx->private_ctx);
+	free_streams(cctx->private_ctx);
 	return 0;
 }
 
+/*
+DOC:
+	Strength order of ids: fast 15 (weakest) .. fast 1 == fast 0,
+	then HC 16 .. HC 31 (strongest).
+ */
+static int lz4_get_comp_strength(int comp_id)
+{
+	if (validate_comp_prf_id(comp_id))
+		return -EINVAL;
+
+	if (BCOMP_LZ4_GET_COMP_TP(comp_id) == BCOMP_LZ4_TP_FAST)
+		return BCOMP_LZ4_MAX_FAST_ID + 1 - max_t(int, comp_id, 1);
+
+	return comp_id;
+}
+
 static int validate_chunk(struct chunk *chnk)
 {
 	if (!test_bit(BFA_INITIALIZED, &(chnk->src.flags))) {
@@ -89,18 +156,29 @@ static int validate_chunk(struct chunk *chnk)
 	return 0;
 }
 
+/*
+DOC:
+	LZ4 gets `chnk->dst_limit` as the output capacity, so it aborts as soon
+	as the result can't save anything (LZ4 returns 0 in that case).
+ */
 static int fast_compress(struct chunk *chnk, int id, void *wrkmem)
 {
 	return chnk->dst.data_sz = LZ4_compress_fast(
 		       chnk->src.data, chnk->dst.data, chnk->src.data_sz,
-		       chnk->dst.buf_sz, id, wrkmem);
+		       chnk->dst_limit, id, wrkmem);
 }
 
 static int hc_compress(struct chunk *chnk, int id, void *wrkmem)
 {
 	return chnk->dst.data_sz = LZ4_compress_HC(
 		       chnk->src.data, chnk->dst.data, chnk->src.data_sz,
-		       chnk->dst.buf_sz, id, wrkmem);
+		       chnk->dst_limit, id, wrkmem);
+}
+
+static inline void store_raw(struct chunk *chnk)
+{
+	/* psize == lsize: map profile keeps the block uncompressed */
+	chnk->dst.data_sz = chnk->src.data_sz;
 }
 
 static int compress(int comp_id, struct chunk *chnk, void *wrkmem)
@@ -108,6 +186,12 @@ static int compress(int comp_id, struct chunk *chnk, void *wrkmem)
 	int ret;
 
 	enum comp_tp tp = BCOMP_LZ4_GET_COMP_TP(comp_id);
+
+	if (!chnk->dst_limit) {
+		store_raw(chnk);
+		return 0;
+	}
+
 	switch (tp) {
 	case BCOMP_LZ4_TP_FAST:
 		ret = fast_compress(chnk, comp_id, wrkmem);
@@ -121,23 +205,44 @@ static int compress(int comp_id, struct chunk *chnk, void *wrkmem)
 		return -ENOTSUPP;
 	}
 
-	if (!ret)
-		return -EIO;
+	if (!ret) {
+		/* output exceeded dst_limit: incompressible, not an error */
+		store_raw(chnk);
+		return 0;
+	}
 
 	chnk->dst.data_sz = ret;
 
 	return 0;
 }
 
-static int lz4_cmpress_chunk(struct comp_ctx *cctx, struct chunk *chnk)
+static int lz4_cmpress_chunk(struct comp_ctx *cctx, struct chunk *chnk,
+			     int comp_id)
 {
+	struct lz4_stream *stream;
+	u64 start;
 	int ret;
 
 	ret = validate_chunk(chnk);
 	if (ret)
 		return ret;
 
-	ret = compress(cctx->comp_prf_id, chnk, cctx->private_ctx);
+	if (comp_id > cctx->max_comp_prf_id) {
+		BCOMP_ERRLOG("comp_prf_id exceeds allocated workspace");
+		return -EINVAL;
+	}
+
+	stream = raw_cpu_ptr((struct lz4_stream __percpu *)cctx->private_ctx);
+	mutex_lock(&stream->lock);
+
+	/* the wait for the workspace and preemption are nobody's codec time */
+	preempt_disable();
+	start = local_clock();
+	ret = compress(comp_id, chnk, stream->wrkmem);
+	comp_acct(cctx, CPU_ACCT_COMP, comp_id, start, chnk, ret);
+	preempt_enable();
+
+	mutex_unlock(&stream->lock);
 	if (ret) {
 		BCOMP_ERRLOG("problem with LZ4_compress");
 		return ret;
@@ -193,13 +298,19 @@ static int decompress(int decomp_prf_id, struct chunk *chnk, u32 expexted_sz)
 static int lz4_decmpress_chunk(struct comp_ctx *cctx, struct chunk *chnk,
 			       u32 expexted_sz)
 {
+	u64 start;
 	int ret;
 
 	ret = validate_chunk(chnk);
 	if (ret)
 		return ret;
 
+	preempt_disable();
+	start = local_clock();
 	ret = decompress(cctx->decomp_prf_id, chnk, expexted_sz);
+	comp_acct(cctx, CPU_ACCT_DECOMP, cctx->decomp_prf_id, start, chnk,
+		  ret);
+	preempt_enable();
 	if (ret) {
 		BCOMP_ERRLOG("problem with LZ4_decompress");
 		return ret;
@@ -210,14 +321,23 @@ static int lz4_decmpress_chunk(struct comp_ctx *cctx, struct chunk *chnk,
 
 static u32 lz4_get_dst_buf_sz(struct comp_ctx *cctx, u32 data_for_comp_sz)
 {
-	return LZ4_compressBound(data_for_comp_sz);
+	/*
+	IMPORTANT:
+		Output is bounded by comp_useful_size() (< data_for_comp_sz),
+		so LZ4_compressBound() is never needed.
+	*/
+	return data_for_comp_sz;
 }
 
-const struct comp_ops lz4_comp_ops = { .get_private_ctx = lz4_get_private_ctx,
-				       .put_private_ctx = lz4_put_private_ctx,
-				       .comp_chunk = lz4_cmpress_chunk,
-				       .decomp_chunk = lz4_decmpress_chunk,
-				       .get_dst_buf_sz = lz4_get_dst_buf_sz };
+const struct comp_ops lz4_comp_ops = {
+	.get_private_ctx = lz4_get_private_ctx,
+	.put_private_ctx = lz4_put_private_ctx,
+	.comp_chunk = lz4_cmpress_chunk,
+	.decomp_chunk = lz4_decmpress_chunk,
+	.get_dst_buf_sz = lz4_get_dst_buf_sz,
+	.get_comp_strength = lz4_get_comp_strength,
+	.safe_decomp_id = BCOMP_LZ4_DECOM_SAFE
+};
 
 const struct comp_ops *get_lz4_comp_ops(void)
 {
@@ -2,6 +2,7 @@
 #define LZ4_COMP
 
 #include <linux/lz4.h>
+#include <linux/mutex.h>
 
 #include "../include/comp_common.h"
 
@@ -21,6 +22,12 @@ enum comp_tp { BCOMP_LZ4_TP_FAST, BCOMP_LZ4_TP_HC };
 
 enum decomp_tp { BCOMP_LZ4_DECOM_FAST = 0, BCOMP_LZ4_DECOM_SAFE = 1 };
 
+/* per-CPU compression workspace (comp_ctx->private_ctx is a percpu array) */
+struct lz4_stream {
+	struct mutex lock;
+	void *wrkmem;
+};
+
 const struct comp_ops *get_lz4_comp_ops(void);
 
 #endif /* LZ4_COMP */
\ No newline at end of file
@@ -0,0 +1,233 @@
+#include <linux/types.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
+
+#include "../include/bcomp_static.h"
+#include "../include/comp_common.h"
+#include "../include/split_comp.h"
+
+struct split_task {
+	struct work_struct work;
+	struct completion done;
+
+	struct chunk part; // buffers are linked into the block
+	struct comp_ctx *cctx;
+	int comp_id;
+	u32 expected_sz; // decompression only
+	bool decomp;
+	bool skip; // raw sub-stream, already copied
+	int ret;
+};
+
+/* ================== TASKS ================== */
+
+static void split_link_part(struct chunk *part, char *src, u32 src_sz,
+			    char *dst, u32 dst_sz)
+{
+	memset(part, 0, sizeof(*part));
+
+	link_data(src_sz, src, false, &part->src);
+	part->src.data_sz = src_sz;
+	link_data(dst_sz, dst, false, &part->dst);
+}
+
+static void split_run_task(struct split_task *t)
+{
+	if (t->skip)
+		t->ret = 0;
+	else if (t->decomp)
+		t->ret = decomp_src_to_dst(&t->part, t->expected_sz, t->cctx);
+	else
+		t->ret = comp_src_to_dst_id(&t->part, t->comp_id, t->cctx);
+}
+
+static void split_work_fn(struct work_struct *work)
+{
+	struct split_task *t = container_of(work, struct split_task, work);
+
+	split_run_task(t);
+	complete(&t->done);
+}
+
+/*
+DOC:
+	Task 0 runs in the caller, the others go to the CPUs that follow the
+	caller's one in cpumask_local_spread() order (its node first). Every
+	submitter starts from its own CPU, so concurrent writers spread over
+	the node instead of all piling onto the same few CPUs.
+ */
+static int split_run_tasks(struct workqueue_struct *wq,
+			   struct split_task *tasks, int nsub)
+{
+	int node = numa_node_id();
+	unsigned int base = raw_smp_processor_id();
+	int ret = 0;
+
+	for (int i = 1; i < nsub; i++) {
+		INIT_WORK(&tasks[i].work, split_work_fn);
+		init_completion(&tasks[i].done);
+		queue_work_on(cpumask_local_spread((base + i) % nr_cpu_ids,
+						   node),
+			      wq, &tasks[i].work);
+	}
+
+	split_run_task(&tasks[0]);
+
+	for (int i = 0; i < nsub; i++) {
+		if (i)
+			wait_for_completion(&tasks[i].done);
+		if (tasks[i].ret)
+			ret = tasks[i].ret;
+	}
+
+	return ret;
+}
+
+/* ================== API ================== */
+
+int validate_split(int nsub, u32 bs, struct comp_ctx *cctx)
+{
+	if (nsub < 2 || nsub > SPLIT_MAX || bs % nsub ||
+	    bs / nsub < SPLIT_MIN_SUB_SZ) {
+		BCOMP_ERRLOG("split: sub-streams should be in [2, 8], bs / split >= 4k");
+		return -EINVAL;
+	}
+
+	/* sub-streams are compressed into caller's buffers */
+	if (!comp_dst_buf_size(bs, cctx)) {
+		BCOMP_ERRLOG("split: not supported by compression profile");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int split_comp_chunk(struct workqueue_struct *wq, struct chunk *chnk,
+		     int comp_id, int nsub, struct comp_ctx *cctx)
+{
+	u32 src_sz = chnk->src.data_sz;
+	u32 sub_sz = src_sz / nsub;
+	u32 hdr_sz = split_hdr_size(nsub);
+	struct split_task *tasks;
+	__le32 *hdr = (__le32 *)chnk->dst.data;
+	char *scratch, *out;
+	u32 psize;
+	int ret;
+
+	if (!chnk->dst_limit || chnk->dst_limit <= hdr_sz)
+		goto store_raw;
+
+	tasks = kcalloc(nsub, sizeof(*tasks), GFP_NOIO);
+	if (!tasks)
+		return -ENOMEM;
+
+	scratch = kmalloc(src_sz, GFP_NOIO);
+	if (!scratch) {
+		ret = -ENOMEM;
+		goto free_tasks;
+	}
+
+	for (int i = 0; i < nsub; i++) {
+		split_link_part(&tasks[i].part, chnk->src.data + i * sub_sz,
+				sub_sz, scratch + i * sub_sz, sub_sz);
+		/* == sub_sz is reserved for raw sub-streams */
+		tasks[i].part.dst_limit = sub_sz - 1;
+		tasks[i].cctx = cctx;
+		tasks[i].comp_id = comp_id;
+	}
+
+	ret = split_run_tasks(wq, tasks, nsub);
+	if (ret)
+		goto free_scratch;
+
+	/* LAYOUT */
+	psize = hdr_sz;
+	for (int i = 0; i < nsub; i++)
+		psize += min_t(u32, tasks[i].part.dst.data_sz, sub_sz);
+
+	if (psize > chnk->dst_limit) {
+		kfree(scratch);
+		kfree(tasks);
+		goto store_raw;
+	}
+
+	out = chnk->dst.data + hdr_sz;
+	for (int i = 0; i < nsub; i++) {
+		struct chunk *part = &tasks[i].part;
+
+		if (part->dst.data_sz >= sub_sz) {
+			hdr[i] = cpu_to_le32(sub_sz);
+			memcpy(out, part->src.data, sub_sz);
+			out += sub_sz;
+			continue;
+		}
+
+		hdr[i] = cpu_to_le32(part->dst.data_sz);
+		memcpy(out, part->dst.data, part->dst.data_sz);
+		out += part->dst.data_sz;
+	}
+
+	chnk->dst.data_sz = psize;
+
+free_scratch:
+	kfree(scratch);
+free_tasks:
+	kfree(tasks);
+	return ret;
+
+store_raw:
+	chnk->dst.data_sz = src_sz;
+	return 0;
+}
+
+int split_decomp_chunk(struct workqueue_struct *wq, struct chunk *chnk,
+		       u32 expected_sz, int nsub, struct comp_ctx *dctx)
+{
+	u32 sub_sz = expected_sz / nsub;
+	u32 hdr_sz = split_hdr_size(nsub);
+	__le32 *hdr = (__le32 *)chnk->src.data;
+	struct split_task *tasks;
+	u32 off = hdr_sz, sub_psize;
+	int ret;
+
+	if (chnk->src.data_sz < hdr_sz || chnk->dst.buf_sz < expected_sz)
+		return -EINVAL;
+
+	tasks = kcalloc(nsub, sizeof(*tasks), GFP_NOIO);
+	if (!tasks)
+		return -ENOMEM;
+
+	for (int i = 0; i < nsub; i++) {
+		sub_psize = le32_to_cpu(hdr[i]);
+		if (sub_psize > sub_sz || off + sub_psize > chnk->src.data_sz) {
+			ret = -EINVAL;
+			goto free_tasks;
+		}
+
+		split_link_part(&tasks[i].part, chnk->src.data + off,
+				sub_psize, chnk->dst.data + i * sub_sz, sub_sz);
+		tasks[i].cctx = dctx;
+		tasks[i].expected_sz = sub_sz;
+		tasks[i].decomp = true;
+		off += sub_psize;
+
+		if (sub_psize == sub_sz) {
+			memcpy(tasks[i].part.dst.data, tasks[i].part.src.data,
+			       sub_sz);
+			tasks[i].skip = true;
+		}
+	}
+
+	ret = split_run_tasks(wq, tasks, nsub);
+	if (ret)
+		goto free_tasks;
+
+	chnk->dst.data_sz = expected_sz;
+
+free_tasks:
+	kfree(tasks);
+	return ret;
+}
@@ -3,6 +3,7 @@
 #include <linux/types.h>
 #include <linux/stddef.h>
 #include <linux/blk_types.h>
+#include <linux/workqueue.h>
 
 /* ========= REQUEST STRUCTURES ========= */
 
@@ -10,29 +11,94 @@
 #include "settings.h"
 #include "map_common.h"
 #include "comp_common.h"
+#include "comp_controller.h"
+#include "policy.h"
+#include "heat.h"
+#include "blk_cache.h"
+#include "prefetch.h"
+#include "mem_store.h"
+#include "writeback.h"
+#include "log_dev.h"
+#include "meta.h"
+#include "blk_hdr.h"
+#include "map_pager.h"
+#include "map_file.h"
+#include "raw_io.h"
 #include "stats.h"
+#include "lat_hist.h"
 
 struct bcomp_req {
 	enum req_op op_type;
 	struct bio *original_bio;
+	int comp_prf_id; // write: level chosen for the request
+	u64 fp; // write: content fingerprint (dedup maps)
+	struct map_cell *dup; // write: referenced dedup candidate
+	struct comp_ctx *cctx; // write: pinned while the candidate is verified
+	struct log_rec *log_rec; // write: reserved slot on the log device
+	struct meta_jent ment; // write: journal entry, see meta.h
+	struct list_head meta_node; // write: waits for the journal commit
+	struct work_struct work;
+	u64 lat[LAT_STAGES]; // stage stamps, see lat_hist.h
 
 	struct map_entity *entity;
 	struct bcomp_dev *bcdev;
 };
 
-struct underlying_dev {
+/*
+DOC:
+	`<path>[,<path>...]` -- blocks are striped over the members in units
+	of `stripe=<blocks>`, each member has its own bio_set. pba is an offset
+	in the striped space, bcomp_under_map() turns it into a member sector.
+*/
+#define UNDER_MAX_MEMBERS 8
+#define UNDER_PATH_DELIMITER ','
+
+struct under_member {
 	struct block_device *bdev;
 	struct file *bdev_fl;
 	struct bio_set *bset;
 };
 
+struct underlying_dev {
+	struct under_member members[UNDER_MAX_MEMBERS];
+	u32 nr_members; // 0 -- RAM backend
+	u32 stripe_blks; // stripe unit, in blocks
+
+	sector_t nr_sects;
+	struct mem_store *mem; // RAM backend, see mem_store.h
+};
+
 struct bcomp_dev {
 	enum w_block_size bs;
 	struct gendisk *bcomp_disk;
 	struct underlying_dev *under_dev;
-	struct comp_ctx *compress;
+	struct comp_ctx __rcu *compress; // see bcomp_get_comp()
+	struct comp_controller *ctl; // NULL -- fixed comp_prf_id
+	struct comp_policy __rcu *policy; // NULL -- no per-request policy
+	struct comp_range_table __rcu *ranges; // NULL -- no per-LBA policy
 	struct map_ctx *map;
 	struct stats *stats;
+	struct cpu_acct *acct; // codec CPU time, see cpu_acct.h
+
+	u64 blk_cnt;
+	unsigned long *blk_locks; // one bit per block, see bcomp_lock_block()
+	unsigned long *written; // one bit per block, see bcomp_mark_written()
+	bool sparse; // never-written blocks read as zeroes
+	unsigned long last_io; // jiffies of the last submitted bio
+
+	struct recomp_ctx *recomp; // NULL -- no recompression was triggered
+	struct heat_ctx *heat; // NULL -- no hot/cold tracking
+	struct blk_cache *cache; // NULL -- no decompressed-block cache
+	struct prefetch_ctx *prefetch; // NULL -- no sequential read-ahead
+	struct wb_ctx *wb; // NULL -- writes go straight to compression
+	struct log_ctx *log; // NULL -- writes go to the home location
+	struct meta_ctx *meta; // NULL -- the map is lost on unmap
+	struct blk_hdr_ctx *hdr; // NULL -- compressed blocks carry no trailer
+	struct map_pager *pager; // NULL -- the whole map stays in memory
+	struct workqueue_struct *wq; // deferred parts of the data-path
+
+	u8 split; // sub-streams per block, 0 -- single stream
+	struct workqueue_struct *split_wq; // sub-stream (de)compression
 };
 
 // ======== initialization ======== //
@@ -42,16 +108,93 @@ int bcomp_init_dev(struct user_settings *settings, int major, int free_minor,
 		   struct bcomp_dev *bcdev);
 void bcomp_free_dev(struct bcomp_dev *bcdev);
 
+/*
+DOC:
+	Active write profile. Writes pin it with bcomp_get_comp() for the
+	time of compression, bcomp_switch_comp() publishes a new one and the
+	old ctx is freed by the last in-flight write. Reads don't need it:
+	every map_cell keeps the profile the block was compressed with.
+ */
+struct comp_ctx *bcomp_get_comp(struct bcomp_dev *bcdev);
+void bcomp_put_comp(struct comp_ctx *cctx);
+int bcomp_switch_comp(struct user_settings *settings, struct bcomp_dev *bcdev);
+int bcomp_decomp_cell(struct bcomp_dev *bcdev, struct chunk *chnk,
+		      struct map_cell *cell);
+
+/* pol/tbl == NULL drops the policy */
+int bcomp_set_policy(struct bcomp_dev *bcdev, struct comp_policy *pol);
+int bcomp_set_ranges(struct bcomp_dev *bcdev, struct comp_range_table *tbl);
+
 // ======== data-path ======== //
 
 /* -------- tools -------- */
 void copy_sg_to_buf(struct buffer *buf, struct bio *bio);
 void copy_buf_to_sg(struct buffer *buf, struct bio *bio);
 int add_buffer_to_bio(struct buffer *buf, u32 part_to_use, struct bio *bio);
+/* block backend: bio of pba (a logged block -- of its log copy) */
+int bcomp_alloc_block_bio(struct bcomp_dev *bcdev, enum req_op op,
+			  sector_t pba, struct buffer *buf,
+			  struct bio **bio_ptr);
+int bcomp_rw_block_sync(struct bcomp_dev *bcdev, enum req_op op,
+			sector_t pba, struct buffer *buf);
+struct under_member *bcomp_under_map(struct bcomp_dev *bcdev, sector_t pba,
+				     sector_t *sector);
+/* member block -> block key in the striped space */
+u64 bcomp_under_key(struct bcomp_dev *bcdev, u32 member, u64 blk);
+int bcomp_under_flush(struct bcomp_dev *bcdev);
+/* compressed cell -> stored->dst holds the decompressed block */
+int bcomp_read_cell_sync(struct bcomp_dev *bcdev, struct map_cell *cell,
+			 struct chunk **stored_ptr);
+
+static inline u64 bcomp_lba_to_key(struct bcomp_dev *bcdev, sector_t lba)
+{
+	return lba / DIV_ROUND_UP(bcdev->bs, 512);
+}
+
+static inline sector_t bcomp_key_to_lba(struct bcomp_dev *bcdev, u64 key)
+{
+	return key * DIV_ROUND_UP(bcdev->bs, 512);
+}
+
+/*
+DOC:
+	Block lock serializes everything that reads or rewrites a block
+	(foreground requests hold it from submit till endio, background work
+	holds it around read-modify-write), so a map_cell never changes under
+	in-flight I/O of the same block.
+ */
+void bcomp_lock_block(struct bcomp_dev *bcdev, sector_t lba);
+bool bcomp_trylock_block(struct bcomp_dev *bcdev, sector_t lba);
+void bcomp_unlock_block(struct bcomp_dev *bcdev, sector_t lba);
+
+/*
+DOC:
+	Written bitmap: a block is written once a write of it completed (or
+	the map was loaded with it). It lives as long as the mapping, meta=
+	keeps it in its entries. Set under the block lock; with `sparse=1`
+	reads of a block never written are zero-filled without any I/O.
+ */
+static inline void bcomp_mark_written(struct bcomp_dev *bcdev, sector_t lba)
+{
+	set_bit(bcomp_lba_to_key(bcdev, lba), bcdev->written);
+}
+
+static inline bool bcomp_blk_written(struct bcomp_dev *bcdev, sector_t lba)
+{
+	return test_bit(bcomp_lba_to_key(bcdev, lba), bcdev->written);
+}
+
+/* read as zeroes, sparse= only */
+static inline bool bcomp_blk_unwritten(struct bcomp_dev *bcdev, sector_t lba)
+{
+	return bcdev->sparse && !bcomp_blk_written(bcdev, lba);
+}
 
 /* -------- request -------- */
 struct bcomp_req *bcomp_alloc_req(void);
 void bcomp_free_req(struct bcomp_req *req);
+/* ends the original bio and frees the request with its chunk */
+void bcomp_complete_req(struct bcomp_req *req, blk_status_t status);
 
 /* -------- bio -------- */
 void bcomp_submit_bio(struct bio *original_bio);
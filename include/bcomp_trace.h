@@ -0,0 +1,222 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bcomp
+
+#if !defined(BCOMP_TRACE) || defined(TRACE_HEADER_MULTI_READ)
+#define BCOMP_TRACE
+
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/tracepoint.h>
+
+/*
+DOC:
+	Tracepoints of the data path (`events/bcomp/`), for perf/bpftrace.
+
+	Every event carries the original bio pointer, so one request can be
+	followed from bcomp_bio_submit to its underlying bio, and lba -- the
+	logical sector of the block. The underlying events also carry the
+	underlying bio, the member (or log) device and pba; the RAM backend
+	has no underlying bio and emits none of them.
+
+	Compression and decompression report the time spent in ns, it is
+	only measured while the event is enabled. A disabled tracepoint is a
+	patched-out branch, the arguments are not evaluated.
+
+	Fields are a stable interface: new ones go to the end.
+ */
+
+TRACE_EVENT(bcomp_bio_submit,
+	TP_PROTO(struct bio *bio),
+	TP_ARGS(bio),
+
+	TP_STRUCT__entry(
+		__field(void *, bio)
+		__field(sector_t, lba)
+		__field(u32, size)
+		__field(u32, opf)
+	),
+
+	TP_fast_assign(
+		__entry->bio = bio;
+		__entry->lba = bio->bi_iter.bi_sector;
+		__entry->size = bio->bi_iter.bi_size;
+		__entry->opf = bio->bi_opf;
+	),
+
+	TP_printk("bio=%p lba=%llu size=%u op=%u flags=%#x", __entry->bio,
+		  (unsigned long long)__entry->lba, __entry->size,
+		  __entry->opf & REQ_OP_MASK, __entry->opf & ~REQ_OP_MASK)
+);
+
+TRACE_EVENT(bcomp_req_alloc,
+	TP_PROTO(struct bio *bio, void *req),
+	TP_ARGS(bio, req),
+
+	TP_STRUCT__entry(
+		__field(void *, bio)
+		__field(void *, req)
+		__field(sector_t, lba)
+		__field(u32, op)
+	),
+
+	TP_fast_assign(
+		__entry->bio = bio;
+		__entry->req = req;
+		__entry->lba = bio->bi_iter.bi_sector;
+		__entry->op = bio_op(bio);
+	),
+
+	TP_printk("bio=%p req=%p lba=%llu op=%u", __entry->bio, __entry->req,
+		  (unsigned long long)__entry->lba, __entry->op)
+);
+
+DECLARE_EVENT_CLASS(bcomp_codec,
+	TP_PROTO(struct bio *bio, sector_t lba, u8 cprf, int prf_id,
+		 u32 lsize, u32 psize, u64 ns, int ret),
+	TP_ARGS(bio, lba, cprf, prf_id, lsize, psize, ns, ret),
+
+	TP_STRUCT__entry(
+		__field(void *, bio)
+		__field(sector_t, lba)
+		__field(u8, cprf)
+		__field(int, prf_id)
+		__field(u32, lsize)
+		__field(u32, psize)
+		__field(u64, ns)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->bio = bio;
+		__entry->lba = lba;
+		__entry->cprf = cprf;
+		__entry->prf_id = prf_id;
+		__entry->lsize = lsize;
+		__entry->psize = psize;
+		__entry->ns = ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("bio=%p lba=%llu cprf=%u id=%d lsize=%u psize=%u ns=%llu ret=%d",
+		  __entry->bio, (unsigned long long)__entry->lba,
+		  __entry->cprf, __entry->prf_id, __entry->lsize,
+		  __entry->psize, __entry->ns, __entry->ret)
+);
+
+/* psize == lsize -- the block is stored raw */
+DEFINE_EVENT(bcomp_codec, bcomp_compress,
+	TP_PROTO(struct bio *bio, sector_t lba, u8 cprf, int prf_id,
+		 u32 lsize, u32 psize, u64 ns, int ret),
+	TP_ARGS(bio, lba, cprf, prf_id, lsize, psize, ns, ret)
+);
+
+DEFINE_EVENT(bcomp_codec, bcomp_decompress,
+	TP_PROTO(struct bio *bio, sector_t lba, u8 cprf, int prf_id,
+		 u32 lsize, u32 psize, u64 ns, int ret),
+	TP_ARGS(bio, lba, cprf, prf_id, lsize, psize, ns, ret)
+);
+
+DECLARE_EVENT_CLASS(bcomp_map,
+	TP_PROTO(struct bio *bio, sector_t lba, sector_t pba, u32 psize,
+		 int ret),
+	TP_ARGS(bio, lba, pba, psize, ret),
+
+	TP_STRUCT__entry(
+		__field(void *, bio)
+		__field(sector_t, lba)
+		__field(sector_t, pba)
+		__field(u32, psize)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->bio = bio;
+		__entry->lba = lba;
+		__entry->pba = pba;
+		__entry->psize = psize;
+		__entry->ret = ret;
+	),
+
+	TP_printk("bio=%p lba=%llu pba=%llu psize=%u ret=%d", __entry->bio,
+		  (unsigned long long)__entry->lba,
+		  (unsigned long long)__entry->pba, __entry->psize,
+		  __entry->ret)
+);
+
+/* psize == 0 -- stored raw (or a hole for the lookup, ret -ENODATA) */
+DEFINE_EVENT(bcomp_map, bcomp_map_lookup,
+	TP_PROTO(struct bio *bio, sector_t lba, sector_t pba, u32 psize,
+		 int ret),
+	TP_ARGS(bio, lba, pba, psize, ret)
+);
+
+DEFINE_EVENT(bcomp_map, bcomp_map_update,
+	TP_PROTO(struct bio *bio, sector_t lba, sector_t pba, u32 psize,
+		 int ret),
+	TP_ARGS(bio, lba, pba, psize, ret)
+);
+
+TRACE_EVENT(bcomp_under_submit,
+	TP_PROTO(struct bio *orig, struct bio *bio, sector_t lba),
+	TP_ARGS(orig, bio, lba),
+
+	TP_STRUCT__entry(
+		__field(void *, orig)
+		__field(void *, bio)
+		__field(dev_t, dev)
+		__field(sector_t, lba)
+		__field(sector_t, pba)
+		__field(u32, size)
+	),
+
+	TP_fast_assign(
+		__entry->orig = orig;
+		__entry->bio = bio;
+		__entry->dev = bio_dev(bio);
+		__entry->lba = lba;
+		__entry->pba = bio->bi_iter.bi_sector;
+		__entry->size = bio->bi_iter.bi_size;
+	),
+
+	TP_printk("orig=%p bio=%p dev=%d,%d lba=%llu pba=%llu size=%u",
+		  __entry->orig, __entry->bio, MAJOR(__entry->dev),
+		  MINOR(__entry->dev), (unsigned long long)__entry->lba,
+		  (unsigned long long)__entry->pba, __entry->size)
+);
+
+/* the iterator of a completed bio is consumed, pba is in the submit event */
+TRACE_EVENT(bcomp_under_complete,
+	TP_PROTO(struct bio *orig, struct bio *bio, sector_t lba),
+	TP_ARGS(orig, bio, lba),
+
+	TP_STRUCT__entry(
+		__field(void *, orig)
+		__field(void *, bio)
+		__field(dev_t, dev)
+		__field(sector_t, lba)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry->orig = orig;
+		__entry->bio = bio;
+		__entry->dev = bio_dev(bio);
+		__entry->lba = lba;
+		__entry->status = blk_status_to_errno(bio->bi_status);
+	),
+
+	TP_printk("orig=%p bio=%p dev=%d,%d lba=%llu status=%d",
+		  __entry->orig, __entry->bio, MAJOR(__entry->dev),
+		  MINOR(__entry->dev), (unsigned long long)__entry->lba,
+		  __entry->status)
+);
+
+#endif /* BCOMP_TRACE */
+
+/* out-of-tree: Kbuild puts include/ on the path of bcomp.c */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE bcomp_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,83 @@
+#ifndef BCOMP_BLK_CACHE
+#define BCOMP_BLK_CACHE
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+/*
+DOC:
+	Cache of decompressed blocks.
+
+	Blocks are spread over shards by block index (neighbours land on
+	different shards), every shard has its own lock, hash table and LRU
+	list and holds at most cap / nr_shards bytes. The tables are sized
+	for the blocks a shard can hold (a bucket per block, rounded up to a
+	power of 2), so chains stay short whatever `cache=<MiB>` is. Read end_io inserts a
+	block right after decompression, reads of cached blocks don't touch
+	the underlying device at all.
+
+	All calls are made under the block lock (bcomp_lock_block()), so an
+	invalidation from a write can't race with an insert of stale data.
+	Inserts come from end_io: allocations never sleep and may fail.
+
+	The shrinker evicts LRU tails of all shards on memory pressure.
+ */
+
+#define BLK_CACHE_MIN_BUCKET_BITS 4
+
+struct bcomp_dev;
+struct bio;
+struct shrinker;
+
+struct blk_cache_shard {
+	spinlock_t lock;
+	struct hlist_head *tbl; // 1 << blk_cache.bucket_bits
+	struct list_head lru; // head -- most recently used
+	u64 bytes;
+};
+
+struct blk_cache {
+	struct bcomp_dev *bcdev;
+	u64 shard_cap; // bytes
+	u32 nr_shards; // power of 2
+	u32 bucket_bits; // of every shard table
+	struct blk_cache_shard *shards;
+	struct shrinker *shrinker;
+	atomic_t scan_from; // shard the next shrinker scan starts from
+
+	atomic_long_t entries;
+	atomic64_t bytes;
+	atomic64_t hits_cnt;
+	atomic64_t misses_cnt;
+	atomic64_t evicted_cnt;
+	atomic64_t reclaimed_cnt;
+	atomic64_t prefetch_hits_cnt; // first reads of prefetched blocks
+};
+
+#define PRITTY_BLK_CACHE_STATS_TEMPLATE \
+	"\
+cache_cap_bytes: %llu\n\
+cache_bytes: %lld\n\
+cache_entries: %ld\n\
+cache_hits_cnt: %lld\n\
+cache_misses_cnt: %lld\n\
+cache_evicted_cnt: %lld\n\
+cache_reclaimed_cnt: %lld\n\
+cache_prefetch_hits_cnt: %lld\n\
+"
+
+struct blk_cache *alloc_blk_cache(struct bcomp_dev *bcdev, u32 cap_mb);
+void free_blk_cache(struct blk_cache *bc);
+
+/* copies a cached block to the bio, false -- not cached */
+bool blk_cache_read(struct blk_cache *bc, sector_t lba, struct bio *bio);
+bool blk_cache_contains(struct blk_cache *bc, sector_t lba);
+void blk_cache_insert(struct blk_cache *bc, sector_t lba, const char *data,
+		      u32 sz, bool prefetched);
+void blk_cache_invalidate(struct blk_cache *bc, sector_t lba);
+
+int blk_cache_stats_emit(char *buf, int at, struct blk_cache *bc);
+void reset_blk_cache_stats(struct blk_cache *bc);
+
+#endif /* BCOMP_BLK_CACHE */
@@ -0,0 +1,107 @@
+#ifndef BCOMP_BLK_HDR
+#define BCOMP_BLK_HDR
+
+#include <linux/types.h>
+
+#include "bcomp_static.h"
+#include "comp_common.h"
+#include "map_common.h"
+
+/*
+DOC:
+	Self-describing compressed blocks (`linear` map).
+
+	A compressed block saves at least one sector, so the last bytes of
+	its bs slot are never used by the data: a struct blk_hdr trailer is
+	put there with the algorithm, sizes, lba and a write sequence number,
+	protected by a crc. Raw blocks carry nothing, their data fills the
+	slot. Stamping costs no extra I/O on the write path.
+
+	A raw block may hold anything, a trailer of another device too (an
+	image of a bcomp device written through this one). The crc is seeded
+	with a random id of the device, kept in a superblock in the last
+	block of the striped space: it is written at the first `hdr=1` map
+	and read at every next one, so foreign trailers never validate.
+
+	Rebuild (`rebuild=1`) reconstructs the map at mapping time: every
+	member is split into ranges scanned in parallel on bcdev->wq with
+	BLK_HDR_SCAN_IO reads, a block with a valid trailer for its own lba
+	becomes a compressed cell, anything else is raw. With the linear map
+	an lba has a single home, so a block is never seen twice; the
+	sequence counter continues after the largest seq found.
+ */
+
+#define BLK_HDR_MAGIC 0x6862636dU // "mcbh"
+#define BLK_HDR_SCAN_IO (1U << 20) // bytes per rebuild read
+#define BLK_HDR_MAX_SCANNERS 64
+
+#define BLK_HDR_SB_MAGIC 0x7362636dU // "mcbs"
+#define BLK_HDR_SB_VERSION 1
+
+struct bcomp_dev;
+
+struct blk_hdr {
+	__le32 magic;
+	__le32 crc; // seeded with the device id, computed with crc == 0
+	__le32 lsize;
+	__le32 psize;
+	u8 cprf;
+	u8 comp_prf_id;
+	u8 nsub;
+	u8 pad;
+	__le32 pad2;
+	__le64 lba;
+	__le64 seq;
+} __packed;
+
+struct blk_hdr_sb {
+	__le32 magic;
+	__le32 version;
+	__le64 dev_id;
+	__le32 bs;
+	__le32 crc; // computed with crc == 0
+} __packed;
+
+struct blk_hdr_ctx {
+	struct bcomp_dev *bcdev;
+	sector_t sb_sect; // superblock, past the end of the data
+	u64 dev_id;
+	u32 seed; // crc of dev_id
+	atomic64_t seq;
+
+	atomic64_t stamped_cnt;
+	atomic64_t scanned_cnt;
+	atomic64_t rebuilt_cnt;
+	atomic64_t bad_cnt; // magic matched, the rest didn't
+	u64 rebuild_ms;
+};
+
+#define PRITTY_BLK_HDR_STATS_TEMPLATE \
+	"\
+hdr_seq: %lld\n\
+hdr_stamped_cnt: %lld\n\
+hdr_scanned_cnt: %lld\n\
+hdr_rebuilt_cnt: %lld\n\
+hdr_bad_cnt: %lld\n\
+hdr_rebuild_ms: %llu\n\
+"
+
+/* reserves the superblock, before the map sizes the device */
+struct blk_hdr_ctx *alloc_blk_hdr(struct bcomp_dev *bcdev,
+				  enum w_block_size bs);
+void free_blk_hdr(struct blk_hdr_ctx *h);
+
+/* reads the device id, a new device gets one unless it is rebuilt */
+int blk_hdr_load(struct blk_hdr_ctx *h, bool rebuild);
+
+/* compressed cell -> trailer at the end of the bs buffer */
+void blk_hdr_stamp(struct blk_hdr_ctx *h, struct map_cell *cell,
+		   struct buffer *buf);
+
+/* map is empty: rebuilds it from the trailers on the device */
+int blk_hdr_rebuild(struct blk_hdr_ctx *h);
+
+int blk_hdr_stats_emit(char *buf, int at, struct blk_hdr_ctx *h);
+void reset_blk_hdr_stats(struct blk_hdr_ctx *h);
+
+#endif /* BCOMP_BLK_HDR */
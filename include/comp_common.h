@@ -3,7 +3,12 @@
 
 #include <linux/bitops.h>
 #include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/kref.h>
 #include <linux/types.h>
+#include <linux/sched/clock.h>
+
+#include "cpu_acct.h"
 
 /*
 WARNING: 
@@ -35,36 +40,56 @@ void link_data(u32 new_buf_sz, char *new_buf_data, int attach_it,
 struct chunk {
 	struct buffer src;
 	struct buffer dst;
+	u32 dst_limit; // max useful compressed size (overflow => store raw)
 };
 
 enum comp_profile { EMPTY, LZ4 };
 
 struct comp_ctx;
 
+/* comp_prf_id has to fit into map_cell */
+#define COMP_PRF_ID_MAX U8_MAX
+
 struct comp_ops {
 	int (*get_private_ctx)(int comp_id, int decomp_id,
 			       struct comp_ctx *cctx);
 	int (*put_private_ctx)(struct comp_ctx *cctx);
-	int (*comp_chunk)(struct comp_ctx *cctx, struct chunk *data);
+	int (*comp_chunk)(struct comp_ctx *cctx, struct chunk *data,
+			  int comp_id);
 	int (*decomp_chunk)(struct comp_ctx *cctx, struct chunk *data,
 			    u32 expected_sz);
 	u32 (*get_dst_buf_sz)(struct comp_ctx *cctx, u32 data_for_comp_sz);
+	/* < 0 -- invalid comp_id, otherwise bigger value <=> better ratio */
+	int (*get_comp_strength)(int comp_id);
+
+	int safe_decomp_id; // decomp_id for blocks of another active profile
 };
 
 struct comp_ctx {
 	int comp_prf_id;
 	int decomp_prf_id;
+	int max_comp_prf_id; // strongest id comp_chunk() may be asked for
+	u32 min_saving; // bytes compression has to save to be worth storing
 	enum comp_profile prf;
 	void *private_ctx;
 	const struct comp_ops *ops;
+	struct cpu_acct *acct; // NULL -- not accounted, see cpu_acct.h
+
+	struct kref ref; // ctx published in bcomp_dev is switched at runtime
 };
 
-static inline int comp_src_to_dst(struct chunk *data, struct comp_ctx *ctx)
+static inline int comp_src_to_dst_id(struct chunk *data, int comp_id,
+				     struct comp_ctx *ctx)
 {
 	if (!ctx->ops->comp_chunk)
 		return -ENOTSUPP;
 
-	return ctx->ops->comp_chunk(ctx, data);
+	return ctx->ops->comp_chunk(ctx, data, comp_id);
+}
+
+static inline int comp_src_to_dst(struct chunk *data, struct comp_ctx *ctx)
+{
+	return comp_src_to_dst_id(data, ctx->comp_prf_id, ctx);
 }
 
 static inline int decomp_src_to_dst(struct chunk *data, u32 expected_sz,
@@ -76,6 +101,14 @@ static inline int decomp_src_to_dst(struct chunk *data, u32 expected_sz,
 	return ctx->ops->decomp_chunk(ctx, data, expected_sz);
 }
 
+/* profiles: preemption disabled since `start`, the codec only in between */
+static inline void comp_acct(struct comp_ctx *ctx, enum cpu_acct_op op,
+			     int id, u64 start, struct chunk *data, int ret)
+{
+	if (ctx->acct)
+		cpu_acct_add(ctx->acct, op, ctx, id, start, data, ret);
+}
+
 /*
 DOC:
 	comp_dst_buf_size() == 0 means that dst_buf would be allocated inside comp_chunk()
@@ -89,6 +122,32 @@ static inline u32 comp_dst_buf_size(u32 data_for_comp_sz, struct comp_ctx *ctx)
 	return ctx->ops->get_dst_buf_sz(ctx, data_for_comp_sz);
 }
 
+/*
+DOC:
+	Largest compressed size that still saves at least `min_saving` bytes
+	(at least one sector). Output that does not fit is stored raw, so
+	compressors may give up as soon as they cross this bound.
+	comp_useful_size() == 0 means that compression can't save anything.
+*/
+static inline u32 comp_useful_size(u32 data_for_comp_sz, struct comp_ctx *ctx)
+{
+	u32 saving = round_up(max_t(u32, ctx->min_saving, SECTOR_SIZE),
+			      SECTOR_SIZE);
+
+	if (data_for_comp_sz <= saving)
+		return 0;
+
+	return data_for_comp_sz - saving;
+}
+
+static inline int comp_strength(int comp_id, struct comp_ctx *ctx)
+{
+	if (!ctx->ops->get_comp_strength)
+		return -ENOTSUPP;
+
+	return ctx->ops->get_comp_strength(comp_id);
+}
+
 static inline void free_comp(struct comp_ctx *cctx)
 {
 	if (cctx->private_ctx)
@@ -120,4 +179,25 @@ int allocate_chunk_for_comp(struct chunk **chnk_ptr, u32 src_sz, u32 min_dst_sz,
 
 int init_comp_ops(enum comp_profile cprf, struct comp_ctx *cctx);
 
+/*
+DOC:
+	Decompression doesn't use private_ctx, so a block compressed with any
+	profile can be read through a temporary ctx built from its map_cell.
+	decomp_id < 0 -> profile's safe_decomp_id.
+*/
+int init_decomp_ctx(struct comp_ctx *dctx, enum comp_profile cprf,
+		    int decomp_id);
+
+void release_comp(struct kref *ref);
+
+static inline void get_comp(struct comp_ctx *cctx)
+{
+	kref_get(&cctx->ref);
+}
+
+static inline void put_comp(struct comp_ctx *cctx)
+{
+	kref_put(&cctx->ref, release_comp);
+}
+
 #endif /* BCOMP_COMP_COMMON */
\ No newline at end of file
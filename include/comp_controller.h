@@ -0,0 +1,66 @@
+#ifndef BCOMP_COMP_CONTROLLER
+#define BCOMP_COMP_CONTROLLER
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "comp_common.h"
+
+/*
+DOC:
+	Feedback controller choosing comp_prf_id for every write.
+
+	The configured [from-id, to-id] range is turned into a ladder of ids
+	sorted by comp_strength(). Once per window the controller looks at
+	the write backlog (in-flight writes) and, if set, at the achieved
+	MB/s and moves one step:
+		* backlog >= backlog_hi or MB/s < target (with backlog) -> faster
+		* backlog <= backlog_hi / 4 and MB/s >= target -> stronger
+ */
+
+#define CTL_LADDER_MAX (COMP_PRF_ID_MAX + 1)
+#define CTL_WINDOW_MS 100
+#define CTL_DEFAULT_BACKLOG 32
+
+struct comp_controller {
+	u8 ladder[CTL_LADDER_MAX];
+	int ladder_len;
+	atomic_t level; // index in ladder
+
+	u32 backlog_hi; // in-flight writes
+	u32 target_mbps; // 0 -- backlog only
+
+	atomic_t inflight;
+	atomic64_t window_bytes;
+	unsigned long window_start;
+	spinlock_t lock; // window evaluation
+
+	atomic64_t stronger_cnt;
+	atomic64_t faster_cnt;
+};
+
+struct comp_controller *alloc_comp_controller(int from_id, int to_id,
+					      u32 backlog_hi, u32 target_mbps,
+					      struct comp_ctx *cctx);
+void free_comp_controller(struct comp_controller *ctl);
+
+int comp_controller_start(struct comp_controller *ctl);
+void comp_controller_end(struct comp_controller *ctl, u32 bytes);
+void reset_comp_controller_stats(struct comp_controller *ctl);
+
+static inline int comp_controller_cur_id(struct comp_controller *ctl)
+{
+	return ctl->ladder[atomic_read(&ctl->level)];
+}
+
+static inline int comp_controller_max_id(struct comp_controller *ctl)
+{
+	int max_id = 0;
+
+	for (int i = 0; i < ctl->ladder_len; i++)
+		max_id = max_t(int, max_id, ctl->ladder[i]);
+
+	return max_id;
+}
+
+#endif /* BCOMP_COMP_CONTROLLER */
@@ -0,0 +1,67 @@
+#ifndef BCOMP_CPU_ACCT
+#define BCOMP_CPU_ACCT
+
+#include <linux/types.h>
+
+/*
+DOC:
+	CPU time of compression and decompression (per device).
+
+	Profiles of a ctx with `acct` set add the local_clock() time of the
+	codec, the call and bytes in/out to the counters of the CPU it ran
+	on, by op, profile and id. The codec runs with preemption disabled
+	and the clock starts after the per-CPU workspace is locked: waiting
+	for the workspace or for the CPU is not billed to anybody. Split
+	blocks are accounted per sub-stream, on the worker that ran it.
+
+	bcomp_stats shows the totals, debugfs `bio-comp-dev/cpu_time` every
+	(CPU, op, profile, id) with calls. A reset records a baseline.
+ */
+
+struct dentry;
+struct comp_ctx;
+struct chunk;
+
+enum cpu_acct_op {
+	CPU_ACCT_COMP,
+	CPU_ACCT_DECOMP,
+	CPU_ACCT_OPS
+};
+
+#define CPU_ACCT_IDS 32 // lz4 0..31, larger ids share the last slot
+
+struct cpu_acct_pcpu;
+
+struct cpu_acct {
+	struct cpu_acct_pcpu __percpu *pcpu;
+	struct cpu_acct_pcpu __percpu *base; // at the last reset
+	struct dentry *file;
+};
+
+#define PRITTY_CPU_ACCT_STATS_TEMPLATE \
+	"\
+comp_calls: %llu\n\
+comp_ns: %llu\n\
+comp_bytes_in: %llu\n\
+comp_bytes_out: %llu\n\
+decomp_calls: %llu\n\
+decomp_ns: %llu\n\
+decomp_bytes_in: %llu\n\
+decomp_bytes_out: %llu\n\
+"
+
+struct cpu_acct *alloc_cpu_acct(void);
+void free_cpu_acct(struct cpu_acct *acct);
+
+/* the device is live: the file is removed by free_cpu_acct() */
+void cpu_acct_debugfs(struct cpu_acct *acct, struct dentry *parent);
+
+/* preemption disabled since `start`; bytes out only count when ret == 0 */
+void cpu_acct_add(struct cpu_acct *acct, enum cpu_acct_op op,
+		  struct comp_ctx *ctx, int id, u64 start, struct chunk *data,
+		  int ret);
+
+int cpu_acct_stats_emit(char *buf, int at, struct cpu_acct *acct);
+void reset_cpu_acct_stats(struct cpu_acct *acct);
+
+#endif /* BCOMP_CPU_ACCT */
@@ -0,0 +1,65 @@
+#ifndef BCOMP_HEAT
+#define BCOMP_HEAT
+
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+/*
+DOC:
+	Hot/cold block tracking.
+
+	Every block has a saturating u8 access counter bumped by reads and
+	writes (plain racy stores: a lost update only makes the counter a bit
+	colder). Writes to a block with counter >= threshold are stored raw
+	and marked in the `raw` bitmap.
+
+	Every `age_sec` the aging worker walks the counters:
+		* raw-because-hot block with counter < threshold -> compressed
+		* compressed block with counter >= threshold -> stored raw
+	and halves them afterwards, so a block stays hot only while it is
+	being accessed. Conversions use bcomp_trylock_block(), foreground I/O
+	always wins.
+
+	Blocks under an explicit LBA-range rule are left to that rule.
+ */
+
+#define HEAT_DEFAULT_AGE_SEC 10
+
+struct bcomp_dev;
+
+struct heat_ctx {
+	struct bcomp_dev *bcdev;
+	u8 *cnt; // per block
+	unsigned long *raw; // per block: stored raw because hot
+	u8 threshold;
+	u32 age_sec;
+	struct delayed_work work;
+
+	atomic64_t hot_writes_cnt;
+	atomic64_t heated_cnt;
+	atomic64_t cooled_cnt;
+	atomic64_t passes_cnt;
+};
+
+#define PRITTY_HEAT_STATS_TEMPLATE \
+	"\
+heat_threshold: %u\n\
+heat_hot_writes_cnt: %lld\n\
+heat_heated_cnt: %lld\n\
+heat_cooled_cnt: %lld\n\
+heat_passes_cnt: %lld\n\
+"
+
+struct heat_ctx *alloc_heat(struct bcomp_dev *bcdev, u32 threshold,
+			    u32 age_sec);
+void free_heat(struct heat_ctx *hc);
+
+void heat_touch(struct heat_ctx *hc, sector_t lba);
+/* decides whether a write goes raw because the block is hot */
+bool heat_write_raw(struct heat_ctx *hc, sector_t lba);
+void heat_clear_raw(struct heat_ctx *hc, sector_t lba);
+
+int heat_stats_emit(char *buf, int at, struct heat_ctx *hc);
+void reset_heat_stats(struct heat_ctx *hc);
+
+#endif /* BCOMP_HEAT */
@@ -0,0 +1,81 @@
+#ifndef BCOMP_LAT_HIST
+#define BCOMP_LAT_HIST
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/timekeeping.h>
+
+/*
+DOC:
+	Per-stage latency histograms (debugfs `bio-comp-dev/`).
+
+	A request stamps the stages it goes through into bcomp_req.lat:
+		write: submit -> alloc -> compress -> map -> under_submit ->
+		       under_done -> endio
+		read:  submit -> map -> under_submit -> under_done ->
+		       decomp -> endio
+	A stage accounts the time since the previous stage the request
+	stamped, slot LAT_SUBMIT of a histogram holds the whole request
+	(submit -> endio). Requests served without the backend (caches,
+	holes) are not accounted. A dedup hit goes from alloc to endio,
+	the verification read included.
+
+	Buckets are log2 of nanoseconds in per-CPU arrays, reads sum the
+	CPUs; a reset records the sums as a baseline, like struct stats.
+	Percentiles are reported as the upper bound of their bucket.
+
+	Stamps are taken behind the bcomp_lat_key static key: with `enabled`
+	set to 0 the I/O path runs a patched-out branch and nothing else.
+ */
+
+enum lat_op {
+	LAT_READ,
+	LAT_WRITE,
+	LAT_OPS
+};
+
+enum lat_stage {
+	LAT_SUBMIT, // histogram slot: the whole request
+	LAT_ALLOC,
+	LAT_COMPRESS,
+	LAT_MAP,
+	LAT_UNDER_SUBMIT,
+	LAT_UNDER_DONE,
+	LAT_DECOMP,
+	LAT_ENDIO,
+	LAT_STAGES
+};
+
+#define LAT_BUCKETS 40 // 2^39 ns ~ 9 min, the last one takes the rest
+
+DECLARE_STATIC_KEY_TRUE(bcomp_lat_key);
+
+static inline u64 lat_now(void)
+{
+	return static_branch_likely(&bcomp_lat_key) ? ktime_get_ns() : 0;
+}
+
+static inline void lat_stamp(u64 *lat, enum lat_stage stage)
+{
+	if (static_branch_likely(&bcomp_lat_key))
+		lat[stage] = ktime_get_ns();
+}
+
+void __lat_record(enum lat_op op, const u64 *lat);
+
+/* stamps LAT_ENDIO and accounts the request */
+static inline void lat_done(enum lat_op op, u64 *lat)
+{
+	if (!static_branch_likely(&bcomp_lat_key))
+		return;
+
+	lat[LAT_ENDIO] = ktime_get_ns();
+	__lat_record(op, lat);
+}
+
+struct dentry;
+
+int lat_hist_init(struct dentry *parent);
+void lat_hist_exit(void);
+
+#endif /* BCOMP_LAT_HIST */
@@ -0,0 +1,98 @@
+#ifndef BCOMP_LOG_DEV
+#define BCOMP_LOG_DEV
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+/*
+DOC:
+	Write log on a separate fast device (`log=<path>`).
+
+	Writes (after compression) are appended to the log as a circular
+	buffer and completed when the log write completes. The index maps a
+	block to its newest record, reads of an indexed block go to the log.
+	The destage worker copies records to their home location on the
+	main device in append order and frees the log space; a record that
+	was superseded by a newer one is just skipped.
+
+	When the log is full, a write goes to the home location and drops
+	the block's record, so nothing waits for log space.
+
+	IMPORTANT:
+		Records are found by pba of sync helpers too, that works
+		only while pba == lba (linear map): the dedup map and the RAM
+		backend are refused with a log device.
+		Index updates and record release happen under the block lock.
+ */
+
+#define LOG_DESTAGE_MS 100
+
+struct bcomp_dev;
+struct block_device;
+struct file;
+
+struct log_rec {
+	struct list_head fifo;
+	sector_t lba;
+	sector_t sect; // on the log device
+	u32 len; // bytes written, rounded up to the logical block size
+	u32 span; // sectors taken from the log (with wrap padding)
+	bool done; // log write completed
+};
+
+struct log_ctx {
+	struct bcomp_dev *bcdev;
+	struct block_device *bdev;
+	struct file *bdev_fl;
+	sector_t nr_sects;
+	u32 lbs; // logical block size of the log device
+
+	spinlock_t lock; // fifo, head/tail, index; taken from end_io
+	struct list_head fifo; // append order
+	u64 head; // sectors appended, monotonic
+	u64 tail; // sectors released, monotonic
+	struct log_rec **idx; // per block, NULL -- home location is current
+
+	struct delayed_work work;
+
+	atomic64_t appended_cnt;
+	atomic64_t destaged_cnt;
+	atomic64_t full_cnt;
+	atomic64_t read_hits_cnt;
+	atomic64_t errors_cnt;
+};
+
+#define PRITTY_LOG_STATS_TEMPLATE \
+	"\
+log_sectors: %llu\n\
+log_used_sectors: %llu\n\
+log_appended_cnt: %lld\n\
+log_destaged_cnt: %lld\n\
+log_full_cnt: %lld\n\
+log_read_hits_cnt: %lld\n\
+log_errors_cnt: %lld\n\
+"
+
+struct log_ctx *alloc_log(struct bcomp_dev *bcdev, const char *path);
+/* destages everything first */
+void free_log(struct log_ctx *log);
+
+/*
+DOC:
+	Under the block lock. NULL -- no log space, the block's record is
+	dropped and the write goes to the home location.
+	The record has to be passed to log_commit() after the write.
+ */
+struct log_rec *log_reserve(struct log_ctx *log, sector_t lba, u32 data_sz);
+void log_commit(struct log_ctx *log, struct log_rec *rec, bool ok);
+
+/* under the block lock */
+struct log_rec *log_lookup(struct log_ctx *log, sector_t lba);
+void log_forget(struct log_ctx *log, sector_t lba);
+
+int log_stats_emit(char *buf, int at, struct log_ctx *log);
+void reset_log_stats(struct log_ctx *log);
+
+#endif /* BCOMP_LOG_DEV */
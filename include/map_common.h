@@ -7,13 +7,19 @@
 #include "bcomp_static.h"
 #include "comp_common.h"
 
-enum map_entity_flags { ENTITY_DATA_INITED, ENTITY_CELL_INITED };
+enum map_entity_flags { ENTITY_DATA_INITED, ENTITY_CELL_INITED, ENTITY_HOLE };
 
 //All map_cell belongs to map_ctx->private_ctx
 struct map_cell {
 	u32 lsize; // user expected size
 	u32 psize; // actual stored size
 
+	u8 cprf; // enum comp_profile the block was compressed with
+	u8 comp_prf_id; // level the block was compressed with
+	u32 wtime; // seconds (ktime_get_seconds()) of the last rewrite
+	u32 refcnt; // LBAs sharing the physical block (dedup), 1 otherwise
+	u8 nsub; // sub-streams of a compressed block, 0 -- single stream
+
 	sector_t lba;
 	sector_t pba;
 };
@@ -27,7 +33,15 @@ struct map_entity {
 	struct chunk *data; // doesn't belong to map_entity
 };
 
-#define is_data_compressed(cell) ((cell) != NULL)
+/* maps may keep a cell for a raw block too (dedup: pba != lba) */
+#define is_data_compressed(cell) \
+	((cell) != NULL && (cell)->psize < (cell)->lsize)
+
+/* a block without a cell is stored raw at pba == lba */
+static inline sector_t map_cell_pba(struct map_cell *cell, sector_t lba)
+{
+	return cell ? cell->pba : lba;
+}
 
 #define get_map_entity_pba(entity_ptr)                           \
 	(((entity_ptr)->cell == NULL) ? (entity_ptr)->cell_key : \
@@ -48,8 +62,9 @@ static inline void add_data_to_entity(struct chunk *data,
 }
 
 struct map_ctx;
+struct cell_manager_ops;
 
-enum map_profile { LINEAR };
+enum map_profile { LINEAR, DEDUP };
 
 struct map_ops {
 	int (*alloc_private_ctx)(struct map_ctx *mctx, sector_t storage_size,
@@ -57,15 +72,44 @@ struct map_ops {
 	int (*free_private_ctx)(struct map_ctx *mctx);
 	int (*update_cell)(struct map_ctx *mctx, sector_t lba, u32 lsize,
 			   u32 psize, struct map_cell **cell);
+	/* -ENODATA -- lba was never written (or discarded) */
 	int (*get_cell)(struct map_ctx *mctx, sector_t lba,
 			struct map_cell **cell);
 	//TODO: extend interface to work with non-linear mapping and rewrite all pipline
+
+	/*
+	DOC:
+		Optional (NULL -- not supported).
+		find_dup() returns a referenced cell with the same fingerprint
+		(or NULL), the caller verifies the content and either maps
+		lba to it with link_dup() (the reference is consumed) or drops
+		the reference with put_dup(). commit_cell() makes a written
+		cell visible to find_dup() after its data hit the disk (may be
+		called from bio end_io).
+	*/
+	int (*find_dup)(struct map_ctx *mctx, u64 fp, struct map_cell **cell);
+	int (*link_dup)(struct map_ctx *mctx, sector_t lba,
+			struct map_cell *cell);
+	void (*put_dup)(struct map_ctx *mctx, struct map_cell *cell);
+	void (*commit_cell)(struct map_ctx *mctx, struct map_cell *cell,
+			    u64 fp);
+	int (*discard_cell)(struct map_ctx *mctx, sector_t lba);
+
+	int (*stats_emit)(struct map_ctx *mctx, char *buf, int at);
+	void (*reset_stats)(struct map_ctx *mctx);
 };
 
 struct map_ctx {
 	enum map_profile prf;
 	void *private_ctx;
 	const struct map_ops *ops;
+
+	/*
+	Linear map: external cell manager (see map_pager.h), set before
+	init_map(), NULL -- every cell stays in memory. Owned by the caller.
+	 */
+	const struct cell_manager_ops *cell_ops;
+	void *cell_ctx;
 };
 
 static inline void free_map(struct map_ctx *map)
@@ -103,6 +147,70 @@ static inline int get_mapping(struct map_cell **cell, sector_t lba,
 	return mctx->ops->get_cell(mctx, lba, cell);
 }
 
+static inline bool map_has_dedup(struct map_ctx *mctx)
+{
+	return mctx->ops->find_dup != NULL;
+}
+
+static inline int find_dup_mapping(struct map_cell **cell, u64 fp,
+				   struct map_ctx *mctx)
+{
+	*cell = NULL;
+	if (!mctx->ops->find_dup)
+		return 0;
+
+	return mctx->ops->find_dup(mctx, fp, cell);
+}
+
+static inline int link_dup_mapping(sector_t lba, struct map_cell *cell,
+				   struct map_ctx *mctx)
+{
+	if (!mctx->ops->link_dup)
+		return -EOPNOTSUPP;
+
+	return mctx->ops->link_dup(mctx, lba, cell);
+}
+
+static inline void put_dup_mapping(struct map_cell *cell, struct map_ctx *mctx)
+{
+	if (mctx->ops->put_dup)
+		mctx->ops->put_dup(mctx, cell);
+}
+
+static inline void commit_mapping(struct map_cell *cell, u64 fp,
+				  struct map_ctx *mctx)
+{
+	if (mctx->ops->commit_cell && cell)
+		mctx->ops->commit_cell(mctx, cell, fp);
+}
+
+static inline bool map_can_discard(struct map_ctx *mctx)
+{
+	return mctx->ops->discard_cell != NULL;
+}
+
+static inline int discard_mapping(sector_t lba, struct map_ctx *mctx)
+{
+	if (!mctx->ops->discard_cell)
+		return -EOPNOTSUPP;
+
+	return mctx->ops->discard_cell(mctx, lba);
+}
+
+static inline int map_stats_emit(struct map_ctx *mctx, char *buf, int at)
+{
+	if (!mctx->ops->stats_emit)
+		return 0;
+
+	return mctx->ops->stats_emit(mctx, buf, at);
+}
+
+static inline void reset_map_stats(struct map_ctx *mctx)
+{
+	if (mctx->ops->reset_stats)
+		mctx->ops->reset_stats(mctx);
+}
+
 int init_map_ops(enum map_profile map_prf, struct map_ctx *mctx);
 
 #endif /* BCOMP_MAP_COMMON */
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef BCOMP_MAP_FILE
+#define BCOMP_MAP_FILE
+
+/* shared with tools/mkimage, so uapi types only */
+#include <linux/types.h>
+
+/*
+DOC:
+	Pre-built map (`linear` map, `mapfile=<path>`).
+
+	tools/mkimage compresses a source image offline and writes the
+	underlying image (every block at its home location, compressed data
+	at the start of the slot) and a map file:
+		| struct map_file_hdr | struct map_file_ent * blk_cnt |
+
+	At mapping time the file is read in MAP_FILE_IO pieces and every
+	entry with a psize becomes a compressed cell, the rest is raw. An
+	entry has the layout of struct meta_ent of the checkpoint.
+ */
+
+#define MAP_FILE_MAGIC 0x6662636dU // "mcbf"
+#define MAP_FILE_VERSION 1
+#define MAP_FILE_IO (1U << 20) // bytes per read while loading
+
+/* psize == 0 -- stored raw */
+struct map_file_ent {
+	__le32 psize;
+	__u8 cprf; // enum comp_profile
+	__u8 comp_prf_id;
+	__u8 nsub;
+	__u8 pad;
+} __attribute__((packed));
+
+struct map_file_hdr {
+	__le32 magic;
+	__le32 version;
+	__le32 bs;
+	__le32 pad;
+	__le64 blk_cnt; // entries after the header
+	__le32 ents_crc; // crc32_le(~0) of the entries
+	__le32 crc; // struct map_file_hdr, computed with crc == 0
+} __attribute__((packed));
+
+#ifdef __KERNEL__
+
+struct bcomp_dev;
+
+/* map is empty: a cell for every compressed entry of the file */
+int map_file_load(struct bcomp_dev *bcdev, const char *path);
+
+#endif /* __KERNEL__ */
+
+#endif /* BCOMP_MAP_FILE */
@@ -0,0 +1,127 @@
+#ifndef BCOMP_MAP_PAGER
+#define BCOMP_MAP_PAGER
+
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "bcomp_static.h"
+#include "map_common.h"
+
+/*
+DOC:
+	Bounded map memory (`linear` map, `map_mem=<MiB>`).
+
+	Cells are grouped in map pages of bs / sizeof(struct meta_ent)
+	consecutive blocks, a page on disk is one bs block of struct meta_ent
+	in a spill area at the tail of the underlying space (one block per
+	map page). Only resident pages take memory: the page table itself
+	(a pointer per map page) and the cells of compressed blocks.
+
+	A page that was never evicted has no copy on disk, its blocks are
+	raw. When the resident pages grow over the budget the evict worker
+	walks the resident list CLOCK-like (a page touched since the last
+	pass gets a second chance), writes a dirty page out and drops it.
+
+	Faults: a request finds its page missing under its block lock,
+	parks its bio on the fault of the page and returns; one async read
+	per page is in flight, its completion installs the page and
+	resubmits the parked bios. Background paths (process context, not
+	inside submit_bio) wait for the fault instead.
+
+	IMPORTANT:
+		A cell is only valid under its block lock, so a page is
+		evicted with the locks of all its blocks taken (trylock, a
+		busy page is skipped): nobody can hold a cell of it or fault
+		it in meanwhile.
+
+		The spill area is not persistent, the map is lost on unmap
+		like without the pager (see meta.h, blk_hdr.h).
+ */
+
+#define MAP_PAGER_LOW_PCT 90 // evict down to this part of the budget
+#define MAP_PAGER_MIN_PAGES 64 // the budget holds at least that many
+
+struct bcomp_dev;
+
+struct map_page {
+	struct list_head node; // pager->resident
+	u64 nr;
+	bool dirty; // differs from the disk copy
+	bool referenced; // touched since the last CLOCK pass
+	struct map_cell *cells[]; // per block of the page, NULL -- raw
+};
+
+struct map_fault {
+	struct list_head node; // pager->faults
+	struct map_pager *pager;
+	u64 nr;
+	char *buf;
+	blk_status_t status;
+	struct bio_list parked;
+	struct work_struct work;
+};
+
+struct map_pager {
+	struct bcomp_dev *bcdev;
+	sector_t start; // first sector of the spill area in the striped space
+	u32 bs;
+	u32 per_page; // blocks of a map page
+	u64 blk_cnt; // data blocks
+	u64 nr_pages;
+	u64 budget; // bytes of resident pages
+
+	struct map_page **pages; // NULL -- not resident
+	unsigned long *on_disk; // bit per map page, has a disk copy
+
+	spinlock_t lock;
+	struct list_head resident; // CLOCK order, the hand is at the tail
+	u64 nr_resident;
+	struct list_head faults; // map_fault in flight
+	wait_queue_head_t wait; // faults of process context
+	atomic64_t mem; // bytes of resident pages
+
+	struct workqueue_struct *wq; // fault completion, eviction
+	struct work_struct evict_work;
+
+	atomic64_t faults_cnt;
+	atomic64_t parked_cnt;
+	atomic64_t evicted_cnt;
+	atomic64_t written_cnt;
+	atomic64_t errors_cnt;
+};
+
+#define PRITTY_MAP_PAGER_STATS_TEMPLATE \
+	"\
+pager_budget_bytes: %llu\n\
+pager_mem_bytes: %lld\n\
+pager_pages: %llu\n\
+pager_faults_cnt: %lld\n\
+pager_parked_cnt: %lld\n\
+pager_evicted_cnt: %lld\n\
+pager_written_cnt: %lld\n\
+pager_errors_cnt: %lld\n\
+"
+
+/* takes the spill area off under_dev->nr_sects, before the map is built */
+struct map_pager *alloc_map_pager(struct bcomp_dev *bcdev,
+				  enum w_block_size bs, u32 mem_mb);
+/* before under_dev and the map: it evicts to the first, the map borrows it */
+void free_map_pager(struct map_pager *pager);
+
+/* cell manager of the linear map, see map_ctx->cell_ops */
+const struct cell_manager_ops *get_map_pager_cell_ops(void);
+
+/*
+under the block lock of lba: false -- the page is resident, go on,
+true -- bio is parked and will be resubmitted, drop the lock and return
+ */
+bool map_pager_park(struct map_pager *pager, sector_t lba, struct bio *bio);
+
+int map_pager_stats_emit(char *buf, int at, struct map_pager *pager);
+void reset_map_pager_stats(struct map_pager *pager);
+
+#endif /* BCOMP_MAP_PAGER */
@@ -0,0 +1,81 @@
+#ifndef BCOMP_MEM_STORE
+#define BCOMP_MEM_STORE
+
+#include <linux/string.h>
+#include <linux/types.h>
+
+/*
+DOC:
+	RAM backend (`mem:<MiB>` instead of the underlying device path).
+
+	Every stored block is one object of the smallest size class that fits
+	its psize: MEM_CLASSES kmem_caches of bs / MEM_CLASSES steps, so a
+	block wastes less than bs / MEM_CLASSES bytes. Objects are indexed by
+	block number of the pba, reads and writes complete synchronously.
+	An empty slot reads as a raw block of zeroes (a fresh device is
+	probed and formatted before anything is written).
+
+	`limit` caps the memory held by objects (0 -- no cap), a write that
+	doesn't fit fails with -ENOSPC.
+
+	IMPORTANT:
+		Slots are not locked here: every access is made under the block
+		lock of the pba. That holds only while pba == lba (linear map),
+		the dedup map is refused with this backend.
+ */
+
+#define MEM_PATH_PREFIX "mem:"
+#define MEM_CLASSES 16
+
+struct bio;
+struct buffer;
+struct kmem_cache;
+
+struct mem_obj {
+	u32 sz;
+	u8 cls;
+	char data[];
+};
+
+struct mem_store {
+	u32 bs;
+	u64 nr_blocks;
+	u64 limit; // bytes, 0 -- unlimited
+	struct mem_obj **slots;
+	struct kmem_cache *classes[MEM_CLASSES];
+
+	atomic64_t used_bytes; // object sizes (with class padding)
+	atomic64_t stored_bytes; // payload
+	atomic64_t objs_cnt;
+	atomic64_t nospace_cnt;
+};
+
+#define PRITTY_MEM_STORE_STATS_TEMPLATE \
+	"\
+mem_limit_bytes: %llu\n\
+mem_used_bytes: %lld\n\
+mem_stored_bytes: %lld\n\
+mem_objs_cnt: %lld\n\
+mem_nospace_cnt: %lld\n\
+"
+
+static inline bool is_mem_path(const char *path)
+{
+	return !strncmp(path, MEM_PATH_PREFIX, strlen(MEM_PATH_PREFIX));
+}
+
+/* "mem:<MiB>" -> capacity in sectors */
+int parse_mem_path(const char *path, sector_t *nr_sects);
+
+struct mem_store *alloc_mem_store(u32 bs, u64 nr_blocks, u32 limit_mb);
+void free_mem_store(struct mem_store *ms);
+
+int mem_store_write(struct mem_store *ms, u64 key, const char *data, u32 sz);
+/* buf->data_sz = stored size */
+int mem_store_read(struct mem_store *ms, u64 key, struct buffer *buf);
+int mem_store_read_bio(struct mem_store *ms, u64 key, struct bio *bio);
+
+int mem_store_stats_emit(char *buf, int at, struct mem_store *ms);
+void reset_mem_store_stats(struct mem_store *ms);
+
+#endif /* BCOMP_MEM_STORE */
@@ -0,0 +1,156 @@
+#ifndef BCOMP_META
+#define BCOMP_META
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "bcomp_static.h"
+
+/*
+DOC:
+	Persistent map metadata (`linear` map).
+
+	The tail of the underlying space is taken by a metadata area, in
+	blocks of bs:
+		| sb 0 | sb 1 | checkpoint 0 | checkpoint 1 | journal ring |
+
+	A checkpoint is a dense array of struct meta_ent, one per data
+	block. The journal is a ring of blocks of struct meta_jent, every
+	block carries its sequence number and crc, its position in the ring
+	is seq % journal_blks. A superblock names the active checkpoint and
+	the first journal block to replay over it, the copy with the newest
+	generation wins.
+
+	Group commit: a completed data write doesn't finish its bio, it
+	queues a journal entry with the new state of the block. The commit
+	worker flushes the members once per batch (the data is durable),
+	writes the entries with REQ_FUA and completes all bios of the batch.
+
+	A checkpoint is written to the other slot when the journal is half
+	full: the map is walked block by block under the block lock, the
+	members are flushed and the superblock moves to the new slot with the
+	journal tail. Remount reads the checkpoint and replays only the
+	journal blocks written after it.
+
+	IMPORTANT:
+		Blocks are rewritten in place, so a write that was not
+		acknowledged before a crash may leave its block unreadable.
+		Background in-place rewrites of acknowledged blocks
+		(recompression, hot/cold conversion) are refused for this
+		reason.
+ */
+
+#define META_MAGIC 0x7062636dU // "mcbp"
+#define META_JOURNAL_MAGIC 0x6a62636dU // "mcbj"
+#define META_VERSION 2
+#define META_VERSION_NO_WRITTEN 1 // entries carry no META_ENT_WRITTEN
+
+#define META_SB_BLKS 2
+#define META_MIN_JOURNAL_BLKS 16
+#define META_IO_BLKS 32 // checkpoint blocks in flight
+
+struct bcomp_dev;
+struct bcomp_req;
+
+#define META_ENT_WRITTEN 0x1 // see bcomp_dev.written
+
+/* state of one block, psize == 0 -- stored raw */
+struct meta_ent {
+	__le32 psize;
+	u8 cprf;
+	u8 comp_prf_id;
+	u8 nsub;
+	u8 flags;
+} __packed;
+
+struct meta_jent {
+	__le64 key;
+	struct meta_ent ent;
+} __packed;
+
+struct meta_jblk_hdr {
+	__le32 magic;
+	__le32 crc; // the whole block, computed with crc == 0
+	__le64 seq;
+	__le32 nr;
+	__le32 pad;
+} __packed;
+
+struct meta_sb {
+	__le32 magic;
+	__le32 version;
+	__le64 gen;
+
+	__le32 bs;
+	__le32 ckpt_slot;
+	__le64 blk_cnt;
+	__le64 ckpt_blks;
+	__le64 journal_blks;
+
+	__le64 jseq; // first journal block to replay
+	__le32 ckpt_crc;
+	__le32 crc; // struct meta_sb, computed with crc == 0
+} __packed;
+
+struct meta_ctx {
+	struct bcomp_dev *bcdev;
+	sector_t start; // first sector of the area in the striped space
+	u32 bs;
+	u64 blk_cnt; // data blocks
+	u64 ckpt_blks;
+	u64 journal_blks;
+
+	spinlock_t lock;
+	struct list_head pending; // bcomp_req waiting for a journal commit
+	u64 head; // seq of the next journal block
+	u64 tail; // seq of the first block the checkpoint needs
+	u64 gen;
+	u32 ckpt_slot;
+	bool ckpt_queued;
+
+	char *jbuf; // commit worker only
+	wait_queue_head_t wait; // commit waits for journal space
+
+	struct workqueue_struct *wq; // can't share bcdev->wq
+	struct work_struct commit_work;
+	struct work_struct ckpt_work;
+
+	atomic64_t commits_cnt;
+	atomic64_t entries_cnt;
+	atomic64_t ckpts_cnt;
+	atomic64_t replayed_cnt;
+	atomic64_t errors_cnt;
+};
+
+#define PRITTY_META_STATS_TEMPLATE \
+	"\
+meta_journal_blocks: %llu\n\
+meta_journal_used_blocks: %llu\n\
+meta_commits_cnt: %lld\n\
+meta_entries_cnt: %lld\n\
+meta_checkpoints_cnt: %lld\n\
+meta_replayed_cnt: %lld\n\
+meta_errors_cnt: %lld\n\
+"
+
+/* takes the area off under_dev->nr_sects, before the map is built */
+struct meta_ctx *alloc_meta(struct bcomp_dev *bcdev, enum w_block_size bs,
+			    u32 journal_mb);
+/* commits everything and writes the last checkpoint */
+void free_meta(struct meta_ctx *meta);
+
+/* map is empty: loads the checkpoint and replays the journal (or formats) */
+int meta_load(struct meta_ctx *meta);
+
+/* under the block lock: the state the write left */
+void meta_encode(struct meta_ctx *meta, struct bcomp_req *req);
+/* completes the request once its entry is durable */
+void meta_journal(struct meta_ctx *meta, struct bcomp_req *req);
+
+int meta_stats_emit(char *buf, int at, struct meta_ctx *meta);
+void reset_meta_stats(struct meta_ctx *meta);
+
+#endif /* BCOMP_META */
@@ -0,0 +1,83 @@
+#ifndef BCOMP_POLICY
+#define BCOMP_POLICY
+
+#include <linux/bio.h>
+#include <linux/rcupdate.h>
+#include <linux/types.h>
+
+#include "comp_common.h"
+
+/*
+DOC:
+	Per-request compression policy.
+
+	Table "<class>:<action>[,<class>:<action>...]", where
+		class  -- meta | fua | sync (bio flags) or
+			  rt | be | idle (ioprio class of the bio, none == be)
+		action -- comp_prf_id | raw (no compression) | default
+	Flags are checked first (meta, fua, sync), then the ioprio class.
+	The first class with a non-default action decides; otherwise the
+	controller or the fixed comp_prf_id is used.
+ */
+
+#define POLICY_DELIMITER ','
+
+#define POLICY_DEFAULT (-1)
+#define POLICY_RAW (-2)
+
+enum policy_class {
+	POLICY_META,
+	POLICY_FUA,
+	POLICY_SYNC,
+	POLICY_RT,
+	POLICY_BE,
+	POLICY_IDLE,
+	POLICY_CLASS_N
+};
+
+struct comp_policy {
+	int action[POLICY_CLASS_N];
+	struct rcu_head rcu;
+};
+
+struct comp_policy *parse_comp_policy(const char *arg, int len);
+
+/* ids have to be valid for cctx and fit its workspaces (bcomp_grow_comp()) */
+int validate_comp_policy(struct comp_policy *pol, struct comp_ctx *cctx);
+int comp_policy_max_id(struct comp_policy *pol);
+
+int comp_policy_action(struct comp_policy *pol, struct bio *bio);
+int comp_policy_emit(char *buf, int at, struct comp_policy *pol);
+
+/*
+DOC:
+	Per-LBA-range policy, takes precedence over the per-request one.
+
+	Table "<first-sector>-<last-sector>:<action>[,...]" with the same
+	actions. Ranges are kept sorted and must not overlap, so the write
+	path finds the range of a bio with a binary search.
+ */
+
+#define RANGE_DELIMITER '-'
+#define RANGES_MAX 4096
+
+struct comp_range {
+	sector_t first;
+	sector_t last;
+	int action;
+};
+
+struct comp_range_table {
+	int len;
+	struct rcu_head rcu;
+	struct comp_range ranges[];
+};
+
+struct comp_range_table *parse_comp_ranges(const char *arg, int len);
+int validate_comp_ranges(struct comp_range_table *tbl, struct comp_ctx *cctx);
+int comp_ranges_max_id(struct comp_range_table *tbl);
+
+int comp_ranges_action(struct comp_range_table *tbl, sector_t lba);
+int comp_ranges_emit(char *buf, int at, struct comp_range_table *tbl);
+
+#endif /* BCOMP_POLICY */
@@ -0,0 +1,83 @@
+#ifndef BCOMP_PREFETCH
+#define BCOMP_PREFETCH
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+/*
+DOC:
+	Sequential read prefetch.
+
+	A few stream slots remember where the last reads ended. A read that
+	continues a stream PREFETCH_MIN_RUN times in a row queues the next
+	`depth` blocks of the stream. The worker submits the whole window as
+	async bios under a plug and returns; completions decompress the
+	blocks on bcdev->wq and put them into the block cache, so the reader
+	finds them there. A stream queues its next window while the current
+	one is in flight, every stream has its own pending range.
+
+	`depth` adapts to the share of prefetched blocks that were actually
+	read (blk_cache prefetch hits) every PREFETCH_WINDOW blocks:
+		* hit rate >= PREFETCH_GROW_PCT -> doubled (up to max_depth)
+		* hit rate < PREFETCH_SHRINK_PCT -> halved (down to 1)
+
+	The worker uses bcomp_trylock_block(), blocks busy with foreground
+	I/O are skipped; a submitted block stays locked until it is in the
+	cache. Holes and raw blocks are skipped too: there is nothing to
+	decompress ahead.
+ */
+
+#define PREFETCH_STREAMS 8
+#define PREFETCH_MIN_RUN 2
+#define PREFETCH_WINDOW 64
+#define PREFETCH_GROW_PCT 75
+#define PREFETCH_SHRINK_PCT 25
+
+struct bcomp_dev;
+
+struct prefetch_stream {
+	sector_t next; // lba a continuing read starts at
+	sector_t pend_from; // [pend_from, issued_to) waits for the worker
+	sector_t issued_to; // prefetch was queued up to (exclusive)
+	u32 run; // reads in a row
+	unsigned long last; // jiffies of the last read, slot replacement
+};
+
+struct prefetch_ctx {
+	struct bcomp_dev *bcdev;
+
+	spinlock_t lock;
+	struct prefetch_stream streams[PREFETCH_STREAMS];
+	struct work_struct work;
+	atomic_t inflight; // submitted blocks not in the cache yet
+
+	u32 max_depth; // blocks
+	u32 depth;
+	u64 win_issued;
+	u64 win_hits_base; // blk_cache prefetch hits at the window start
+
+	atomic64_t triggered_cnt;
+	atomic64_t issued_cnt;
+	atomic64_t skipped_cnt;
+};
+
+#define PRITTY_PREFETCH_STATS_TEMPLATE \
+	"\
+prefetch_depth: %u\n\
+prefetch_triggered_cnt: %lld\n\
+prefetch_issued_cnt: %lld\n\
+prefetch_skipped_cnt: %lld\n\
+"
+
+struct prefetch_ctx *alloc_prefetch(struct bcomp_dev *bcdev, u32 max_depth);
+void free_prefetch(struct prefetch_ctx *pc);
+
+/* called for every read before it is served */
+void prefetch_read(struct prefetch_ctx *pc, sector_t lba);
+
+int prefetch_stats_emit(char *buf, int at, struct prefetch_ctx *pc);
+void reset_prefetch_stats(struct prefetch_ctx *pc);
+
+#endif /* BCOMP_PREFETCH */
@@ -0,0 +1,62 @@
+#ifndef BCOMP_RAW_IO
+#define BCOMP_RAW_IO
+
+/* shared with userspace, so uapi types only */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+DOC:
+	Stored-form block export/import (ioctls of the bcomp disk).
+
+	BCOMP_IOC_EXPORT fills every struct bcomp_raw_blk of the array from
+	its lba: the block as it is stored (psize bytes of compressed data,
+	or bs bytes of a raw block, psize == lsize) and the cell metadata
+	needed to decompress it. Nothing is decompressed.
+
+	BCOMP_IOC_IMPORT is the mirror: the data is written to the home
+	location of lba as is and the map points to it, nothing is
+	compressed. The metadata is checked, the compressed data is not: a
+	block that doesn't decompress fails on read.
+
+	Both need CAP_SYS_ADMIN, take the block lock of every block and
+	write back the write-back cache first, `done` reports the blocks
+	processed when an error stops the batch. Import needs the disk
+	opened for writing and is refused with dedup and meta= (the journal
+	is fed by the write path only). The RAM backend has no stored form
+	to share and refuses both.
+ */
+
+#define BCOMP_IOC_MAGIC 0xbc
+#define BCOMP_RAW_MAX_NR 256 // blocks per call
+
+struct bcomp_raw_blk {
+	__u64 lba; // sector, bs aligned
+	__u32 lsize; // bs
+	__u32 psize; // == lsize -- stored raw
+	__u8 cprf; // enum comp_profile
+	__u8 comp_prf_id;
+	__u8 nsub; // sub-streams, see split_comp.h
+	__u8 pad[5];
+	__u64 data; // user buffer of lsize bytes
+};
+
+struct bcomp_raw_io {
+	__u64 blks; // struct bcomp_raw_blk[nr]
+	__u32 nr;
+	__u32 done; // out
+};
+
+#define BCOMP_IOC_EXPORT _IOWR(BCOMP_IOC_MAGIC, 1, struct bcomp_raw_io)
+#define BCOMP_IOC_IMPORT _IOWR(BCOMP_IOC_MAGIC, 2, struct bcomp_raw_io)
+
+#ifdef __KERNEL__
+
+struct bcomp_dev;
+
+int bcomp_raw_export(struct bcomp_dev *bcdev, struct bcomp_raw_io *io);
+int bcomp_raw_import(struct bcomp_dev *bcdev, struct bcomp_raw_io *io);
+
+#endif /* __KERNEL__ */
+
+#endif /* BCOMP_RAW_IO */
@@ -0,0 +1,76 @@
+#ifndef BCOMP_RECOMPRESS
+#define BCOMP_RECOMPRESS
+
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include "comp_common.h"
+
+/*
+DOC:
+	Background recompression of cold blocks.
+
+	The worker walks the map in block order, `budget` blocks per second,
+	(only while the device is idle in RECOMP_IDLE mode). A compressed
+	block that was not rewritten for `cold_sec` and was compressed with a
+	weaker level than `comp_prf_id` is read, recompressed and rewritten
+	only if it shrinks. Blocks are taken with bcomp_trylock_block(), so
+	foreground I/O always wins.
+
+	recomp_psize_delta_bytes sums how much the stored blocks shrank. It
+	is not reclaimed space: a block backend keeps the whole bs slot of a
+	block at pba == lba, only the RAM backend frees memory (down to its
+	size classes, see mem_used_bytes).
+
+	Trigger (bcomp_recompress module parameter):
+		"<comp-prfl-id> <blocks-per-sec> <cold-sec> <idle|always>"
+		"stop"
+ */
+
+#define RECOMP_TICK_MS 100
+#define RECOMP_IDLE_MS 1000 // no bios for this long <=> device is idle
+#define RECOMP_MODE_STR_LEN 8
+
+enum recomp_mode { RECOMP_IDLE, RECOMP_ALWAYS };
+
+struct bcomp_dev;
+
+struct recomp_ctx {
+	struct bcomp_dev *bcdev;
+	struct comp_ctx *cctx; // target level (own workspaces)
+	struct delayed_work work;
+
+	enum recomp_mode mode;
+	u32 budget; // blocks per second
+	u32 cold_sec;
+
+	u64 cursor; // next block key
+	bool running;
+
+	atomic64_t scanned_cnt;
+	atomic64_t recompressed_cnt;
+	atomic64_t psize_delta_bytes; // not freed space, see DOC
+	atomic64_t passes_cnt;
+};
+
+#define PRITTY_RECOMP_STATS_TEMPLATE \
+	"\
+recomp_comp_prf_id: %d\n\
+recomp_running: %d\n\
+recomp_cursor: %llu/%llu\n\
+recomp_scanned_cnt: %lld\n\
+recomp_recompressed_cnt: %lld\n\
+recomp_psize_delta_bytes: %lld\n\
+recomp_passes_cnt: %lld\n\
+"
+
+int trigger_recomp(struct bcomp_dev *bcdev, const char *arg);
+
+/* 0 -- converted, -EBUSY -- block is in use, -ENODATA -- nothing to do */
+int recomp_store_raw(struct bcomp_dev *bcdev, sector_t lba);
+int recomp_compress_raw(struct bcomp_dev *bcdev, sector_t lba);
+void free_recomp(struct recomp_ctx *rc);
+int recomp_stats_emit(char *buf, int at, struct recomp_ctx *rc);
+void reset_recomp_stats(struct recomp_ctx *rc);
+
+#endif /* BCOMP_RECOMPRESS */
@@ -22,12 +22,47 @@ const char **get_available_bs_names(void);
 const enum comp_profile *get_available_cprf_enum(void);
 const char **get_available_cprf_names(void);
 
-#define MPRF_N 1
+#define MPRF_N 2
 #define MPRF_STR_LEN 10
 const enum map_profile *get_available_mprf_enum(void);
 const char **get_available_mprf_names(void);
 
 #define MAX_PRF_ID_STR_LEN 10
+#define MAX_NUM_STR_LEN 21
+
+/*
+DOC:
+	Optional `<name>=<value>` tokens after the path.
+*/
+#define OPTION_DELIMITER '='
+#define OPTION_RANGE_DELIMITER ':'
+#define OPTION_STR_LEN 64 // value, path options take up to PATH_MAX
+
+enum option_id {
+	OPT_MIN_SAVING,
+	OPT_ADAPT,
+	OPT_ADAPT_BACKLOG,
+	OPT_ADAPT_MBPS,
+	OPT_POLICY,
+	OPT_HOT,
+	OPT_HOT_AGE,
+	OPT_SPLIT,
+	OPT_CACHE,
+	OPT_PREFETCH,
+	OPT_MEM_LIMIT,
+	OPT_WB,
+	OPT_WB_RATE,
+	OPT_LOG,
+	OPT_STRIPE,
+	OPT_META,
+	OPT_HDR,
+	OPT_REBUILD,
+	OPT_MAP_MEM,
+	OPT_MAPFILE,
+	OPT_SPARSE,
+	OPT_N
+};
+const char **get_available_option_names(void);
 
 enum setting_enum_id { BS_ENUM, COMP_ENUM, MAP_ENUM };
 
@@ -38,6 +73,37 @@ struct user_settings {
 	int dcprf_id;
 	enum map_profile map_prf;
 	char *path;
+
+	/* options */
+	u32 min_saving;
+
+	bool adapt;
+	int adapt_from_id;
+	int adapt_to_id;
+	u32 adapt_backlog;
+	u32 adapt_mbps;
+
+	struct comp_policy *policy; // NULL -- no policy, see policy.h
+
+	u32 hot_threshold; // 0 -- no hot/cold tracking, see heat.h
+	u32 hot_age_sec;
+
+	u32 split; // 0 -- single stream per block, see split_comp.h
+	u32 cache_mb; // 0 -- no decompressed-block cache, see blk_cache.h
+	u32 prefetch; // max read-ahead in blocks, 0 -- off, see prefetch.h
+	u32 mem_limit_mb; // RAM backend cap, 0 -- unlimited
+
+	u32 wb_mb; // dirty cap, 0 -- no write-back cache, see writeback.h
+	u32 wb_rate; // destage MB/s, 0 -- unlimited
+
+	char *log_path; // NULL -- no log device, see log_dev.h
+	u32 stripe; // stripe unit in blocks for several paths, 0 -- one block
+	u32 meta_mb; // journal size, 0 -- map isn't persistent, see meta.h
+	u32 hdr; // compressed blocks carry a trailer, see blk_hdr.h
+	u32 rebuild; // rebuild the map from the trailers (implies hdr)
+	u32 map_mem_mb; // map memory budget, 0 -- unbounded, see map_pager.h
+	char *mapfile_path; // NULL -- the map starts empty, see map_file.h
+	u32 sparse; // reads of never-written blocks are zeroes
 };
 
 enum parser_stage {
@@ -47,6 +113,7 @@ enum parser_stage {
 	DECOMP_PROFILE_ID_STG,
 	MAP_PROFILE_STG,
 	PATH_STG,
+	OPTIONS_STG,
 	END_STG,
 	INVALID_STG
 };
@@ -56,6 +123,8 @@ enum parser_stage {
 	 (stage) == COMP_PROFILE_ID_STG ? "compress profile id" :   \
 	 (stage) == DECOMP_PROFILE_ID_STG ? "decompress profile id" :   \
 	 (stage) == MAP_PROFILE_STG	? "map profile" :           \
+	 (stage) == PATH_STG		? "path" :                  \
+	 (stage) == OPTIONS_STG		? "options" :               \
 	 (stage) == END_STG		? "unprented stage (END)" : \
 					  "unexpected stage")
 
@@ -64,4 +133,8 @@ void free_user_settings(struct user_settings *settings);
 enum parser_stage parse_user_settings(const char *arg,
 				      struct user_settings *settings);
 
+/* "<comp-profile> <comp-prfl-id> <decomp-prfl-id>" part of the bcomp-table */
+enum parser_stage parse_comp_settings(const char *arg,
+				      struct user_settings *settings);
+
 #endif /* BCOMP_MODULE_SETTINGS */
@@ -0,0 +1,40 @@
+#ifndef BCOMP_SPLIT_COMP
+#define BCOMP_SPLIT_COMP
+
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include "comp_common.h"
+
+/*
+DOC:
+	Intra-block parallel compression.
+
+	A block is split into `nsub` equal sub-streams compressed
+	independently: sub-stream 0 in the caller, the rest on other CPUs
+	(workqueue). Stored layout:
+		__le32 sub_psize[nsub] | sub-stream 0 | ... | sub-stream nsub-1
+	sub_psize == sub-stream size means the sub-stream is stored raw.
+	The whole block is stored raw (dst.data_sz == src.data_sz) if the
+	result doesn't fit into dst_limit.
+
+	Decompression runs the sub-streams in parallel the same way, so both
+	functions sleep and must not be called from bio end_io.
+ */
+
+#define SPLIT_MAX 8
+#define SPLIT_MIN_SUB_SZ 4096
+
+static inline u32 split_hdr_size(int nsub)
+{
+	return nsub * sizeof(__le32);
+}
+
+int validate_split(int nsub, u32 bs, struct comp_ctx *cctx);
+
+int split_comp_chunk(struct workqueue_struct *wq, struct chunk *chnk,
+		     int comp_id, int nsub, struct comp_ctx *cctx);
+int split_decomp_chunk(struct workqueue_struct *wq, struct chunk *chnk,
+		       u32 expected_sz, int nsub, struct comp_ctx *dctx);
+
+#endif /* BCOMP_SPLIT_COMP */
@@ -2,6 +2,7 @@
 #define BCOMP_STATS
 
 #include <linux/types.h>
+#include <linux/percpu.h>
 
 enum compression_level {
 	LESS_25_P = 25,
@@ -10,31 +11,88 @@ enum compression_level {
 	LESS_99_P = 99
 };
 
-struct stats {
-	atomic64_t all_reqs_cnt;
-	atomic64_t uncompressed_reqs_cnt;
+/*
+DOC:
+	Device counters are per CPU: the I/O path adds to the counter of the
+	CPU it runs on (this_cpu_add() is irq safe, no shared cacheline),
+	readers sum all CPUs. A reset doesn't touch the CPUs, it records the
+	current sums as the baseline the read subtracts.
+
+	A read racing with updates sees every counter at some point of the
+	race, not all of them at the same one. On 32-bit a 64-bit counter
+	may be read torn, the stats are advisory.
+ */
+enum stat_item {
+	/* writes */
+	STAT_ALL_REQS,
+	STAT_UNCOMPRESSED_REQS,
+	STAT_DATA_IN_BYTES,
+	STAT_COMPRESSED_DATA_IN_BYTES,
+	STAT_COMPRESSED_REQS_25, // 0% <= compressed_data < 25%
+	STAT_COMPRESSED_REQS_50, // 25% <= compressed_data < 50%
+	STAT_COMPRESSED_REQS_75, // 50% <= compressed_data < 75%
+	STAT_COMPRESSED_REQS_99, // 75% <= compressed_data < 100%
+
+	/* reads */
+	STAT_READ_REQS, // every read bio, hits of the caches included
+	STAT_READ_BYTES,
+	STAT_READ_DECOMP_REQS, // decompressed from the backend
+	STAT_READ_RAW_REQS, // stored raw, read from the backend
+	STAT_READ_ERRORS,
+	STAT_UNWRITTEN_READS, // zero-filled, see bcomp_blk_unwritten()
 
-	atomic64_t data_in_bytes;
-	atomic64_t compressed_data_in_bytes;
+	STAT_NR
+};
+
+struct stats_pcpu {
+	u64 cnt[STAT_NR];
+};
 
-	atomic64_t compressed_reqs_cnt_25; // 0% <= compressed_data < 25%
-	atomic64_t compressed_reqs_cnt_50; // 25% <= compressed_data < 50%
-	atomic64_t compressed_reqs_cnt_75; // 50% <= compressed_data < 75%
-	atomic64_t compressed_reqs_cnt_99; // 75% <= compressed_data < 100%
+struct stats {
+	struct stats_pcpu __percpu *pcpu;
+	u64 base[STAT_NR]; // sums at the last reset
 };
 
+static inline void stats_add(struct stats *stats, enum stat_item item, u64 v)
+{
+	this_cpu_add(stats->pcpu->cnt[item], v);
+}
+
+static inline void stats_inc(struct stats *stats, enum stat_item item)
+{
+	stats_add(stats, item, 1);
+}
+
 #define PRITTY_STATS_TEMPLATE \
 	"\
-compressed_reqs_cnt_25: %lld\n\
-compressed_reqs_cnt_50: %lld\n\
-compressed_reqs_cnt_75: %lld\n\
-compressed_reqs_cnt_99: %lld\n\
-uncompressed_reqs_cnt: %lld\n\
-all_reqs_cnt: %lld\n\
-data_in_bytes: %lld\n\
-compressed_data_in_bytes: %lld\n\
+compressed_reqs_cnt_25: %llu\n\
+compressed_reqs_cnt_50: %llu\n\
+compressed_reqs_cnt_75: %llu\n\
+compressed_reqs_cnt_99: %llu\n\
+uncompressed_reqs_cnt: %llu\n\
+all_reqs_cnt: %llu\n\
+data_in_bytes: %llu\n\
+compressed_data_in_bytes: %llu\n\
+read_reqs_cnt: %llu\n\
+read_bytes: %llu\n\
+read_decomp_reqs_cnt: %llu\n\
+read_raw_reqs_cnt: %llu\n\
+read_errors_cnt: %llu\n\
+unwritten_reads_cnt: %llu\n\
+"
+
+#define PRITTY_CTL_STATS_TEMPLATE \
+	"\
+adapt_comp_prf_id: %d\n\
+adapt_inflight: %d\n\
+adapt_stronger_cnt: %lld\n\
+adapt_faster_cnt: %lld\n\
 "
 
+struct stats *alloc_stats(void);
+void free_stats(struct stats *stats);
+u64 stats_read(struct stats *stats, enum stat_item item);
+int stats_emit(char *buf, int at, struct stats *stats);
 void reset_stats(struct stats *stats);
 
 enum compression_level get_compression_level(u32 compressed_sz, u32 source_sz);
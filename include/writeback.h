@@ -0,0 +1,123 @@
+#ifndef BCOMP_WRITEBACK
+#define BCOMP_WRITEBACK
+
+#include <linux/types.h>
+#include <linux/blk_types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#include "comp_common.h"
+
+/*
+DOC:
+	Write-back cache.
+
+	Writes are copied into a per-block dirty entry and acknowledged right
+	away, an overwrite of a dirty block is absorbed into its entry. The
+	destage worker compresses and writes dirty blocks in batches of
+	WB_BATCH: every entry goes as a bio to bcomp_submit_bio() directly,
+	so it takes the regular write path (levels, policy, dedup, stats)
+	and needs no live gendisk: the sync of del_gendisk() dirties
+	blocks after the disk is dead, free_wb() destages them too. A
+	destage bio carries the REQ_META/FUA/SYNC hints and the ioprio of the
+	last write absorbed, so the compression policy sees the client.
+
+	Destaging starts WB_EXPIRE_MS after the first dirty write, or at once
+	when writers are throttled (dirty bytes reached `cap`) or wait for a
+	flush. `rate` (MB/s, 0 -- unlimited) spaces the batches.
+
+	A discard drops the entry of the block. A destage bio already on its
+	way finds no entry under the block lock and completes without
+	writing.
+
+	REQ_PREFLUSH waits until every entry dirtied before it is destaged,
+	REQ_FUA waits for its own block. The disk advertises a volatile
+	write cache only while this cache is enabled.
+
+	IMPORTANT:
+		Entries are changed and released under the block lock,
+		an entry being destaged is never written: an overwrite gets
+		a new entry, the destaged one is released by the worker.
+ */
+
+/* the compression policy classifies by them, destage bios carry them */
+#define WB_OPF_HINTS (REQ_META | REQ_FUA | REQ_SYNC)
+
+#define WB_BATCH 64
+#define WB_EXPIRE_MS 1000
+
+struct bcomp_dev;
+struct bio;
+
+struct wb_entry {
+	struct wb_ctx *wb;
+	sector_t lba;
+	u64 seq; // last write absorbed
+	blk_opf_t opf; // WB_OPF_HINTS of the last write absorbed
+	u16 ioprio; // of the last write absorbed
+	bool destaging;
+	blk_status_t status;
+	struct buffer buf;
+	struct rcu_head rcu; // flush waiters read seq under rcu
+};
+
+struct wb_ctx {
+	struct bcomp_dev *bcdev;
+	struct xarray dirty; // block key -> wb_entry
+	u64 cap; // bytes
+	u32 rate; // MB/s, 0 -- unlimited
+
+	atomic64_t seq;
+	atomic64_t dirty_bytes;
+	atomic_t inflight; // destage bios of the current batch
+	atomic_t waiters; // throttled writers and flushes
+	atomic_t failed; // a destage failed since the last flush
+	wait_queue_head_t wait;
+
+	struct workqueue_struct *wq; // destage can't share bcdev->wq
+	struct delayed_work work;
+
+	atomic64_t cached_cnt;
+	atomic64_t absorbed_cnt;
+	atomic64_t destaged_cnt;
+	atomic64_t throttled_cnt;
+	atomic64_t flushes_cnt;
+	atomic64_t read_hits_cnt;
+	atomic64_t errors_cnt;
+};
+
+#define PRITTY_WB_STATS_TEMPLATE \
+	"\
+wb_cap_bytes: %llu\n\
+wb_dirty_bytes: %lld\n\
+wb_cached_cnt: %lld\n\
+wb_absorbed_cnt: %lld\n\
+wb_destaged_cnt: %lld\n\
+wb_throttled_cnt: %lld\n\
+wb_flushes_cnt: %lld\n\
+wb_read_hits_cnt: %lld\n\
+wb_errors_cnt: %lld\n\
+"
+
+struct wb_ctx *alloc_wb(struct bcomp_dev *bcdev, u32 cap_mb, u32 rate);
+/* after del_gendisk(): destages everything first, part0 is still held */
+void free_wb(struct wb_ctx *wb);
+
+/* destage bios take the regular write path */
+bool wb_owns_bio(struct bio *bio);
+
+/* completes the bio (REQ_FUA -- after the block is destaged) */
+int wb_write(struct wb_ctx *wb, struct bio *bio);
+/* under the block lock: dirty block -> copied to the bio */
+bool wb_read(struct wb_ctx *wb, sector_t lba, struct bio *bio);
+/* under the block lock: the dirty block is dropped, never destaged */
+void wb_discard(struct wb_ctx *wb, sector_t lba);
+/* under the block lock: a destage bio of a block discarded meanwhile */
+bool wb_dropped(struct wb_ctx *wb, struct bio *bio);
+int wb_flush(struct wb_ctx *wb);
+
+int wb_stats_emit(char *buf, int at, struct wb_ctx *wb);
+void reset_wb_stats(struct wb_ctx *wb);
+
+#endif /* BCOMP_WRITEBACK */
@@ -20,6 +20,8 @@ struct cell_manager_ops {
 	int (*alloc_cell)(struct map_cell **cell_ptr, sector_t lba,
 			  void *cell_manager_ctx);
 	void (*free_cell)(u64 cell_key, void *cell_manager_ctx);
+	/* optional: the cell of lba was changed in place */
+	void (*dirty_cell)(sector_t lba, void *cell_manager_ctx);
 };
 
 static inline void *alloc_cell_manager_ctx(sector_t storage_size,
@@ -74,6 +76,15 @@ static inline void free_cell(u64 cell_key, void *cell_manager_ctx,
 	ops->free_cell(cell_key, cell_manager_ctx);
 }
 
+static inline void dirty_cell(sector_t lba, void *cell_manager_ctx,
+			      const struct cell_manager_ops *ops)
+{
+	if (!ops || !ops->dirty_cell)
+		return;
+
+	ops->dirty_cell(lba, cell_manager_ctx);
+}
+
 struct base_cell_manager_ctx {
 	/* 
 	IMPORTANT:
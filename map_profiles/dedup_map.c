@@ -0,0 +1,401 @@
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/bitmap.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+
+#include "../include/bcomp_static.h"
+#include "../include/map_common.h"
+
+#include "dedup_map.h"
+
+/*
+DOC:
+	Content-hash deduplication map.
+
+	Every written lba points to a refcounted physical record
+	(struct dedup_cell) placed anywhere on the underlying device, raw
+	blocks included. Records of successfully written blocks are indexed
+	by the xxh64 fingerprint of the logical data, so a write with the
+	same content (verified byte by byte by the caller) only takes a
+	reference and skips compression and the underlying write.
+
+	An overwrite reuses the record in place only while it is exclusive
+	(refcnt == 1), otherwise the new data gets a free physical block and
+	the shared one is kept for the other lbas. A physical block is freed
+	when its last reference is overwritten or discarded.
+
+	All state is protected by one spinlock, commit_cell() is called from
+	bio end_io.
+ */
+
+#define DEDUP_MIN_HASH_BITS 4
+
+struct dedup_cell {
+	struct map_cell cell; // cell.refcnt -- lbas + in-flight find_dup()
+	u64 fp;
+	bool hashed;
+	struct hlist_node node;
+};
+
+struct dedup_map_ctx {
+	spinlock_t lock;
+
+	u64 block_number;
+	u64 bs_in_sectors;
+	struct dedup_cell **lba_map; // lba key -> record
+	unsigned long *pba_used; // physical block key -> in use
+	u64 pba_hint;
+
+	struct hlist_head *index;
+	u32 index_bits;
+
+	u64 mapped_cnt; // lbas pointing to a record
+	u64 stored_cnt; // records (used physical blocks)
+	atomic64_t hits_cnt;
+	atomic64_t hits_bytes;
+};
+
+#define PRITTY_DEDUP_STATS_TEMPLATE \
+	"\
+dedup_hits_cnt: %lld\n\
+dedup_hits_bytes: %lld\n\
+dedup_mapped_blocks: %llu\n\
+dedup_stored_blocks: %llu\n\
+dedup_ratio_x100: %llu\n\
+"
+
+static inline struct dedup_cell *to_dedup_cell(struct map_cell *cell)
+{
+	return container_of(cell, struct dedup_cell, cell);
+}
+
+static inline u64 _lba_to_key(struct dedup_map_ctx *dctx, sector_t lba)
+{
+	u64 key = lba / dctx->bs_in_sectors;
+
+	BUG_ON(key >= dctx->block_number);
+	return key;
+}
+
+/* ================== PHYSICAL BLOCKS ================== */
+
+static int alloc_pba(struct dedup_map_ctx *dctx, sector_t *pba)
+{
+	u64 key;
+
+	key = find_next_zero_bit(dctx->pba_used, dctx->block_number,
+				 dctx->pba_hint);
+	if (key >= dctx->block_number)
+		key = find_first_zero_bit(dctx->pba_used, dctx->block_number);
+	if (key >= dctx->block_number)
+		return -ENOSPC;
+
+	__set_bit(key, dctx->pba_used);
+	dctx->pba_hint = key + 1;
+	dctx->stored_cnt++;
+
+	*pba = key * dctx->bs_in_sectors;
+	return 0;
+}
+
+static void free_pba(struct dedup_map_ctx *dctx, sector_t pba)
+{
+	__clear_bit(pba / dctx->bs_in_sectors, dctx->pba_used);
+	dctx->stored_cnt--;
+}
+
+/* ================== RECORDS ================== */
+
+static void unhash_record(struct dedup_cell *rec)
+{
+	if (!rec->hashed)
+		return;
+
+	hlist_del(&rec->node);
+	rec->hashed = false;
+}
+
+/* drops one reference, the caller holds dctx->lock */
+static void put_record(struct dedup_map_ctx *dctx, struct dedup_cell *rec)
+{
+	if (--rec->cell.refcnt)
+		return;
+
+	unhash_record(rec);
+	free_pba(dctx, rec->cell.pba);
+	kfree(rec);
+}
+
+/* ================== MAP_OPS ================== */
+
+static int update_dedup_cell(struct map_ctx *mctx, sector_t lba, u32 lsize,
+			     u32 psize, struct map_cell **cell)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+	struct dedup_cell *fresh, *old, *rec;
+	unsigned long flags;
+	u64 key = _lba_to_key(dctx, lba);
+	int ret = 0;
+
+	/* allocated in advance: the record may be needed under the lock */
+	fresh = kzalloc(sizeof(*fresh), GFP_NOIO);
+	if (!fresh)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&dctx->lock, flags);
+
+	old = dctx->lba_map[key];
+	if (old && old->cell.refcnt == 1) {
+		/* nobody else sees the block: rewrite it in place */
+		unhash_record(old);
+		rec = old;
+	} else {
+		ret = alloc_pba(dctx, &fresh->cell.pba);
+		if (ret)
+			goto unlock;
+
+		rec = fresh;
+		fresh = NULL;
+		rec->cell.lba = lba;
+		rec->cell.refcnt = 1;
+
+		if (old)
+			put_record(dctx, old);
+		else
+			dctx->mapped_cnt++;
+
+		dctx->lba_map[key] = rec;
+	}
+
+	rec->cell.lsize = lsize;
+	rec->cell.psize = psize;
+	*cell = &rec->cell;
+
+unlock:
+	spin_unlock_irqrestore(&dctx->lock, flags);
+	kfree(fresh);
+
+	if (ret)
+		BCOMP_ERRLOG("dedup map: no free physical blocks");
+	return ret;
+}
+
+static int get_dedup_cell(struct map_ctx *mctx, sector_t lba,
+			  struct map_cell **cell)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+	struct dedup_cell *rec;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dctx->lock, flags);
+	rec = dctx->lba_map[_lba_to_key(dctx, lba)];
+	spin_unlock_irqrestore(&dctx->lock, flags);
+
+	if (!rec)
+		return -ENODATA;
+
+	/* lba is locked by the caller, so its record can't go away */
+	*cell = &rec->cell;
+	return 0;
+}
+
+static int find_dedup_dup(struct map_ctx *mctx, u64 fp, struct map_cell **cell)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+	struct dedup_cell *rec;
+	unsigned long flags;
+
+	*cell = NULL;
+
+	spin_lock_irqsave(&dctx->lock, flags);
+	hlist_for_each_entry(rec, &dctx->index[hash_64(fp, dctx->index_bits)],
+			     node) {
+		if (rec->fp != fp)
+			continue;
+
+		rec->cell.refcnt++;
+		*cell = &rec->cell;
+		break;
+	}
+	spin_unlock_irqrestore(&dctx->lock, flags);
+
+	return 0;
+}
+
+static int link_dedup_dup(struct map_ctx *mctx, sector_t lba,
+			  struct map_cell *cell)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+	struct dedup_cell *rec = to_dedup_cell(cell);
+	struct dedup_cell *old;
+	unsigned long flags;
+	u64 key = _lba_to_key(dctx, lba);
+
+	spin_lock_irqsave(&dctx->lock, flags);
+
+	old = dctx->lba_map[key];
+	if (old)
+		put_record(dctx, old);
+	else
+		dctx->mapped_cnt++;
+
+	dctx->lba_map[key] = rec;
+
+	spin_unlock_irqrestore(&dctx->lock, flags);
+
+	atomic64_inc(&dctx->hits_cnt);
+	atomic64_add(cell->lsize, &dctx->hits_bytes);
+	return 0;
+}
+
+static void put_dedup_dup(struct map_ctx *mctx, struct map_cell *cell)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dctx->lock, flags);
+	put_record(dctx, to_dedup_cell(cell));
+	spin_unlock_irqrestore(&dctx->lock, flags);
+}
+
+static void commit_dedup_cell(struct map_ctx *mctx, struct map_cell *cell,
+			      u64 fp)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+	struct dedup_cell *rec = to_dedup_cell(cell);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dctx->lock, flags);
+	if (!rec->hashed) {
+		rec->fp = fp;
+		rec->hashed = true;
+		hlist_add_head(&rec->node,
+			       &dctx->index[hash_64(fp, dctx->index_bits)]);
+	}
+	spin_unlock_irqrestore(&dctx->lock, flags);
+}
+
+static int discard_dedup_cell(struct map_ctx *mctx, sector_t lba)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+	struct dedup_cell *rec;
+	unsigned long flags;
+	u64 key = _lba_to_key(dctx, lba);
+
+	spin_lock_irqsave(&dctx->lock, flags);
+
+	rec = dctx->lba_map[key];
+	if (rec) {
+		dctx->lba_map[key] = NULL;
+		dctx->mapped_cnt--;
+		put_record(dctx, rec);
+	}
+
+	spin_unlock_irqrestore(&dctx->lock, flags);
+	return 0;
+}
+
+static int dedup_stats_emit(struct map_ctx *mctx, char *buf, int at)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+	u64 mapped = READ_ONCE(dctx->mapped_cnt);
+	u64 stored = READ_ONCE(dctx->stored_cnt);
+
+	return sysfs_emit_at(buf, at, PRITTY_DEDUP_STATS_TEMPLATE,
+			     atomic64_read(&dctx->hits_cnt),
+			     atomic64_read(&dctx->hits_bytes), mapped, stored,
+			     stored ? div64_u64(mapped * 100, stored) : 100);
+}
+
+static void reset_dedup_stats(struct map_ctx *mctx)
+{
+	struct dedup_map_ctx *dctx = mctx->private_ctx;
+
+	atomic64_set(&dctx->hits_cnt, 0);
+	atomic64_set(&dctx->hits_bytes, 0);
+}
+
+/* ================== PRIVATE_CTX ================== */
+
+static void free_dedup_map_ctx(struct dedup_map_ctx *dctx)
+{
+	struct dedup_cell *rec;
+
+	if (dctx->lba_map) {
+		/* every record is freed once, by its last lba */
+		for (u64 i = 0; i < dctx->block_number; i++) {
+			rec = dctx->lba_map[i];
+			if (rec && !--rec->cell.refcnt)
+				kfree(rec);
+		}
+	}
+
+	kvfree(dctx->index);
+	kvfree(dctx->pba_used);
+	kvfree(dctx->lba_map);
+	kfree(dctx);
+}
+
+static int alloc_dedup_private_ctx(struct map_ctx *mctx, sector_t storage_size,
+				   enum w_block_size bs)
+{
+	struct dedup_map_ctx *dctx;
+
+	dctx = kzalloc(sizeof(*dctx), GFP_KERNEL);
+	if (!dctx)
+		return -ENOMEM;
+
+	spin_lock_init(&dctx->lock);
+	dctx->bs_in_sectors = DIV_ROUND_UP(bs, SECTOR_SIZE);
+	dctx->block_number = div64_u64(storage_size, dctx->bs_in_sectors);
+	dctx->index_bits = max_t(u32, ilog2(max_t(u64, dctx->block_number, 1)),
+				 DEDUP_MIN_HASH_BITS);
+
+	dctx->lba_map = kvcalloc(dctx->block_number, sizeof(*dctx->lba_map),
+				 GFP_KERNEL);
+	dctx->pba_used = kvcalloc(BITS_TO_LONGS(dctx->block_number),
+				  sizeof(unsigned long), GFP_KERNEL);
+	dctx->index = kvcalloc(1UL << dctx->index_bits, sizeof(*dctx->index),
+			       GFP_KERNEL);
+	if (!dctx->lba_map || !dctx->pba_used || !dctx->index) {
+		free_dedup_map_ctx(dctx);
+		return -ENOMEM;
+	}
+
+	mctx->ops = get_dedup_map_ops();
+	mctx->private_ctx = dctx;
+	return 0;
+}
+
+static int free_dedup_private_ctx(struct map_ctx *mctx)
+{
+	free_dedup_map_ctx(mctx->private_ctx);
+	mctx->private_ctx = NULL;
+	return 0;
+}
+
+/* ================== GETTER ================== */
+
+const struct map_ops dedup_map_ops = {
+	.alloc_private_ctx = alloc_dedup_private_ctx,
+	.free_private_ctx = free_dedup_private_ctx,
+	.update_cell = update_dedup_cell,
+	.get_cell = get_dedup_cell,
+	.find_dup = find_dedup_dup,
+	.link_dup = link_dedup_dup,
+	.put_dup = put_dedup_dup,
+	.commit_cell = commit_dedup_cell,
+	.discard_cell = discard_dedup_cell,
+	.stats_emit = dedup_stats_emit,
+	.reset_stats = reset_dedup_stats
+};
+
+const struct map_ops *get_dedup_map_ops(void)
+{
+	return &dedup_map_ops;
+}
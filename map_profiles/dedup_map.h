@@ -0,0 +1,8 @@
+#ifndef BCOMP_MAP_DEDUP
+#define BCOMP_MAP_DEDUP
+
+#include "../include/map_common.h"
+
+const struct map_ops *get_dedup_map_ops(void);
+
+#endif /* BCOMP_MAP_DEDUP */
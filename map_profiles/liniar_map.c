@@ -13,10 +13,16 @@ const struct cell_manager_ops *LINIAR_MANAGER_OPS;
 static int alloc_liniar_private_ctx(struct map_ctx *mctx, sector_t storage_size,
 				    enum w_block_size bs)
 {
+	mctx->ops = get_liniar_map_ops();
+	if (mctx->cell_ops) {
+		LINIAR_MANAGER_OPS = mctx->cell_ops;
+		mctx->private_ctx = mctx->cell_ctx;
+		return 0;
+	}
+
 	LINIAR_MANAGER_OPS =
 		get_base_cell_manager_ops(); //TODO: mb make as const
 
-	mctx->ops = get_liniar_map_ops();
 	mctx->private_ctx =
 		alloc_cell_manager_ctx(storage_size, bs, LINIAR_MANAGER_OPS);
 	if (!mctx->private_ctx)
@@ -47,6 +53,8 @@ static int update_liniar_cell(struct map_ctx *mctx, sector_t lba, u32 lsize,
 		_cell->pba = lba;
 		_cell->lsize = lsize;
 		_cell->psize = psize;
+		_cell->refcnt = 1;
+		dirty_cell(lba, mctx->private_ctx, LINIAR_MANAGER_OPS);
 
 	} else {
 		ret = get_cell_ptr(&_cell, lba, mctx->private_ctx,
@@ -58,7 +66,11 @@ static int update_liniar_cell(struct map_ctx *mctx, sector_t lba, u32 lsize,
 			__clear_cell(_cell);
 			_cell->lsize = 0;
 			_cell->psize = 1;
+			dirty_cell(lba, mctx->private_ctx, LINIAR_MANAGER_OPS);
 		}
+
+		/* block is stored raw at lba */
+		_cell = NULL;
 	}
 
 	*cell = _cell;
@@ -10,6 +10,7 @@
 #include "../include/bcomp.h"
 
 #include "liniar_map.h"
+#include "dedup_map.h"
 
 /* ================== MAP_CTX ================== */
 
@@ -19,6 +20,9 @@ int init_map_ops(enum map_profile map_prf, struct map_ctx *mctx)
 	case LINEAR:
 		mctx->ops = get_liniar_map_ops();
 		break;
+	case DEDUP:
+		mctx->ops = get_dedup_map_ops();
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * bcomp-mkimage -- offline builder of pre-compressed bcomp images.
+ *
+ * Compresses <src> block by block on all CPUs and writes the underlying
+ * image (every block at its home location, as the `linear` map stores it)
+ * and the map file bcomp loads with `mapfile=<path>`, see
+ * include/map_file.h.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include <lz4.h>
+#include <lz4hc.h>
+
+#include "../../include/map_file.h"
+
+/* compression_profiles/lz4_comp.h, comp_common.h */
+#define BCOMP_LZ4_MAX_FAST_ID 15 // [0..15] <=> acceleration factor
+#define BCOMP_LZ4_MAX_HC_ID (BCOMP_LZ4_MAX_FAST_ID + 16) // LZ4HC_MAX_CLEVEL
+#define BCOMP_CPRF_LZ4 1 // enum comp_profile
+#define SECTOR_SIZE 512
+
+#define BATCH_BLKS 256 // blocks a worker takes at once
+
+struct job {
+	int src_fd;
+	int img_fd;
+	int map_fd;
+	uint32_t bs;
+	uint32_t limit; // comp_useful_size()
+	int comp_id;
+	uint64_t src_size;
+	uint64_t blk_cnt;
+
+	atomic_uint_fast64_t next; // first block of the next batch
+	atomic_uint_fast64_t compressed;
+	atomic_uint_fast64_t stored; // bytes of data in the image
+	atomic_int failed;
+};
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t c, i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320U : (c >> 1);
+		crc_table[i] = c;
+	}
+}
+
+/* crc32_le() of the kernel: no final inversion */
+static uint32_t crc32_le(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static int parse_bs(const char *arg, uint32_t *bs)
+{
+	static const char *names[] = { "4k", "8k", "16k", "32k", "64k",
+				       "128k" };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strcmp(arg, names[i])) {
+			*bs = 4096U << i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int pread_full(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (!n) {
+			memset(buf, 0, len); // tail of the last block
+			return 0;
+		}
+
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+/* psize, 0 -- incompressible, the block is stored raw */
+static int compress_blk(struct job *job, const char *src, char *dst,
+			void *state)
+{
+	if (!job->limit)
+		return 0;
+
+	if (job->comp_id <= BCOMP_LZ4_MAX_FAST_ID)
+		return LZ4_compress_fast_extState(state, src, dst, job->bs,
+						  job->limit, job->comp_id);
+
+	return LZ4_compress_HC_extStateHC(state, src, dst, job->bs,
+					  job->limit,
+					  job->comp_id - BCOMP_LZ4_MAX_FAST_ID);
+}
+
+static int do_batch(struct job *job, uint64_t first, uint32_t n, char *src,
+		    char *slots, struct map_file_ent *ents, void *state)
+{
+	uint32_t bs = job->bs;
+	uint32_t i;
+	int psize;
+	int ret;
+
+	ret = pread_full(job->src_fd, src, (size_t)n * bs, first * bs);
+	if (ret)
+		return ret;
+
+	memset(ents, 0, n * sizeof(*ents));
+	for (i = 0; i < n; i++) {
+		char *blk = src + (size_t)i * bs;
+		char *slot = slots + (size_t)i * bs;
+
+		psize = compress_blk(job, blk, slot, state);
+		if (psize <= 0) {
+			memcpy(slot, blk, bs);
+			atomic_fetch_add(&job->stored, bs);
+			continue;
+		}
+
+		memset(slot + psize, 0, bs - psize);
+		ents[i].psize = htole32(psize);
+		ents[i].cprf = BCOMP_CPRF_LZ4;
+		ents[i].comp_prf_id = job->comp_id;
+		atomic_fetch_add(&job->compressed, 1);
+		atomic_fetch_add(&job->stored, psize);
+	}
+
+	ret = pwrite_full(job->img_fd, slots, (size_t)n * bs, first * bs);
+	if (ret)
+		return ret;
+
+	return pwrite_full(job->map_fd, (char *)ents, n * sizeof(*ents),
+			   sizeof(struct map_file_hdr) + first * sizeof(*ents));
+}
+
+static void *worker(void *arg)
+{
+	struct job *job = arg;
+	size_t batch = (size_t)BATCH_BLKS * job->bs;
+	struct map_file_ent *ents;
+	char *src, *slots;
+	void *state;
+	uint64_t first;
+	uint32_t n;
+	int ret = -ENOMEM;
+
+	src = malloc(batch);
+	slots = malloc(batch);
+	ents = malloc(BATCH_BLKS * sizeof(*ents));
+	state = malloc(job->comp_id <= BCOMP_LZ4_MAX_FAST_ID ?
+			       LZ4_sizeofState() :
+			       LZ4_sizeofStateHC());
+	if (!src || !slots || !ents || !state)
+		goto out;
+
+	ret = 0;
+	while (!atomic_load(&job->failed)) {
+		first = atomic_fetch_add(&job->next, BATCH_BLKS);
+		if (first >= job->blk_cnt)
+			break;
+
+		n = job->blk_cnt - first < BATCH_BLKS ? job->blk_cnt - first :
+							BATCH_BLKS;
+		ret = do_batch(job, first, n, src, slots, ents, state);
+		if (ret)
+			break;
+	}
+
+out:
+	if (ret) {
+		fprintf(stderr, "bcomp-mkimage: %s\n", strerror(-ret));
+		atomic_store(&job->failed, 1);
+	}
+
+	free(state);
+	free(ents);
+	free(slots);
+	free(src);
+	return NULL;
+}
+
+/* the entries are written out of order, their crc is taken at the end */
+static int write_map_hdr(struct job *job)
+{
+	size_t len = 1U << 20;
+	struct map_file_hdr hdr = {};
+	uint64_t left = job->blk_cnt * sizeof(struct map_file_ent);
+	off_t off = sizeof(hdr);
+	uint32_t crc = ~0U;
+	char *buf;
+	int ret = 0;
+
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+
+	while (left) {
+		size_t n = left < len ? left : len;
+
+		ret = pread_full(job->map_fd, buf, n, off);
+		if (ret)
+			goto free_buf;
+
+		crc = crc32_le(crc, buf, n);
+		left -= n;
+		off += n;
+	}
+
+	hdr.magic = htole32(MAP_FILE_MAGIC);
+	hdr.version = htole32(MAP_FILE_VERSION);
+	hdr.bs = htole32(job->bs);
+	hdr.blk_cnt = htole64(job->blk_cnt);
+	hdr.ents_crc = htole32(crc);
+	hdr.crc = htole32(crc32_le(~0U, &hdr, sizeof(hdr)));
+
+	ret = pwrite_full(job->map_fd, (char *)&hdr, sizeof(hdr), 0);
+
+free_buf:
+	free(buf);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bcomp-mkimage -b <bs> -c <comp-prfl-id> [-s <min_saving>] [-j <threads>] <src> <image> <mapfile>\n"
+		"  <bs>            4k, 8k, 16k, 32k, 64k or 128k\n"
+		"  <comp-prfl-id>  lz4 id as for the module: 0..15 fast, 16..%d HC\n"
+		"  <min_saving>    bytes a block must save (default: 512)\n"
+		"  <threads>       default: online CPUs\n",
+		BCOMP_LZ4_MAX_HC_ID);
+}
+
+int main(int argc, char **argv)
+{
+	struct job job = { .comp_id = -1 };
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t min_saving = 0, saving;
+	pthread_t *tids;
+	struct stat st;
+	long i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:c:s:j:")) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_bs(optarg, &job.bs)) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'c':
+			job.comp_id = atoi(optarg);
+			break;
+		case 's':
+			min_saving = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			threads = atol(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (argc - optind != 3 || !job.bs || job.comp_id < 0 ||
+	    job.comp_id > BCOMP_LZ4_MAX_HC_ID || threads < 1) {
+		usage();
+		return 1;
+	}
+
+	/* comp_useful_size() */
+	saving = min_saving > SECTOR_SIZE ? min_saving : SECTOR_SIZE;
+	saving = (saving + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+	job.limit = job.bs > saving ? job.bs - saving : 0;
+
+	job.src_fd = open(argv[optind], O_RDONLY);
+	if (job.src_fd < 0 || fstat(job.src_fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	/* a block device reports 0 in st_size */
+	job.src_size = S_ISBLK(st.st_mode) ? lseek(job.src_fd, 0, SEEK_END) :
+					    st.st_size;
+	job.blk_cnt = (job.src_size + job.bs - 1) / job.bs;
+
+	job.img_fd = open(argv[optind + 1], O_WRONLY | O_CREAT, 0644);
+	if (job.img_fd < 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	job.map_fd = open(argv[optind + 2], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (job.map_fd < 0) {
+		perror(argv[optind + 2]);
+		return 1;
+	}
+
+	crc32_init();
+
+	tids = calloc(threads, sizeof(*tids));
+	if (!tids)
+		return 1;
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, worker, &job)) {
+			atomic_store(&job.failed, 1);
+			threads = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	if (atomic_load(&job.failed) || write_map_hdr(&job) ||
+	    fsync(job.img_fd) || fsync(job.map_fd)) {
+		fprintf(stderr, "bcomp-mkimage: failed\n");
+		return 1;
+	}
+
+	printf("blocks: %llu, compressed: %llu, data: %llu of %llu bytes\n",
+	       (unsigned long long)job.blk_cnt,
+	       (unsigned long long)atomic_load(&job.compressed),
+	       (unsigned long long)atomic_load(&job.stored),
+	       (unsigned long long)job.blk_cnt * job.bs);
+
+	close(job.map_fd);
+	close(job.img_fd);
+	close(job.src_fd);
+	return 0;
+}
@@ -0,0 +1,317 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+
+#include "../include/bcomp.h"
+#include "../include/blk_cache.h"
+
+struct blk_cache_entry {
+	struct hlist_node node;
+	struct list_head lru;
+	sector_t lba;
+	u32 sz;
+	bool prefetched; // inserted ahead of demand, not read yet
+	char data[];
+};
+
+static inline struct blk_cache_shard *get_shard(struct blk_cache *bc,
+						sector_t lba)
+{
+	u64 key = bcomp_lba_to_key(bc->bcdev, lba);
+
+	return &bc->shards[key & (bc->nr_shards - 1)];
+}
+
+static inline struct hlist_head *get_bucket(struct blk_cache *bc,
+					    struct blk_cache_shard *shard,
+					    sector_t lba)
+{
+	return &shard->tbl[hash_64(lba, bc->bucket_bits)];
+}
+
+static struct blk_cache_entry *shard_lookup(struct blk_cache *bc,
+					    struct blk_cache_shard *shard,
+					    sector_t lba)
+{
+	struct blk_cache_entry *e;
+
+	hlist_for_each_entry(e, get_bucket(bc, shard, lba), node)
+		if (e->lba == lba)
+			return e;
+
+	return NULL;
+}
+
+/* unlinks the entry, caller frees it outside the lock */
+static void shard_unlink(struct blk_cache *bc, struct blk_cache_shard *shard,
+			 struct blk_cache_entry *e)
+{
+	hlist_del(&e->node);
+	list_del(&e->lru);
+	shard->bytes -= e->sz;
+
+	atomic_long_dec(&bc->entries);
+	atomic64_sub(e->sz, &bc->bytes);
+}
+
+/* ================== DATA-PATH ================== */
+
+bool blk_cache_read(struct blk_cache *bc, sector_t lba, struct bio *bio)
+{
+	struct blk_cache_shard *shard = get_shard(bc, lba);
+	struct blk_cache_entry *e;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	unsigned long flags;
+	char *ptr;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	e = shard_lookup(bc, shard, lba);
+	if (!e || e->sz != bio->bi_iter.bi_size) {
+		spin_unlock_irqrestore(&shard->lock, flags);
+		atomic64_inc(&bc->misses_cnt);
+		return false;
+	}
+
+	list_move(&e->lru, &shard->lru);
+	if (e->prefetched) {
+		e->prefetched = false;
+		atomic64_inc(&bc->prefetch_hits_cnt);
+	}
+
+	ptr = e->data;
+	bio_for_each_segment(bv, bio, iter) {
+		memcpy_to_bvec(&bv, ptr);
+		ptr += bv.bv_len;
+	}
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	atomic64_inc(&bc->hits_cnt);
+	return true;
+}
+
+bool blk_cache_contains(struct blk_cache *bc, sector_t lba)
+{
+	struct blk_cache_shard *shard = get_shard(bc, lba);
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	ret = shard_lookup(bc, shard, lba) != NULL;
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	return ret;
+}
+
+void blk_cache_insert(struct blk_cache *bc, sector_t lba, const char *data,
+		      u32 sz, bool prefetched)
+{
+	struct blk_cache_shard *shard = get_shard(bc, lba);
+	struct blk_cache_entry *e, *old, *victim, *tmp;
+	unsigned long flags;
+	LIST_HEAD(evicted);
+
+	if (sz > bc->shard_cap)
+		return;
+
+	/* end_io context: no sleeping, no reclaim, no warnings on failure */
+	e = kmalloc(struct_size(e, data, sz), GFP_NOWAIT | __GFP_NOWARN);
+	if (!e)
+		return;
+
+	e->lba = lba;
+	e->sz = sz;
+	e->prefetched = prefetched;
+	memcpy(e->data, data, sz);
+
+	spin_lock_irqsave(&shard->lock, flags);
+	old = shard_lookup(bc, shard, lba);
+	if (old) {
+		shard_unlink(bc, shard, old);
+		list_add(&old->lru, &evicted);
+	}
+
+	while (shard->bytes + sz > bc->shard_cap && !list_empty(&shard->lru)) {
+		victim = list_last_entry(&shard->lru, struct blk_cache_entry,
+					 lru);
+		shard_unlink(bc, shard, victim);
+		list_add(&victim->lru, &evicted);
+		atomic64_inc(&bc->evicted_cnt);
+	}
+
+	hlist_add_head(&e->node, get_bucket(bc, shard, lba));
+	list_add(&e->lru, &shard->lru);
+	shard->bytes += sz;
+	atomic_long_inc(&bc->entries);
+	atomic64_add(sz, &bc->bytes);
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	list_for_each_entry_safe(victim, tmp, &evicted, lru)
+		kfree(victim);
+}
+
+void blk_cache_invalidate(struct blk_cache *bc, sector_t lba)
+{
+	struct blk_cache_shard *shard = get_shard(bc, lba);
+	struct blk_cache_entry *e;
+	unsigned long flags;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	e = shard_lookup(bc, shard, lba);
+	if (e)
+		shard_unlink(bc, shard, e);
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	kfree(e);
+}
+
+/* ================== SHRINKER ================== */
+
+static unsigned long blk_cache_count(struct shrinker *shrink,
+				     struct shrink_control *sc)
+{
+	struct blk_cache *bc = shrink->private_data;
+	long cnt = atomic_long_read(&bc->entries);
+
+	return cnt > 0 ? cnt : SHRINK_EMPTY;
+}
+
+static unsigned long blk_cache_scan(struct shrinker *shrink,
+				    struct shrink_control *sc)
+{
+	struct blk_cache *bc = shrink->private_data;
+	struct blk_cache_entry *e, *tmp;
+	struct blk_cache_shard *shard;
+	unsigned long freed = 0;
+	unsigned long flags;
+	u32 from = atomic_inc_return(&bc->scan_from);
+	u32 quota = DIV_ROUND_UP(sc->nr_to_scan, bc->nr_shards);
+	LIST_HEAD(evicted);
+
+	/* LRU tails of all shards, round-robin */
+	for (u32 i = 0; i < bc->nr_shards && freed < sc->nr_to_scan; i++) {
+		shard = &bc->shards[(from + i) & (bc->nr_shards - 1)];
+
+		spin_lock_irqsave(&shard->lock, flags);
+		for (u32 n = 0; n < quota && freed < sc->nr_to_scan &&
+				!list_empty(&shard->lru);
+		     n++, freed++) {
+			e = list_last_entry(&shard->lru, struct blk_cache_entry,
+					    lru);
+			shard_unlink(bc, shard, e);
+			list_add(&e->lru, &evicted);
+		}
+		spin_unlock_irqrestore(&shard->lock, flags);
+	}
+
+	list_for_each_entry_safe(e, tmp, &evicted, lru)
+		kfree(e);
+
+	atomic64_add(freed, &bc->reclaimed_cnt);
+	return freed ? freed : SHRINK_STOP;
+}
+
+/* ================== INIT ================== */
+
+struct blk_cache *alloc_blk_cache(struct bcomp_dev *bcdev, u32 cap_mb)
+{
+	struct blk_cache *bc;
+
+	bc = kzalloc(sizeof(*bc), GFP_KERNEL);
+	if (!bc)
+		return NULL;
+
+	bc->bcdev = bcdev;
+	bc->nr_shards = roundup_pow_of_two(num_possible_cpus());
+	bc->shard_cap = div_u64((u64)cap_mb << 20, bc->nr_shards);
+	if (bc->shard_cap < bcdev->bs) {
+		BCOMP_ERRLOG("cache: cap is too small for the block size");
+		goto free_bc;
+	}
+
+	/* a bucket per block a shard can hold */
+	bc->bucket_bits = max_t(u32, BLK_CACHE_MIN_BUCKET_BITS,
+				order_base_2(div_u64(bc->shard_cap,
+						     bcdev->bs)));
+
+	bc->shards = kcalloc(bc->nr_shards, sizeof(*bc->shards), GFP_KERNEL);
+	if (!bc->shards)
+		goto free_bc;
+
+	for (u32 i = 0; i < bc->nr_shards; i++) {
+		spin_lock_init(&bc->shards[i].lock);
+		INIT_LIST_HEAD(&bc->shards[i].lru);
+
+		/* zeroed hlist_heads are empty */
+		bc->shards[i].tbl = kvcalloc(1UL << bc->bucket_bits,
+					     sizeof(struct hlist_head),
+					     GFP_KERNEL);
+		if (!bc->shards[i].tbl)
+			goto free_tables;
+	}
+
+	bc->shrinker = shrinker_alloc(0, "%s-cache", BCOMP_NAME);
+	if (!bc->shrinker)
+		goto free_tables;
+
+	bc->shrinker->count_objects = blk_cache_count;
+	bc->shrinker->scan_objects = blk_cache_scan;
+	bc->shrinker->private_data = bc;
+	shrinker_register(bc->shrinker);
+
+	return bc;
+
+free_tables:
+	for (u32 i = 0; i < bc->nr_shards; i++)
+		kvfree(bc->shards[i].tbl);
+	kfree(bc->shards);
+free_bc:
+	kfree(bc);
+	return NULL;
+}
+
+void free_blk_cache(struct blk_cache *bc)
+{
+	struct blk_cache_entry *e, *tmp;
+
+	shrinker_free(bc->shrinker);
+
+	for (u32 i = 0; i < bc->nr_shards; i++) {
+		list_for_each_entry_safe(e, tmp, &bc->shards[i].lru, lru)
+			kfree(e);
+		kvfree(bc->shards[i].tbl);
+	}
+
+	kfree(bc->shards);
+	kfree(bc);
+}
+
+/* ================== STATS ================== */
+
+int blk_cache_stats_emit(char *buf, int at, struct blk_cache *bc)
+{
+	return sysfs_emit_at(buf, at, PRITTY_BLK_CACHE_STATS_TEMPLATE,
+			     bc->shard_cap * bc->nr_shards,
+			     atomic64_read(&bc->bytes),
+			     atomic_long_read(&bc->entries),
+			     atomic64_read(&bc->hits_cnt),
+			     atomic64_read(&bc->misses_cnt),
+			     atomic64_read(&bc->evicted_cnt),
+			     atomic64_read(&bc->reclaimed_cnt),
+			     atomic64_read(&bc->prefetch_hits_cnt));
+}
+
+void reset_blk_cache_stats(struct blk_cache *bc)
+{
+	atomic64_set(&bc->hits_cnt, 0);
+	atomic64_set(&bc->misses_cnt, 0);
+	atomic64_set(&bc->evicted_cnt, 0);
+	atomic64_set(&bc->reclaimed_cnt, 0);
+	atomic64_set(&bc->prefetch_hits_cnt, 0);
+}
@@ -0,0 +1,380 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/cpumask.h>
+#include <linux/crc32.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
+
+#include "../include/bcomp.h"
+#include "../include/blk_hdr.h"
+
+/* ================== STAMP ================== */
+
+void blk_hdr_stamp(struct blk_hdr_ctx *h, struct map_cell *cell,
+		   struct buffer *buf)
+{
+	struct blk_hdr hdr = {};
+	u32 bs = h->bcdev->bs;
+
+	if (!is_data_compressed(cell))
+		return;
+
+	/* comp_useful_size() keeps at least a sector free */
+	BUG_ON(cell->psize + sizeof(hdr) > bs || buf->buf_sz < bs);
+
+	hdr.magic = cpu_to_le32(BLK_HDR_MAGIC);
+	hdr.lsize = cpu_to_le32(cell->lsize);
+	hdr.psize = cpu_to_le32(cell->psize);
+	hdr.cprf = cell->cprf;
+	hdr.comp_prf_id = cell->comp_prf_id;
+	hdr.nsub = cell->nsub;
+	hdr.lba = cpu_to_le64(cell->lba);
+	hdr.seq = cpu_to_le64(atomic64_inc_return(&h->seq));
+	hdr.crc = cpu_to_le32(crc32_le(h->seed, (u8 *)&hdr, sizeof(hdr)));
+
+	memcpy(buf->data + bs - sizeof(hdr), &hdr, sizeof(hdr));
+	atomic64_inc(&h->stamped_cnt);
+}
+
+/* ================== REBUILD ================== */
+
+struct blk_hdr_scan {
+	struct work_struct work;
+	struct blk_hdr_ctx *h;
+	u32 member;
+	u64 first; // member blocks
+	u64 last;
+
+	u64 max_seq;
+	int ret;
+};
+
+static int blk_hdr_apply(struct blk_hdr_ctx *h, u64 key, struct blk_hdr *hdr,
+			 u64 *max_seq)
+{
+	struct bcomp_dev *bcdev = h->bcdev;
+	sector_t lba = bcomp_key_to_lba(bcdev, key);
+	u32 crc = le32_to_cpu(hdr->crc);
+	u32 psize = le32_to_cpu(hdr->psize);
+	struct map_cell *cell;
+	int ret;
+
+	if (le32_to_cpu(hdr->magic) != BLK_HDR_MAGIC)
+		return 0;
+
+	hdr->crc = 0;
+	if (crc32_le(h->seed, (u8 *)hdr, sizeof(*hdr)) != crc ||
+	    le64_to_cpu(hdr->lba) != lba ||
+	    le32_to_cpu(hdr->lsize) != bcdev->bs || !psize ||
+	    psize >= bcdev->bs) {
+		atomic64_inc(&h->bad_cnt);
+		return 0;
+	}
+
+	if (hdr->nsub > 1 && !bcdev->split_wq) {
+		BCOMP_ERRLOG("rebuild: device was written with split, map it so");
+		return -EINVAL;
+	}
+
+	/* distinct keys only: cells of the linear map are independent */
+	ret = update_mapping(&cell, lba, bcdev->bs, psize, bcdev->map);
+	if (ret || !cell)
+		return ret ?: -EIO;
+
+	cell->cprf = hdr->cprf;
+	cell->comp_prf_id = hdr->comp_prf_id;
+	cell->nsub = hdr->nsub;
+	cell->wtime = ktime_get_seconds();
+
+	*max_seq = max_t(u64, *max_seq, le64_to_cpu(hdr->seq));
+	atomic64_inc(&h->rebuilt_cnt);
+	return 0;
+}
+
+static int blk_hdr_scan_io(struct blk_hdr_scan *scan, struct page **pages,
+			   u32 nr_pages, u64 blk, u32 nr_blks)
+{
+	struct blk_hdr_ctx *h = scan->h;
+	struct bcomp_dev *bcdev = h->bcdev;
+	struct under_member *m = &bcdev->under_dev->members[scan->member];
+	u32 bs = bcdev->bs;
+	struct blk_hdr hdr;
+	struct bio *bio;
+	u32 i, pg;
+	u64 key;
+	int ret;
+
+	bio = bio_alloc(m->bdev, nr_pages, REQ_OP_READ, GFP_KERNEL);
+	if (!bio)
+		return -ENOMEM;
+
+	for (i = 0; i < (u32)((u64)nr_blks * bs >> PAGE_SHIFT); i++)
+		__bio_add_page(bio, pages[i], PAGE_SIZE, 0);
+
+	bio->bi_iter.bi_sector = blk * (bs >> SECTOR_SHIFT);
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr_blks; i++) {
+		key = bcomp_under_key(bcdev, scan->member, blk + i);
+		if (key >= bcdev->blk_cnt)
+			continue;
+
+		/* the trailer ends the last page of the block */
+		pg = ((u64)(i + 1) * bs >> PAGE_SHIFT) - 1;
+		memcpy(&hdr, page_address(pages[pg]) + PAGE_SIZE - sizeof(hdr),
+		       sizeof(hdr));
+
+		ret = blk_hdr_apply(h, key, &hdr, &scan->max_seq);
+		if (ret)
+			return ret;
+	}
+
+	atomic64_add(nr_blks, &h->scanned_cnt);
+	return 0;
+}
+
+static void blk_hdr_scan_work(struct work_struct *work)
+{
+	struct blk_hdr_scan *scan =
+		container_of(work, struct blk_hdr_scan, work);
+	u32 bs = scan->h->bcdev->bs;
+	u32 io_blks = BLK_HDR_SCAN_IO / bs;
+	u32 nr_pages = BLK_HDR_SCAN_IO >> PAGE_SHIFT;
+	struct page **pages;
+	u64 blk;
+	u32 i, n;
+
+	pages = kcalloc(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		scan->ret = -ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i]) {
+			scan->ret = -ENOMEM;
+			goto free_pages;
+		}
+	}
+
+	for (blk = scan->first; blk < scan->last; blk += n) {
+		n = min_t(u64, io_blks, scan->last - blk);
+		scan->ret = blk_hdr_scan_io(scan, pages, nr_pages, blk, n);
+		if (scan->ret)
+			break;
+
+		cond_resched();
+	}
+
+free_pages:
+	for (i = 0; i < nr_pages && pages[i]; i++)
+		__free_page(pages[i]);
+	kfree(pages);
+}
+
+int blk_hdr_rebuild(struct blk_hdr_ctx *h)
+{
+	struct bcomp_dev *bcdev = h->bcdev;
+	struct underlying_dev *under_dev = bcdev->under_dev;
+	u32 io_blks = BLK_HDR_SCAN_IO / bcdev->bs;
+	u32 parts, nr_scans, i, p;
+	struct blk_hdr_scan *scans;
+	u64 member_blks, step, max_seq = 0;
+	ktime_t start = ktime_get();
+	int ret = 0;
+
+	member_blks = div_u64(div_u64(under_dev->nr_sects,
+				      under_dev->nr_members),
+			      bcdev->bs >> SECTOR_SHIFT);
+
+	/* ranges of whole reads, all CPUs busy, all members at once */
+	parts = max_t(u32, 1, min_t(u32, num_online_cpus(),
+				    BLK_HDR_MAX_SCANNERS) /
+				      under_dev->nr_members);
+	step = roundup(DIV_ROUND_UP_ULL(member_blks, parts), io_blks);
+	nr_scans = parts * under_dev->nr_members;
+
+	scans = kcalloc(nr_scans, sizeof(*scans), GFP_KERNEL);
+	if (!scans)
+		return -ENOMEM;
+
+	for (i = 0; i < under_dev->nr_members; i++) {
+		for (p = 0; p < parts; p++) {
+			struct blk_hdr_scan *scan = &scans[i * parts + p];
+
+			scan->h = h;
+			scan->member = i;
+			scan->first = min_t(u64, p * step, member_blks);
+			scan->last = min_t(u64, scan->first + step,
+					   member_blks);
+			INIT_WORK(&scan->work, blk_hdr_scan_work);
+			queue_work(bcdev->wq, &scan->work);
+		}
+	}
+
+	for (i = 0; i < nr_scans; i++) {
+		flush_work(&scans[i].work);
+		ret = ret ?: scans[i].ret;
+		max_seq = max_t(u64, max_seq, scans[i].max_seq);
+	}
+
+	kfree(scans);
+
+	atomic64_set(&h->seq, max_seq);
+	h->rebuild_ms = ktime_ms_delta(ktime_get(), start);
+	return ret;
+}
+
+/* ================== INIT ================== */
+
+static int blk_hdr_sb_rw(struct blk_hdr_ctx *h, blk_opf_t opf, char *data)
+{
+	struct bcomp_dev *bcdev = h->bcdev;
+	struct buffer buf = {};
+	struct bio *bio;
+	int ret;
+
+	link_data(bcdev->bs, data, false, &buf);
+	ret = bcomp_alloc_block_bio(bcdev, opf & REQ_OP_MASK, h->sb_sect, &buf,
+				    &bio);
+	if (ret)
+		return ret;
+
+	bio->bi_opf = opf;
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+	return ret;
+}
+
+static bool blk_hdr_sb_valid(struct blk_hdr_sb *sb)
+{
+	u32 crc = le32_to_cpu(sb->crc);
+
+	if (le32_to_cpu(sb->magic) != BLK_HDR_SB_MAGIC)
+		return false;
+
+	sb->crc = 0;
+	if (crc32_le(~0, (u8 *)sb, sizeof(*sb)) != crc)
+		return false;
+	sb->crc = cpu_to_le32(crc);
+
+	return le32_to_cpu(sb->version) == BLK_HDR_SB_VERSION;
+}
+
+static int blk_hdr_format(struct blk_hdr_ctx *h, char *buf)
+{
+	struct blk_hdr_sb *sb = (struct blk_hdr_sb *)buf;
+
+	memset(buf, 0, h->bcdev->bs);
+	h->dev_id = get_random_u64();
+
+	sb->magic = cpu_to_le32(BLK_HDR_SB_MAGIC);
+	sb->version = cpu_to_le32(BLK_HDR_SB_VERSION);
+	sb->dev_id = cpu_to_le64(h->dev_id);
+	sb->bs = cpu_to_le32(h->bcdev->bs);
+	sb->crc = cpu_to_le32(crc32_le(~0, (u8 *)sb, sizeof(*sb)));
+
+	/* nothing may be stamped with an id the device doesn't keep */
+	return blk_hdr_sb_rw(h, REQ_OP_WRITE | REQ_PREFLUSH | REQ_FUA, buf);
+}
+
+int blk_hdr_load(struct blk_hdr_ctx *h, bool rebuild)
+{
+	struct blk_hdr_sb *sb;
+	__le64 id;
+	char *buf;
+	int ret;
+
+	buf = kzalloc(h->bcdev->bs, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = blk_hdr_sb_rw(h, REQ_OP_READ, buf);
+	if (ret)
+		goto free_buf;
+
+	sb = (struct blk_hdr_sb *)buf;
+	if (blk_hdr_sb_valid(sb)) {
+		if (le32_to_cpu(sb->bs) != h->bcdev->bs) {
+			BCOMP_ERRLOG("hdr: device was written with another bs");
+			ret = -EINVAL;
+			goto free_buf;
+		}
+		h->dev_id = le64_to_cpu(sb->dev_id);
+	} else if (rebuild) {
+		/* without the id no trailer can be trusted */
+		BCOMP_ERRLOG("rebuild: no block header superblock on the device");
+		ret = -EINVAL;
+		goto free_buf;
+	} else {
+		ret = blk_hdr_format(h, buf);
+		if (ret)
+			goto free_buf;
+	}
+
+	id = cpu_to_le64(h->dev_id);
+	h->seed = crc32_le(~0, (u8 *)&id, sizeof(id));
+
+free_buf:
+	kfree(buf);
+	return ret;
+}
+
+struct blk_hdr_ctx *alloc_blk_hdr(struct bcomp_dev *bcdev,
+				  enum w_block_size bs)
+{
+	struct underlying_dev *under_dev = bcdev->under_dev;
+	u32 bs_sects = bs >> SECTOR_SHIFT;
+	u64 total_blks = div_u64(under_dev->nr_sects, bs_sects);
+	struct blk_hdr_ctx *h;
+
+	if (total_blks < 2) {
+		BCOMP_ERRLOG("hdr: device is too small for the superblock");
+		return NULL;
+	}
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (!h)
+		return NULL;
+
+	h->bcdev = bcdev;
+
+	/* the last block, other areas are taken off below it */
+	h->sb_sect = (total_blks - 1) * bs_sects;
+	under_dev->nr_sects = h->sb_sect;
+
+	return h;
+}
+
+void free_blk_hdr(struct blk_hdr_ctx *h)
+{
+	kfree(h);
+}
+
+/* ================== STATS ================== */
+
+int blk_hdr_stats_emit(char *buf, int at, struct blk_hdr_ctx *h)
+{
+	return sysfs_emit_at(buf, at, PRITTY_BLK_HDR_STATS_TEMPLATE,
+			     atomic64_read(&h->seq),
+			     atomic64_read(&h->stamped_cnt),
+			     atomic64_read(&h->scanned_cnt),
+			     atomic64_read(&h->rebuilt_cnt),
+			     atomic64_read(&h->bad_cnt), h->rebuild_ms);
+}
+
+void reset_blk_hdr_stats(struct blk_hdr_ctx *h)
+{
+	atomic64_set(&h->stamped_cnt, 0);
+	atomic64_set(&h->scanned_cnt, 0);
+	atomic64_set(&h->rebuilt_cnt, 0);
+	atomic64_set(&h->bad_cnt, 0);
+}
@@ -0,0 +1,174 @@
+#include <linux/types.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "../include/bcomp_static.h"
+#include "../include/comp_controller.h"
+
+/* ================== LADDER ================== */
+
+static void ladder_insert(struct comp_controller *ctl, int comp_id,
+			  int strength, struct comp_ctx *cctx)
+{
+	int pos = ctl->ladder_len;
+
+	for (int i = 0; i < ctl->ladder_len; i++) {
+		int cur = comp_strength(ctl->ladder[i], cctx);
+
+		if (cur == strength)
+			return;
+
+		if (cur > strength) {
+			pos = i;
+			break;
+		}
+	}
+
+	memmove(&ctl->ladder[pos + 1], &ctl->ladder[pos],
+		ctl->ladder_len - pos);
+	ctl->ladder[pos] = comp_id;
+	ctl->ladder_len++;
+}
+
+static int build_ladder(struct comp_controller *ctl, int from_id, int to_id,
+			struct comp_ctx *cctx)
+{
+	int lo = comp_strength(from_id, cctx);
+	int hi = comp_strength(to_id, cctx);
+	int strength;
+
+	if (lo < 0 || hi < 0)
+		return -EINVAL;
+
+	if (lo > hi)
+		swap(lo, hi);
+
+	for (int id = 0; id <= COMP_PRF_ID_MAX; id++) {
+		strength = comp_strength(id, cctx);
+		if (strength < lo || strength > hi)
+			continue;
+
+		ladder_insert(ctl, id, strength, cctx);
+	}
+
+	return ctl->ladder_len ? 0 : -EINVAL;
+}
+
+/* ================== CONTROLLER ================== */
+
+struct comp_controller *alloc_comp_controller(int from_id, int to_id,
+					      u32 backlog_hi, u32 target_mbps,
+					      struct comp_ctx *cctx)
+{
+	struct comp_controller *ctl;
+
+	ctl = kzalloc(sizeof(*ctl), GFP_KERNEL);
+	if (!ctl)
+		return NULL;
+
+	if (build_ladder(ctl, from_id, to_id, cctx)) {
+		BCOMP_ERRLOG("adapt: invalid comp_prf_id range");
+		kfree(ctl);
+		return NULL;
+	}
+
+	ctl->backlog_hi = backlog_hi ? backlog_hi : CTL_DEFAULT_BACKLOG;
+	ctl->target_mbps = target_mbps;
+	ctl->window_start = jiffies;
+	spin_lock_init(&ctl->lock);
+
+	/* idle device: start from the best ratio */
+	atomic_set(&ctl->level, ctl->ladder_len - 1);
+
+	return ctl;
+}
+
+void free_comp_controller(struct comp_controller *ctl)
+{
+	kfree(ctl);
+}
+
+static int window_direction(struct comp_controller *ctl, u32 backlog,
+			    u64 mbps)
+{
+	u32 backlog_lo = ctl->backlog_hi / 4;
+
+	if (backlog >= ctl->backlog_hi)
+		return -1;
+
+	if (ctl->target_mbps && backlog > backlog_lo &&
+	    mbps < ctl->target_mbps)
+		return -1;
+
+	if (backlog <= backlog_lo ||
+	    (ctl->target_mbps && mbps >= ctl->target_mbps))
+		return 1;
+
+	return 0;
+}
+
+static void comp_controller_step(struct comp_controller *ctl)
+{
+	unsigned long window = msecs_to_jiffies(CTL_WINDOW_MS);
+	unsigned long now = jiffies;
+	unsigned int elapsed_ms;
+	int level, new_level;
+	u64 mbps;
+
+	if (time_before(now, READ_ONCE(ctl->window_start) + window))
+		return;
+
+	if (!spin_trylock(&ctl->lock))
+		return;
+
+	if (time_before(now, ctl->window_start + window))
+		goto unlock;
+
+	elapsed_ms = max_t(unsigned int,
+			   jiffies_to_msecs(now - ctl->window_start), 1);
+	mbps = div64_u64(atomic64_xchg(&ctl->window_bytes, 0) * MSEC_PER_SEC,
+			 (u64)elapsed_ms << 20);
+	WRITE_ONCE(ctl->window_start, now);
+
+	level = atomic_read(&ctl->level);
+	new_level = level + window_direction(
+				    ctl, atomic_read(&ctl->inflight), mbps);
+	new_level = clamp_t(int, new_level, 0, ctl->ladder_len - 1);
+
+	if (new_level > level)
+		atomic64_inc(&ctl->stronger_cnt);
+	else if (new_level < level)
+		atomic64_inc(&ctl->faster_cnt);
+
+	atomic_set(&ctl->level, new_level);
+
+unlock:
+	spin_unlock(&ctl->lock);
+}
+
+/*
+DOC:
+	Every comp_controller_start() must be paired with comp_controller_end()
+	(bytes == 0 for failed writes).
+ */
+int comp_controller_start(struct comp_controller *ctl)
+{
+	atomic_inc(&ctl->inflight);
+	comp_controller_step(ctl);
+
+	return comp_controller_cur_id(ctl);
+}
+
+void comp_controller_end(struct comp_controller *ctl, u32 bytes)
+{
+	atomic64_add(bytes, &ctl->window_bytes);
+	atomic_dec(&ctl->inflight);
+}
+
+void reset_comp_controller_stats(struct comp_controller *ctl)
+{
+	atomic64_set(&ctl->stronger_cnt, 0);
+	atomic64_set(&ctl->faster_cnt, 0);
+}
@@ -0,0 +1,193 @@
+#include <linux/types.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/sched/clock.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+
+#include "../include/comp_common.h"
+#include "../include/settings.h"
+#include "../include/cpu_acct.h"
+
+struct cpu_acct_ent {
+	u64 calls;
+	u64 ns;
+	u64 bytes_in;
+	u64 bytes_out;
+};
+
+struct cpu_acct_pcpu {
+	struct cpu_acct_ent ent[CPU_ACCT_OPS][CPRF_N][CPU_ACCT_IDS];
+};
+
+#define CPU_ACCT_PER_OP (CPRF_N * CPU_ACCT_IDS)
+#define CPU_ACCT_NR (CPU_ACCT_OPS * CPU_ACCT_PER_OP)
+
+static const char *const cpu_acct_op_names[CPU_ACCT_OPS] = { "comp",
+							      "decomp" };
+
+/* ent[][][] of a CPU as a flat array of CPU_ACCT_NR */
+static inline struct cpu_acct_ent *
+cpu_acct_ents(struct cpu_acct_pcpu __percpu *p, int cpu)
+{
+	return &per_cpu_ptr(p, cpu)->ent[0][0][0];
+}
+
+struct cpu_acct *alloc_cpu_acct(void)
+{
+	struct cpu_acct *acct;
+
+	acct = kzalloc(sizeof(*acct), GFP_KERNEL);
+	if (!acct)
+		return NULL;
+
+	acct->pcpu = alloc_percpu(struct cpu_acct_pcpu);
+	if (!acct->pcpu)
+		goto free_acct;
+
+	acct->base = alloc_percpu(struct cpu_acct_pcpu);
+	if (!acct->base)
+		goto free_pcpu;
+
+	return acct;
+
+free_pcpu:
+	free_percpu(acct->pcpu);
+free_acct:
+	kfree(acct);
+	return NULL;
+}
+
+void free_cpu_acct(struct cpu_acct *acct)
+{
+	/* waits for readers of the file */
+	debugfs_remove(acct->file);
+
+	free_percpu(acct->base);
+	free_percpu(acct->pcpu);
+	kfree(acct);
+}
+
+void cpu_acct_add(struct cpu_acct *acct, enum cpu_acct_op op,
+		  struct comp_ctx *ctx, int id, u64 start, struct chunk *data,
+		  int ret)
+{
+	struct cpu_acct_ent __percpu *ent;
+	u64 ns = local_clock() - start;
+
+	if (ctx->prf >= CPRF_N || id < 0)
+		return;
+
+	ent = &acct->pcpu->ent[op][ctx->prf][min(id, CPU_ACCT_IDS - 1)];
+	this_cpu_inc(ent->calls);
+	this_cpu_add(ent->ns, ns);
+	this_cpu_add(ent->bytes_in, data->src.data_sz);
+	if (!ret)
+		this_cpu_add(ent->bytes_out, data->dst.data_sz);
+}
+
+/* ================== READ ================== */
+
+static void cpu_acct_read(struct cpu_acct *acct, int cpu, u32 i,
+			  struct cpu_acct_ent *out)
+{
+	struct cpu_acct_ent *cur = cpu_acct_ents(acct->pcpu, cpu) + i;
+	struct cpu_acct_ent *base = cpu_acct_ents(acct->base, cpu) + i;
+
+	out->calls = READ_ONCE(cur->calls) - base->calls;
+	out->ns = READ_ONCE(cur->ns) - base->ns;
+	out->bytes_in = READ_ONCE(cur->bytes_in) - base->bytes_in;
+	out->bytes_out = READ_ONCE(cur->bytes_out) - base->bytes_out;
+}
+
+static void cpu_acct_sum_op(struct cpu_acct *acct, u32 op,
+			    struct cpu_acct_ent *sum)
+{
+	struct cpu_acct_ent e;
+	u32 i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		for (i = op * CPU_ACCT_PER_OP; i < (op + 1) * CPU_ACCT_PER_OP;
+		     i++) {
+			cpu_acct_read(acct, cpu, i, &e);
+			sum->calls += e.calls;
+			sum->ns += e.ns;
+			sum->bytes_in += e.bytes_in;
+			sum->bytes_out += e.bytes_out;
+		}
+	}
+}
+
+int cpu_acct_stats_emit(char *buf, int at, struct cpu_acct *acct)
+{
+	struct cpu_acct_ent c, d;
+
+	cpu_acct_sum_op(acct, CPU_ACCT_COMP, &c);
+	cpu_acct_sum_op(acct, CPU_ACCT_DECOMP, &d);
+
+	return sysfs_emit_at(buf, at, PRITTY_CPU_ACCT_STATS_TEMPLATE, c.calls,
+			     c.ns, c.bytes_in, c.bytes_out, d.calls, d.ns,
+			     d.bytes_in, d.bytes_out);
+}
+
+/* resets are serialized by the parameter lock */
+void reset_cpu_acct_stats(struct cpu_acct *acct)
+{
+	struct cpu_acct_ent *cur, *base;
+	u32 i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cur = cpu_acct_ents(acct->pcpu, cpu);
+		base = cpu_acct_ents(acct->base, cpu);
+
+		for (i = 0; i < CPU_ACCT_NR; i++) {
+			base[i].calls = READ_ONCE(cur[i].calls);
+			base[i].ns = READ_ONCE(cur[i].ns);
+			base[i].bytes_in = READ_ONCE(cur[i].bytes_in);
+			base[i].bytes_out = READ_ONCE(cur[i].bytes_out);
+		}
+	}
+}
+
+/* ================== DEBUGFS ================== */
+
+static int cpu_acct_show(struct seq_file *m, void *v)
+{
+	const char **prf_names = get_available_cprf_names();
+	struct cpu_acct *acct = m->private;
+	struct cpu_acct_ent e;
+	u32 i;
+	int cpu;
+
+	seq_puts(m, "cpu op profile id calls ns bytes_in bytes_out\n");
+
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < CPU_ACCT_NR; i++) {
+			cpu_acct_read(acct, cpu, i, &e);
+			if (!e.calls)
+				continue;
+
+			seq_printf(m, "%d %s %s %u %llu %llu %llu %llu\n", cpu,
+				   cpu_acct_op_names[i / CPU_ACCT_PER_OP],
+				   prf_names[i / CPU_ACCT_IDS % CPRF_N],
+				   i % CPU_ACCT_IDS, e.calls, e.ns, e.bytes_in,
+				   e.bytes_out);
+		}
+		cond_resched();
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(cpu_acct);
+
+void cpu_acct_debugfs(struct cpu_acct *acct, struct dentry *parent)
+{
+	acct->file = debugfs_create_file("cpu_time", 0400, parent, acct,
+					 &cpu_acct_fops);
+}
@@ -0,0 +1,170 @@
+#include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/jiffies.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
+
+#include "../include/bcomp.h"
+#include "../include/heat.h"
+#include "../include/policy.h"
+#include "../include/recompress.h"
+
+/* ================== DATA-PATH ================== */
+
+void heat_touch(struct heat_ctx *hc, sector_t lba)
+{
+	u64 key = bcomp_lba_to_key(hc->bcdev, lba);
+	u8 cnt = READ_ONCE(hc->cnt[key]);
+
+	if (cnt < U8_MAX)
+		WRITE_ONCE(hc->cnt[key], cnt + 1);
+}
+
+bool heat_write_raw(struct heat_ctx *hc, sector_t lba)
+{
+	u64 key = bcomp_lba_to_key(hc->bcdev, lba);
+
+	/* the block is locked by the write, bitmap ops are atomic anyway */
+	if (READ_ONCE(hc->cnt[key]) < hc->threshold) {
+		clear_bit(key, hc->raw);
+		return false;
+	}
+
+	set_bit(key, hc->raw);
+	atomic64_inc(&hc->hot_writes_cnt);
+	return true;
+}
+
+void heat_clear_raw(struct heat_ctx *hc, sector_t lba)
+{
+	clear_bit(bcomp_lba_to_key(hc->bcdev, lba), hc->raw);
+}
+
+/* ================== AGING ================== */
+
+static bool heat_has_range_rule(struct bcomp_dev *bcdev, sector_t lba)
+{
+	struct comp_range_table *tbl;
+	bool ret = false;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(bcdev->ranges);
+	if (tbl)
+		ret = comp_ranges_action(tbl, lba) != POLICY_DEFAULT;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static void heat_age_block(struct heat_ctx *hc, u64 key)
+{
+	struct bcomp_dev *bcdev = hc->bcdev;
+	sector_t lba = bcomp_key_to_lba(bcdev, key);
+	u8 cnt = READ_ONCE(hc->cnt[key]);
+	int ret;
+
+	if (test_bit(key, hc->raw)) {
+		/* -ENODATA: compressed meanwhile or incompressible, done too */
+		ret = cnt < hc->threshold ? recomp_compress_raw(bcdev, lba) :
+					    -EAGAIN;
+		if (!ret || ret == -ENODATA) {
+			clear_bit(key, hc->raw);
+			atomic64_inc(&hc->cooled_cnt);
+		}
+	} else if (cnt >= hc->threshold &&
+		   !heat_has_range_rule(bcdev, lba)) {
+		if (!recomp_store_raw(bcdev, lba)) {
+			set_bit(key, hc->raw);
+			atomic64_inc(&hc->heated_cnt);
+		}
+	}
+
+	WRITE_ONCE(hc->cnt[key], cnt >> 1);
+}
+
+static void heat_work_fn(struct work_struct *work)
+{
+	struct heat_ctx *hc =
+		container_of(to_delayed_work(work), struct heat_ctx, work);
+
+	for (u64 key = 0; key < hc->bcdev->blk_cnt; key++) {
+		heat_age_block(hc, key);
+
+		if (!(key % BITS_PER_LONG))
+			cond_resched();
+	}
+
+	atomic64_inc(&hc->passes_cnt);
+	queue_delayed_work(system_unbound_wq, &hc->work,
+			   msecs_to_jiffies(hc->age_sec * MSEC_PER_SEC));
+}
+
+/* ================== INIT ================== */
+
+struct heat_ctx *alloc_heat(struct bcomp_dev *bcdev, u32 threshold,
+			    u32 age_sec)
+{
+	struct heat_ctx *hc;
+
+	if (!threshold || threshold > U8_MAX) {
+		BCOMP_ERRLOG("hot threshold should be in [1, 255]");
+		return NULL;
+	}
+
+	hc = kzalloc(sizeof(*hc), GFP_KERNEL);
+	if (!hc)
+		return NULL;
+
+	hc->cnt = kvzalloc(bcdev->blk_cnt, GFP_KERNEL);
+	if (!hc->cnt)
+		goto free_hc;
+
+	hc->raw = kvzalloc(BITS_TO_LONGS(bcdev->blk_cnt) * sizeof(unsigned long),
+			   GFP_KERNEL);
+	if (!hc->raw)
+		goto free_cnt;
+
+	hc->bcdev = bcdev;
+	hc->threshold = threshold;
+	hc->age_sec = age_sec ?: HEAT_DEFAULT_AGE_SEC;
+	INIT_DELAYED_WORK(&hc->work, heat_work_fn);
+
+	queue_delayed_work(system_unbound_wq, &hc->work,
+			   msecs_to_jiffies(hc->age_sec * MSEC_PER_SEC));
+	return hc;
+
+free_cnt:
+	kvfree(hc->cnt);
+free_hc:
+	kfree(hc);
+	return NULL;
+}
+
+void free_heat(struct heat_ctx *hc)
+{
+	cancel_delayed_work_sync(&hc->work);
+
+	kvfree(hc->raw);
+	kvfree(hc->cnt);
+	kfree(hc);
+}
+
+int heat_stats_emit(char *buf, int at, struct heat_ctx *hc)
+{
+	return sysfs_emit_at(buf, at, PRITTY_HEAT_STATS_TEMPLATE,
+			     hc->threshold,
+			     atomic64_read(&hc->hot_writes_cnt),
+			     atomic64_read(&hc->heated_cnt),
+			     atomic64_read(&hc->cooled_cnt),
+			     atomic64_read(&hc->passes_cnt));
+}
+
+void reset_heat_stats(struct heat_ctx *hc)
+{
+	atomic64_set(&hc->hot_writes_cnt, 0);
+	atomic64_set(&hc->heated_cnt, 0);
+	atomic64_set(&hc->cooled_cnt, 0);
+	atomic64_set(&hc->passes_cnt, 0);
+}
@@ -0,0 +1,216 @@
+#include <linux/types.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "../include/lat_hist.h"
+
+DEFINE_STATIC_KEY_TRUE(bcomp_lat_key);
+
+struct lat_hist_pcpu {
+	u64 cnt[LAT_OPS][LAT_STAGES][LAT_BUCKETS];
+};
+
+static struct lat_hist_pcpu __percpu *lat_pcpu;
+static u64 lat_base[LAT_OPS][LAT_STAGES][LAT_BUCKETS]; // sums at the reset
+static DEFINE_MUTEX(lat_lock); // lat_base
+
+static const char *const lat_op_names[LAT_OPS] = { "read", "write" };
+
+/* named by the interval that ends with the stage */
+static const char *const lat_stage_names[LAT_STAGES] = {
+	[LAT_SUBMIT] = "total",
+	[LAT_ALLOC] = "alloc",
+	[LAT_COMPRESS] = "compress",
+	[LAT_MAP] = "map",
+	[LAT_UNDER_SUBMIT] = "queue",
+	[LAT_UNDER_DONE] = "device",
+	[LAT_DECOMP] = "decomp",
+	[LAT_ENDIO] = "endio",
+};
+
+static inline u32 lat_bucket(u64 ns)
+{
+	return min_t(u32, fls64(ns), LAT_BUCKETS - 1);
+}
+
+static inline void lat_account(enum lat_op op, enum lat_stage stage, u64 from,
+			       u64 to)
+{
+	/* stamps of one request may come from different CPUs */
+	u64 ns = to > from ? to - from : 0;
+
+	this_cpu_inc(lat_pcpu->cnt[op][stage][lat_bucket(ns)]);
+}
+
+void __lat_record(enum lat_op op, const u64 *lat)
+{
+	u64 prev = lat[LAT_SUBMIT];
+	u32 stage;
+
+	/* the key was flipped while the request was in flight */
+	if (!lat_pcpu || !prev)
+		return;
+
+	for (stage = LAT_SUBMIT + 1; stage < LAT_STAGES; stage++) {
+		if (!lat[stage])
+			continue;
+
+		lat_account(op, stage, prev, lat[stage]);
+		prev = lat[stage];
+	}
+
+	lat_account(op, LAT_SUBMIT, lat[LAT_SUBMIT], lat[LAT_ENDIO]);
+}
+
+/* ================== DEBUGFS ================== */
+
+static u64 lat_sum(enum lat_op op, enum lat_stage stage, u32 b)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(per_cpu_ptr(lat_pcpu, cpu)->cnt[op][stage][b]);
+
+	return sum;
+}
+
+/* upper bound of the bucket holding the permille-th request */
+static u64 lat_percentile(const u64 *sums, u64 total, u32 permille)
+{
+	u64 target = DIV_ROUND_UP_ULL(total * permille, 1000);
+	u64 seen = 0;
+	u32 b;
+
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		seen += sums[b];
+		if (seen >= target)
+			break;
+	}
+
+	return b ? 1ULL << min_t(u32, b, LAT_BUCKETS - 1) : 0;
+}
+
+static int lat_show(struct seq_file *m, void *v)
+{
+	u64 sums[LAT_BUCKETS];
+	u64 total;
+	u32 op, stage, b;
+
+	seq_puts(m, "op stage cnt p50_ns p99_ns p999_ns\n");
+
+	mutex_lock(&lat_lock);
+	for (op = 0; op < LAT_OPS; op++) {
+		for (stage = 0; stage < LAT_STAGES; stage++) {
+			total = 0;
+			for (b = 0; b < LAT_BUCKETS; b++) {
+				sums[b] = lat_sum(op, stage, b) -
+					  lat_base[op][stage][b];
+				total += sums[b];
+			}
+
+			if (!total)
+				continue;
+
+			seq_printf(m, "%s %s %llu %llu %llu %llu\n",
+				   lat_op_names[op], lat_stage_names[stage],
+				   total, lat_percentile(sums, total, 500),
+				   lat_percentile(sums, total, 990),
+				   lat_percentile(sums, total, 999));
+		}
+	}
+	mutex_unlock(&lat_lock);
+
+	return 0;
+}
+
+static int lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lat_show, NULL);
+}
+
+/* any write resets */
+static ssize_t lat_reset(struct file *file, const char __user *ubuf,
+			 size_t len, loff_t *pos)
+{
+	u64 *base = &lat_base[0][0][0];
+	u32 op, stage, b;
+
+	mutex_lock(&lat_lock);
+	for (op = 0; op < LAT_OPS; op++)
+		for (stage = 0; stage < LAT_STAGES; stage++)
+			for (b = 0; b < LAT_BUCKETS; b++)
+				*base++ = lat_sum(op, stage, b);
+	mutex_unlock(&lat_lock);
+
+	return len;
+}
+
+static const struct file_operations lat_fops = {
+	.owner = THIS_MODULE,
+	.open = lat_open,
+	.read = seq_read,
+	.write = lat_reset,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static ssize_t lat_enabled_read(struct file *file, char __user *ubuf,
+				size_t len, loff_t *pos)
+{
+	char buf[2] = { static_key_enabled(&bcomp_lat_key) ? '1' : '0', '\n' };
+
+	return simple_read_from_buffer(ubuf, len, pos, buf, sizeof(buf));
+}
+
+static ssize_t lat_enabled_write(struct file *file, const char __user *ubuf,
+				 size_t len, loff_t *pos)
+{
+	bool on;
+	int ret;
+
+	ret = kstrtobool_from_user(ubuf, len, &on);
+	if (ret)
+		return ret;
+
+	if (on)
+		static_branch_enable(&bcomp_lat_key);
+	else
+		static_branch_disable(&bcomp_lat_key);
+
+	return len;
+}
+
+static const struct file_operations lat_enabled_fops = {
+	.owner = THIS_MODULE,
+	.read = lat_enabled_read,
+	.write = lat_enabled_write,
+	.llseek = default_llseek,
+};
+
+/* ================== INIT ================== */
+
+int lat_hist_init(struct dentry *parent)
+{
+	lat_pcpu = alloc_percpu(struct lat_hist_pcpu);
+	if (!lat_pcpu) {
+		static_branch_disable(&bcomp_lat_key);
+		return -ENOMEM;
+	}
+
+	debugfs_create_file("latency", 0600, parent, NULL, &lat_fops);
+	debugfs_create_file("enabled", 0600, parent, NULL, &lat_enabled_fops);
+	return 0;
+}
+
+/* the files are gone with the debugfs dir of the module */
+void lat_hist_exit(void)
+{
+	static_branch_disable(&bcomp_lat_key);
+	free_percpu(lat_pcpu);
+	lat_pcpu = NULL;
+}
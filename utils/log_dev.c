@@ -0,0 +1,304 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
+
+#include "../include/bcomp.h"
+#include "../include/log_dev.h"
+
+static inline u64 log_used(struct log_ctx *log)
+{
+	return log->head - log->tail;
+}
+
+/* ================== DATA-PATH ================== */
+
+struct log_rec *log_reserve(struct log_ctx *log, sector_t lba, u32 data_sz)
+{
+	struct log_rec *rec;
+	unsigned long flags;
+	u32 len = round_up(data_sz, log->lbs);
+	u32 sects = len >> SECTOR_SHIFT;
+	u32 pad;
+	u64 pos;
+
+	rec = kzalloc(sizeof(*rec), GFP_NOIO);
+	if (!rec)
+		goto no_space;
+
+	spin_lock_irqsave(&log->lock, flags);
+	div64_u64_rem(log->head, log->nr_sects, &pos);
+	/* a record never wraps */
+	pad = pos + sects > log->nr_sects ? log->nr_sects - pos : 0;
+	if (log_used(log) + pad + sects > log->nr_sects) {
+		spin_unlock_irqrestore(&log->lock, flags);
+		kfree(rec);
+		atomic64_inc(&log->full_cnt);
+		goto no_space;
+	}
+
+	rec->lba = lba;
+	rec->sect = pad ? 0 : pos;
+	rec->len = len;
+	rec->span = pad + sects;
+	log->head += rec->span;
+	list_add_tail(&rec->fifo, &log->fifo);
+	spin_unlock_irqrestore(&log->lock, flags);
+
+	return rec;
+
+no_space:
+	log_forget(log, lba);
+	return NULL;
+}
+
+void log_commit(struct log_ctx *log, struct log_rec *rec, bool ok)
+{
+	u64 key = bcomp_lba_to_key(log->bcdev, rec->lba);
+	unsigned long flags;
+	bool urgent;
+
+	spin_lock_irqsave(&log->lock, flags);
+	rec->done = true;
+	/* a failed record is never indexed, the destager just frees it */
+	if (ok)
+		log->idx[key] = rec;
+	urgent = log_used(log) * 2 > log->nr_sects;
+	spin_unlock_irqrestore(&log->lock, flags);
+
+	if (ok)
+		atomic64_inc(&log->appended_cnt);
+	else
+		atomic64_inc(&log->errors_cnt);
+
+	if (urgent)
+		mod_delayed_work(log->bcdev->wq, &log->work, 0);
+	else
+		queue_delayed_work(log->bcdev->wq, &log->work,
+				   msecs_to_jiffies(LOG_DESTAGE_MS));
+}
+
+struct log_rec *log_lookup(struct log_ctx *log, sector_t lba)
+{
+	u64 key = bcomp_lba_to_key(log->bcdev, lba);
+	struct log_rec *rec;
+	unsigned long flags;
+
+	spin_lock_irqsave(&log->lock, flags);
+	rec = log->idx[key];
+	spin_unlock_irqrestore(&log->lock, flags);
+
+	return rec;
+}
+
+void log_forget(struct log_ctx *log, sector_t lba)
+{
+	u64 key = bcomp_lba_to_key(log->bcdev, lba);
+	unsigned long flags;
+
+	spin_lock_irqsave(&log->lock, flags);
+	log->idx[key] = NULL;
+	spin_unlock_irqrestore(&log->lock, flags);
+}
+
+/* ================== DESTAGE ================== */
+
+static bool log_is_current(struct log_ctx *log, struct log_rec *rec)
+{
+	u64 key = bcomp_lba_to_key(log->bcdev, rec->lba);
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&log->lock, flags);
+	ret = log->idx[key] == rec;
+	spin_unlock_irqrestore(&log->lock, flags);
+
+	return ret;
+}
+
+/*
+DOC:
+	bcomp_rw_block_sync() reads an indexed block from the log and drops
+	the record after a successful home write, so a record is copied with
+	the same helpers the background workers use.
+ */
+static int log_destage_rec(struct log_ctx *log, struct log_rec *rec,
+			   struct buffer *buf)
+{
+	struct bcomp_dev *bcdev = log->bcdev;
+	struct map_cell *cell;
+	int ret = 0;
+
+	bcomp_lock_block(bcdev, rec->lba);
+	if (!log_is_current(log, rec))
+		goto unlock;
+
+	ret = bcomp_rw_block_sync(bcdev, REQ_OP_READ, rec->lba, buf);
+	if (ret)
+		goto unlock;
+
+	/* the log keeps only the compressed part, the trailer is added here */
+	if (bcdev->hdr) {
+		ret = get_mapping(&cell, rec->lba, bcdev->map);
+		if (ret)
+			goto unlock;
+		blk_hdr_stamp(bcdev->hdr, cell, buf);
+	}
+
+	ret = bcomp_rw_block_sync(bcdev, REQ_OP_WRITE, rec->lba, buf);
+
+	if (!ret)
+		atomic64_inc(&log->destaged_cnt);
+
+unlock:
+	bcomp_unlock_block(bcdev, rec->lba);
+	return ret;
+}
+
+/* returns 0 when the log is empty */
+static int log_destage(struct log_ctx *log)
+{
+	struct log_rec *rec;
+	struct buffer buf = {};
+	unsigned long flags;
+	char *data;
+	int ret = 0;
+
+	data = kmalloc(log->bcdev->bs, GFP_NOIO);
+	if (!data)
+		return -ENOMEM;
+	link_data(log->bcdev->bs, data, true, &buf);
+
+	for (;;) {
+		spin_lock_irqsave(&log->lock, flags);
+		rec = list_first_entry_or_null(&log->fifo, struct log_rec,
+					       fifo);
+		spin_unlock_irqrestore(&log->lock, flags);
+
+		/* the oldest write is still in flight, log_commit() kicks */
+		if (!rec || !rec->done) {
+			ret = rec ? -EAGAIN : 0;
+			break;
+		}
+
+		ret = log_destage_rec(log, rec, &buf);
+		if (ret) {
+			atomic64_inc(&log->errors_cnt);
+			break;
+		}
+
+		spin_lock_irqsave(&log->lock, flags);
+		list_del(&rec->fifo);
+		log->tail += rec->span;
+		spin_unlock_irqrestore(&log->lock, flags);
+		kfree(rec);
+
+		cond_resched();
+	}
+
+	kfree(data);
+	return ret;
+}
+
+static void log_destage_work(struct work_struct *work)
+{
+	struct log_ctx *log = container_of(to_delayed_work(work),
+					   struct log_ctx, work);
+
+	int ret = log_destage(log);
+
+	/* I/O errors are retried later, in-flight records kick us again */
+	if (ret && ret != -EAGAIN)
+		queue_delayed_work(log->bcdev->wq, &log->work,
+				   msecs_to_jiffies(LOG_DESTAGE_MS));
+}
+
+/* ================== INIT ================== */
+
+struct log_ctx *alloc_log(struct bcomp_dev *bcdev, const char *path)
+{
+	struct log_ctx *log;
+	struct file *fl;
+
+	log = kzalloc(sizeof(*log), GFP_KERNEL);
+	if (!log)
+		return NULL;
+
+	fl = bdev_file_open_by_path(path, BLK_OPEN_READ | BLK_OPEN_WRITE, log,
+				    NULL);
+	if (IS_ERR(fl)) {
+		BCOMP_ERRLOG("log: incorrect path");
+		goto free_log;
+	}
+
+	log->bcdev = bcdev;
+	log->bdev_fl = fl;
+	log->bdev = file_bdev(fl);
+	log->nr_sects = bdev_nr_sectors(log->bdev);
+	log->lbs = bdev_logical_block_size(log->bdev);
+	if (log->nr_sects < (bcdev->bs >> SECTOR_SHIFT) * 2) {
+		BCOMP_ERRLOG("log: device is too small");
+		goto put_fl;
+	}
+
+	log->idx = kvcalloc(bcdev->blk_cnt, sizeof(*log->idx), GFP_KERNEL);
+	if (!log->idx)
+		goto put_fl;
+
+	spin_lock_init(&log->lock);
+	INIT_LIST_HEAD(&log->fifo);
+	INIT_DELAYED_WORK(&log->work, log_destage_work);
+
+	return log;
+
+put_fl:
+	bdev_fput(fl);
+free_log:
+	kfree(log);
+	return NULL;
+}
+
+void free_log(struct log_ctx *log)
+{
+	struct log_rec *rec, *tmp;
+
+	cancel_delayed_work_sync(&log->work);
+	if (log_destage(log))
+		BCOMP_ERRLOG("log: records left not destaged");
+
+	list_for_each_entry_safe(rec, tmp, &log->fifo, fifo)
+		kfree(rec);
+
+	kvfree(log->idx);
+	bdev_fput(log->bdev_fl);
+	kfree(log);
+}
+
+/* ================== STATS ================== */
+
+int log_stats_emit(char *buf, int at, struct log_ctx *log)
+{
+	return sysfs_emit_at(buf, at, PRITTY_LOG_STATS_TEMPLATE,
+			     (u64)log->nr_sects, READ_ONCE(log->head) -
+						 READ_ONCE(log->tail),
+			     atomic64_read(&log->appended_cnt),
+			     atomic64_read(&log->destaged_cnt),
+			     atomic64_read(&log->full_cnt),
+			     atomic64_read(&log->read_hits_cnt),
+			     atomic64_read(&log->errors_cnt));
+}
+
+void reset_log_stats(struct log_ctx *log)
+{
+	atomic64_set(&log->appended_cnt, 0);
+	atomic64_set(&log->destaged_cnt, 0);
+	atomic64_set(&log->full_cnt, 0);
+	atomic64_set(&log->read_hits_cnt, 0);
+	atomic64_set(&log->errors_cnt, 0);
+}
@@ -0,0 +1,157 @@
+#include <linux/types.h>
+#include <linux/crc32.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+#include "../include/bcomp.h"
+#include "../include/map_file.h"
+
+static int map_file_read(struct file *file, void *buf, size_t len,
+			 loff_t *pos)
+{
+	ssize_t n;
+
+	while (len) {
+		n = kernel_read(file, buf, len, pos);
+		if (n < 0)
+			return n;
+		if (!n)
+			return -EIO; // truncated
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int map_file_check_hdr(struct bcomp_dev *bcdev,
+			      struct map_file_hdr *hdr)
+{
+	u32 crc = le32_to_cpu(hdr->crc);
+
+	hdr->crc = 0;
+	if (le32_to_cpu(hdr->magic) != MAP_FILE_MAGIC ||
+	    crc32_le(~0, (u8 *)hdr, sizeof(*hdr)) != crc) {
+		BCOMP_ERRLOG("map file: bad header");
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(hdr->version) != MAP_FILE_VERSION) {
+		BCOMP_ERRLOG("map file: unsupported version");
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(hdr->bs) != bcdev->bs) {
+		BCOMP_ERRLOG("map file: built for another block size");
+		return -EINVAL;
+	}
+
+	if (le64_to_cpu(hdr->blk_cnt) > bcdev->blk_cnt) {
+		BCOMP_ERRLOG("map file: image is larger than the device");
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+static int map_file_apply(struct bcomp_dev *bcdev, u64 key,
+			  struct map_file_ent *ent)
+{
+	sector_t lba = bcomp_key_to_lba(bcdev, key);
+	u32 psize = le32_to_cpu(ent->psize);
+	struct map_cell *cell;
+	int ret;
+
+	/* raw blocks of the image are data too */
+	bcomp_mark_written(bcdev, lba);
+	if (!psize)
+		return 0;
+
+	if (psize >= bcdev->bs || ent->cprf >= CPRF_N) {
+		BCOMP_ERRLOG("map file: broken entry");
+		return -EUCLEAN;
+	}
+
+	if (ent->nsub > 1 && !bcdev->split_wq) {
+		BCOMP_ERRLOG("map file: image was built with split, map it so");
+		return -EINVAL;
+	}
+
+	ret = update_mapping(&cell, lba, bcdev->bs, psize, bcdev->map);
+	if (ret || !cell)
+		return ret ?: -EIO;
+
+	cell->cprf = ent->cprf;
+	cell->comp_prf_id = ent->comp_prf_id;
+	cell->nsub = ent->nsub;
+	cell->wtime = ktime_get_seconds();
+	return 0;
+}
+
+int map_file_load(struct bcomp_dev *bcdev, const char *path)
+{
+	u32 per_io = MAP_FILE_IO / sizeof(struct map_file_ent);
+	struct map_file_ent *ents;
+	struct map_file_hdr hdr;
+	struct file *file;
+	u64 key, blk_cnt;
+	loff_t pos = 0;
+	u32 crc = ~0;
+	u32 i, n;
+	int ret;
+
+	file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		BCOMP_ERRLOG("map file: can't open");
+		return PTR_ERR(file);
+	}
+
+	ents = kvmalloc(MAP_FILE_IO, GFP_KERNEL);
+	if (!ents) {
+		ret = -ENOMEM;
+		goto close_file;
+	}
+
+	ret = map_file_read(file, &hdr, sizeof(hdr), &pos);
+	if (ret)
+		goto free_ents;
+
+	ret = map_file_check_hdr(bcdev, &hdr);
+	if (ret)
+		goto free_ents;
+
+	blk_cnt = le64_to_cpu(hdr.blk_cnt);
+	for (key = 0; key < blk_cnt; key += n) {
+		n = min_t(u64, per_io, blk_cnt - key);
+		ret = map_file_read(file, ents, n * sizeof(*ents), &pos);
+		if (ret)
+			goto free_ents;
+
+		crc = crc32_le(crc, (u8 *)ents, n * sizeof(*ents));
+		for (i = 0; i < n; i++) {
+			ret = map_file_apply(bcdev, key + i, &ents[i]);
+			if (ret)
+				goto free_ents;
+		}
+
+		cond_resched();
+	}
+
+	/* the device isn't visible yet, a broken file just fails the map */
+	if (crc != le32_to_cpu(hdr.ents_crc)) {
+		BCOMP_ERRLOG("map file: entries crc mismatch");
+		ret = -EUCLEAN;
+		goto free_ents;
+	}
+
+	BCOMP_LOG("map file loaded");
+
+free_ents:
+	kvfree(ents);
+close_file:
+	filp_close(file, NULL);
+	return ret;
+}
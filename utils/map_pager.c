@@ -0,0 +1,721 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/timekeeping.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "../include/bcomp.h"
+#include "../include/map_pager.h"
+#include "../map_profiles/cell_manager.h"
+
+static inline size_t pager_page_size(struct map_pager *pager)
+{
+	return sizeof(struct map_page) +
+	       pager->per_page * sizeof(struct map_cell *);
+}
+
+static inline u64 pager_page_nr(struct map_pager *pager, sector_t lba,
+				u32 *idx)
+{
+	return div_u64_rem(bcomp_lba_to_key(pager->bcdev, lba),
+			   pager->per_page, idx);
+}
+
+static inline sector_t pager_page_lba(struct map_pager *pager,
+				      struct map_page *page, u32 idx)
+{
+	return bcomp_key_to_lba(pager->bcdev,
+				page->nr * pager->per_page + idx);
+}
+
+/* blocks of the last page past the end of the device don't exist */
+static inline u32 pager_page_blks(struct map_pager *pager, u64 nr)
+{
+	return min_t(u64, pager->per_page,
+		     pager->blk_cnt - nr * pager->per_page);
+}
+
+static void pager_check_budget(struct map_pager *pager)
+{
+	if (atomic64_read(&pager->mem) > pager->budget)
+		queue_work(pager->wq, &pager->evict_work);
+}
+
+/* ================== IO ================== */
+
+static struct bio *pager_bio(struct map_pager *pager, blk_opf_t opf, u64 nr,
+			     char *data)
+{
+	struct buffer buf = {};
+	struct under_member *m;
+	struct bio *bio;
+	sector_t sector;
+
+	m = bcomp_under_map(pager->bcdev,
+			    pager->start + nr * (pager->bs >> SECTOR_SHIFT),
+			    &sector);
+	bio = bio_alloc(m->bdev, DIV_ROUND_UP(pager->bs, PAGE_SIZE) + 1, opf,
+			GFP_NOIO);
+	if (!bio)
+		return NULL;
+
+	link_data(pager->bs, data, false, &buf);
+	if (add_buffer_to_bio(&buf, pager->bs, bio)) {
+		bio_put(bio);
+		return NULL;
+	}
+
+	bio->bi_iter.bi_sector = sector;
+	return bio;
+}
+
+/* ================== PAGE ================== */
+
+static void pager_free_page(struct map_pager *pager, struct map_page *page)
+{
+	u64 bytes = pager_page_size(pager);
+	u32 i;
+
+	for (i = 0; i < pager->per_page; i++) {
+		if (!page->cells[i])
+			continue;
+
+		kfree(page->cells[i]);
+		bytes += sizeof(struct map_cell);
+	}
+
+	atomic64_sub(bytes, &pager->mem);
+	kfree(page);
+}
+
+/* buf == NULL -- a page without a disk copy, all blocks raw */
+static struct map_page *pager_decode(struct map_pager *pager, u64 nr,
+				     char *buf)
+{
+	struct meta_ent *ent = (struct meta_ent *)buf;
+	struct map_page *page;
+	struct map_cell *cell;
+	u32 i, psize;
+
+	page = kzalloc(pager_page_size(pager), GFP_NOIO);
+	if (!page)
+		return NULL;
+
+	page->nr = nr;
+	atomic64_add(pager_page_size(pager), &pager->mem);
+	if (!buf)
+		return page;
+
+	for (i = 0; i < pager_page_blks(pager, nr); i++) {
+		psize = le32_to_cpu(ent[i].psize);
+		if (!psize)
+			continue;
+
+		if (psize >= pager->bs) {
+			BCOMP_ERRLOG("pager: broken map page");
+			goto free_page;
+		}
+
+		cell = kzalloc(sizeof(*cell), GFP_NOIO);
+		if (!cell)
+			goto free_page;
+
+		cell->lba = pager_page_lba(pager, page, i);
+		cell->pba = cell->lba;
+		cell->lsize = pager->bs;
+		cell->psize = psize;
+		cell->refcnt = 1;
+		cell->cprf = ent[i].cprf;
+		cell->comp_prf_id = ent[i].comp_prf_id;
+		cell->nsub = ent[i].nsub;
+		cell->wtime = ktime_get_seconds();
+
+		page->cells[i] = cell;
+		atomic64_add(sizeof(*cell), &pager->mem);
+	}
+
+	return page;
+
+free_page:
+	pager_free_page(pager, page);
+	return NULL;
+}
+
+static void pager_encode(struct map_pager *pager, struct map_page *page,
+			 char *buf)
+{
+	struct meta_ent *ent = (struct meta_ent *)buf;
+	struct map_cell *cell;
+	u32 i;
+
+	memset(buf, 0, pager->bs);
+	for (i = 0; i < pager->per_page; i++) {
+		cell = page->cells[i];
+		if (!is_data_compressed(cell))
+			continue;
+
+		ent[i].psize = cpu_to_le32(cell->psize);
+		ent[i].cprf = cell->cprf;
+		ent[i].comp_prf_id = cell->comp_prf_id;
+		ent[i].nsub = cell->nsub;
+	}
+}
+
+/* under pager->lock */
+static void pager_install(struct map_pager *pager, struct map_page *page)
+{
+	page->referenced = true;
+	list_add(&page->node, &pager->resident);
+	pager->nr_resident++;
+	smp_store_release(&pager->pages[page->nr], page);
+}
+
+/* ================== FAULT ================== */
+
+/* under pager->lock */
+static struct map_fault *pager_find_fault(struct map_pager *pager, u64 nr)
+{
+	struct map_fault *f;
+
+	list_for_each_entry(f, &pager->faults, node) {
+		if (f->nr == nr)
+			return f;
+	}
+
+	return NULL;
+}
+
+static void pager_fault_work(struct work_struct *work)
+{
+	struct map_fault *f = container_of(work, struct map_fault, work);
+	struct map_pager *pager = f->pager;
+	struct map_page *page = NULL;
+	struct bio_list parked;
+	struct bio *bio;
+
+	if (f->status == BLK_STS_OK)
+		page = pager_decode(pager, f->nr, f->buf);
+
+	if (!page) {
+		BCOMP_ERRLOG("pager: map page fault failed");
+		atomic64_inc(&pager->errors_cnt);
+	}
+
+	bio_list_init(&parked);
+
+	spin_lock(&pager->lock);
+	list_del(&f->node);
+	if (page)
+		pager_install(pager, page);
+	bio_list_merge(&parked, &f->parked);
+	spin_unlock(&pager->lock);
+
+	wake_up_all(&pager->wait);
+	if (page)
+		pager_check_budget(pager);
+
+	/* they take the block lock again and find the page resident */
+	while ((bio = bio_list_pop(&parked))) {
+		if (page)
+			submit_bio_noacct(bio);
+		else
+			bio_io_error(bio);
+	}
+
+	kfree(f->buf);
+	kfree(f);
+}
+
+static void pager_fault_endio(struct bio *bio)
+{
+	struct map_fault *f = bio->bi_private;
+
+	f->status = bio->bi_status;
+	bio_put(bio);
+
+	queue_work(f->pager->wq, &f->work);
+}
+
+/*
+DOC:
+	One read per page: the first faulter starts it, the rest add their
+	bio (or nothing, process context waits on pager->wait). 1 -- the page
+	got resident in the meantime, nothing was queued.
+ */
+static int pager_fault_start(struct map_pager *pager, u64 nr, struct bio *bio)
+{
+	struct map_fault *f, *new_f;
+	struct bio *read_bio;
+
+	new_f = kzalloc(sizeof(*new_f), GFP_NOIO);
+	if (!new_f)
+		return -ENOMEM;
+
+	new_f->buf = kmalloc(pager->bs, GFP_NOIO);
+	if (!new_f->buf) {
+		kfree(new_f);
+		return -ENOMEM;
+	}
+
+	spin_lock(&pager->lock);
+	if (pager->pages[nr]) {
+		spin_unlock(&pager->lock);
+		f = NULL;
+		goto free_new_f;
+	}
+
+	f = pager_find_fault(pager, nr);
+	if (f) {
+		if (bio)
+			bio_list_add(&f->parked, bio);
+		spin_unlock(&pager->lock);
+		goto free_new_f;
+	}
+
+	f = new_f;
+	f->pager = pager;
+	f->nr = nr;
+	f->status = BLK_STS_OK;
+	bio_list_init(&f->parked);
+	if (bio)
+		bio_list_add(&f->parked, bio);
+	INIT_WORK(&f->work, pager_fault_work);
+	list_add(&f->node, &pager->faults);
+	spin_unlock(&pager->lock);
+
+	atomic64_inc(&pager->faults_cnt);
+
+	read_bio = pager_bio(pager, REQ_OP_READ, nr, f->buf);
+	if (!read_bio) {
+		f->status = BLK_STS_RESOURCE;
+		queue_work(pager->wq, &f->work);
+		return 0;
+	}
+
+	read_bio->bi_end_io = pager_fault_endio;
+	read_bio->bi_private = f;
+	submit_bio(read_bio);
+	return 0;
+
+free_new_f:
+	kfree(new_f->buf);
+	kfree(new_f);
+	return f ? 0 : 1;
+}
+
+static bool pager_fault_done(struct map_pager *pager, u64 nr)
+{
+	bool done;
+
+	spin_lock(&pager->lock);
+	done = !pager_find_fault(pager, nr);
+	spin_unlock(&pager->lock);
+
+	return done;
+}
+
+static int pager_fault_wait(struct map_pager *pager, u64 nr)
+{
+	int ret;
+
+	ret = pager_fault_start(pager, nr, NULL);
+	if (ret < 0)
+		return ret;
+
+	if (!ret)
+		wait_event(pager->wait, pager_fault_done(pager, nr));
+
+	return smp_load_acquire(&pager->pages[nr]) ? 0 : -EIO;
+}
+
+bool map_pager_park(struct map_pager *pager, sector_t lba, struct bio *bio)
+{
+	u32 idx;
+	u64 nr = pager_page_nr(pager, lba, &idx);
+	int ret;
+
+	if (smp_load_acquire(&pager->pages[nr]) ||
+	    !test_bit(nr, pager->on_disk))
+		return false;
+
+	ret = pager_fault_start(pager, nr, bio);
+	if (ret > 0)
+		return false;
+
+	if (ret < 0) {
+		atomic64_inc(&pager->errors_cnt);
+		bio_io_error(bio);
+		return true;
+	}
+
+	atomic64_inc(&pager->parked_cnt);
+	return true;
+}
+
+/*
+DOC:
+	Under the block lock of a block of the page, so a resident page stays
+	resident. A page with a disk copy is faulted in, waiting for it
+	inside submit_bio would deadlock (the read is only issued after the
+	caller returns), so there the caller gets -EAGAIN: the submit path
+	parks its bio with map_pager_park() beforehand and never sees it.
+ */
+static int pager_get_page(struct map_pager *pager, u64 nr, bool create,
+			  struct map_page **page_ptr)
+{
+	struct map_page *page, *new_page;
+	int ret;
+
+	page = smp_load_acquire(&pager->pages[nr]);
+	if (page)
+		goto found;
+
+	if (test_bit(nr, pager->on_disk)) {
+		if (current->bio_list)
+			return -EAGAIN;
+
+		ret = pager_fault_wait(pager, nr);
+		if (ret)
+			return ret;
+
+		page = smp_load_acquire(&pager->pages[nr]);
+		goto found;
+	}
+
+	if (!create) {
+		*page_ptr = NULL;
+		return 0;
+	}
+
+	new_page = pager_decode(pager, nr, NULL);
+	if (!new_page)
+		return -ENOMEM;
+
+	/* another block of the page may have created it */
+	spin_lock(&pager->lock);
+	page = pager->pages[nr];
+	if (!page) {
+		pager_install(pager, new_page);
+		page = new_page;
+		new_page = NULL;
+	}
+	spin_unlock(&pager->lock);
+
+	if (new_page)
+		pager_free_page(pager, new_page);
+
+	pager_check_budget(pager);
+
+found:
+	WRITE_ONCE(page->referenced, true);
+	*page_ptr = page;
+	return 0;
+}
+
+/* ================== EVICT ================== */
+
+static bool pager_trylock_page(struct map_pager *pager, struct map_page *page)
+{
+	u32 n = pager_page_blks(pager, page->nr);
+	u32 i;
+
+	for (i = 0; i < n; i++) {
+		if (!bcomp_trylock_block(pager->bcdev,
+					 pager_page_lba(pager, page, i)))
+			goto unlock;
+	}
+
+	return true;
+
+unlock:
+	while (i--)
+		bcomp_unlock_block(pager->bcdev, pager_page_lba(pager, page, i));
+	return false;
+}
+
+static void pager_unlock_page(struct map_pager *pager, struct map_page *page)
+{
+	u32 n = pager_page_blks(pager, page->nr);
+	u32 i;
+
+	for (i = 0; i < n; i++)
+		bcomp_unlock_block(pager->bcdev, pager_page_lba(pager, page, i));
+}
+
+/* with all block locks of the page */
+static int pager_evict(struct map_pager *pager, struct map_page *page,
+		       char *buf)
+{
+	struct bio *bio;
+	int ret;
+
+	if (page->dirty) {
+		pager_encode(pager, page, buf);
+
+		bio = pager_bio(pager, REQ_OP_WRITE, page->nr, buf);
+		if (!bio)
+			return -ENOMEM;
+
+		ret = submit_bio_wait(bio);
+		bio_put(bio);
+		if (ret)
+			return ret;
+
+		atomic64_inc(&pager->written_cnt);
+	}
+
+	spin_lock(&pager->lock);
+	if (page->dirty)
+		set_bit(page->nr, pager->on_disk);
+	list_del(&page->node);
+	pager->nr_resident--;
+	WRITE_ONCE(pager->pages[page->nr], NULL);
+	spin_unlock(&pager->lock);
+
+	atomic64_inc(&pager->evicted_cnt);
+	return 0;
+}
+
+static void pager_evict_work(struct work_struct *work)
+{
+	struct map_pager *pager =
+		container_of(work, struct map_pager, evict_work);
+	u64 low = div_u64(pager->budget * MAP_PAGER_LOW_PCT, 100);
+	struct map_page *page;
+	u64 budget_steps;
+	char *buf;
+	int ret;
+
+	buf = kmalloc(pager->bs, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	spin_lock(&pager->lock);
+
+	/* two turns of the hand: clear the bits, then evict */
+	budget_steps = 2 * pager->nr_resident;
+	while (atomic64_read(&pager->mem) > low && budget_steps--) {
+		if (list_empty(&pager->resident))
+			break;
+
+		page = list_last_entry(&pager->resident, struct map_page,
+				       node);
+		list_move(&page->node, &pager->resident);
+		if (READ_ONCE(page->referenced)) {
+			WRITE_ONCE(page->referenced, false);
+			continue;
+		}
+
+		/* only this work frees pages, it stays valid unlocked */
+		spin_unlock(&pager->lock);
+
+		if (pager_trylock_page(pager, page)) {
+			ret = pager_evict(pager, page, buf);
+			pager_unlock_page(pager, page);
+
+			if (ret) {
+				BCOMP_ERRLOG("pager: map page write failed");
+				atomic64_inc(&pager->errors_cnt);
+			} else {
+				pager_free_page(pager, page);
+			}
+		}
+
+		cond_resched();
+		spin_lock(&pager->lock);
+	}
+
+	spin_unlock(&pager->lock);
+	kfree(buf);
+}
+
+/* ================== CELL_MANAGER ================== */
+
+static int pager_get_cell_ptr(struct map_cell **cell_ptr, sector_t lba,
+			      void *cell_manager_ctx)
+{
+	struct map_pager *pager = cell_manager_ctx;
+	struct map_page *page;
+	u32 idx;
+	u64 nr = pager_page_nr(pager, lba, &idx);
+	int ret;
+
+	BUG_ON(nr >= pager->nr_pages);
+
+	ret = pager_get_page(pager, nr, false, &page);
+	if (ret)
+		return ret;
+
+	*cell_ptr = page ? page->cells[idx] : NULL;
+	return 0;
+}
+
+static int pager_alloc_cell(struct map_cell **cell_ptr, sector_t lba,
+			    void *cell_manager_ctx)
+{
+	struct map_pager *pager = cell_manager_ctx;
+	struct map_page *page;
+	struct map_cell *cell;
+	u32 idx;
+	u64 nr = pager_page_nr(pager, lba, &idx);
+	int ret;
+
+	BUG_ON(nr >= pager->nr_pages);
+
+	ret = pager_get_page(pager, nr, true, &page);
+	if (ret)
+		return ret;
+
+	cell = page->cells[idx];
+	if (!cell) {
+		cell = kzalloc(sizeof(*cell), GFP_NOIO);
+		if (!cell)
+			return -ENOMEM;
+
+		page->cells[idx] = cell;
+		atomic64_add(sizeof(*cell), &pager->mem);
+		pager_check_budget(pager);
+	}
+
+	__clear_cell(cell);
+	*cell_ptr = cell;
+	return 0;
+}
+
+static void pager_dirty_cell(sector_t lba, void *cell_manager_ctx)
+{
+	struct map_pager *pager = cell_manager_ctx;
+	struct map_page *page;
+	u32 idx;
+	u64 nr = pager_page_nr(pager, lba, &idx);
+
+	page = READ_ONCE(pager->pages[nr]);
+	if (page)
+		WRITE_ONCE(page->dirty, true);
+}
+
+/* the pager is owned by bcomp_dev, the map doesn't allocate or free it */
+static const struct cell_manager_ops map_pager_cell_ops = {
+	.get_cell_ptr = pager_get_cell_ptr,
+	.alloc_cell = pager_alloc_cell,
+	.dirty_cell = pager_dirty_cell,
+};
+
+const struct cell_manager_ops *get_map_pager_cell_ops(void)
+{
+	return &map_pager_cell_ops;
+}
+
+/* ================== INIT ================== */
+
+struct map_pager *alloc_map_pager(struct bcomp_dev *bcdev,
+				  enum w_block_size bs, u32 mem_mb)
+{
+	struct underlying_dev *under_dev = bcdev->under_dev;
+	u32 bs_sects = bs >> SECTOR_SHIFT;
+	struct map_pager *pager;
+	u64 total_blks;
+
+	pager = kzalloc(sizeof(*pager), GFP_KERNEL);
+	if (!pager)
+		return NULL;
+
+	pager->bcdev = bcdev;
+	pager->bs = bs;
+	pager->per_page = bs / sizeof(struct meta_ent);
+	pager->budget = (u64)mem_mb * SZ_1M;
+
+	if (pager->budget < MAP_PAGER_MIN_PAGES * pager_page_size(pager)) {
+		BCOMP_ERRLOG("pager: map_mem is too small for the map pages");
+		goto free_pager;
+	}
+
+	/* data + ceil(data / per_page) fits the device */
+	total_blks = div_u64(under_dev->nr_sects, bs_sects);
+	pager->blk_cnt = div_u64(total_blks * pager->per_page,
+				 pager->per_page + 1);
+	pager->nr_pages = DIV_ROUND_UP_ULL(pager->blk_cnt, pager->per_page);
+	if (!pager->blk_cnt)
+		goto free_pager;
+
+	pager->pages = kvcalloc(pager->nr_pages, sizeof(*pager->pages),
+				GFP_KERNEL);
+	if (!pager->pages)
+		goto free_pager;
+
+	pager->on_disk = kvcalloc(BITS_TO_LONGS(pager->nr_pages),
+				  sizeof(unsigned long), GFP_KERNEL);
+	if (!pager->on_disk)
+		goto free_pages;
+
+	pager->wq = alloc_workqueue("%s_pager", WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+				    BCOMP_NAME);
+	if (!pager->wq)
+		goto free_on_disk;
+
+	spin_lock_init(&pager->lock);
+	INIT_LIST_HEAD(&pager->resident);
+	INIT_LIST_HEAD(&pager->faults);
+	init_waitqueue_head(&pager->wait);
+	INIT_WORK(&pager->evict_work, pager_evict_work);
+
+	pager->start = pager->blk_cnt * bs_sects;
+	under_dev->nr_sects = pager->start;
+
+	return pager;
+
+free_on_disk:
+	kvfree(pager->on_disk);
+free_pages:
+	kvfree(pager->pages);
+free_pager:
+	kfree(pager);
+	return NULL;
+}
+
+void free_map_pager(struct map_pager *pager)
+{
+	struct map_page *page, *tmp;
+
+	/* no I/O is submitted anymore: faults are done */
+	flush_workqueue(pager->wq);
+	cancel_work_sync(&pager->evict_work);
+	destroy_workqueue(pager->wq);
+
+	list_for_each_entry_safe(page, tmp, &pager->resident, node)
+		pager_free_page(pager, page);
+
+	kvfree(pager->on_disk);
+	kvfree(pager->pages);
+	kfree(pager);
+}
+
+/* ================== STATS ================== */
+
+int map_pager_stats_emit(char *buf, int at, struct map_pager *pager)
+{
+	return sysfs_emit_at(buf, at, PRITTY_MAP_PAGER_STATS_TEMPLATE,
+			     pager->budget, atomic64_read(&pager->mem),
+			     READ_ONCE(pager->nr_resident),
+			     atomic64_read(&pager->faults_cnt),
+			     atomic64_read(&pager->parked_cnt),
+			     atomic64_read(&pager->evicted_cnt),
+			     atomic64_read(&pager->written_cnt),
+			     atomic64_read(&pager->errors_cnt));
+}
+
+void reset_map_pager_stats(struct map_pager *pager)
+{
+	atomic64_set(&pager->faults_cnt, 0);
+	atomic64_set(&pager->parked_cnt, 0);
+	atomic64_set(&pager->evicted_cnt, 0);
+	atomic64_set(&pager->written_cnt, 0);
+	atomic64_set(&pager->errors_cnt, 0);
+}
@@ -0,0 +1,221 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/kstrtox.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+#include "../include/bcomp_static.h"
+#include "../include/comp_common.h"
+#include "../include/mem_store.h"
+
+/* ================== SIZE CLASSES ================== */
+
+static inline u32 class_payload(struct mem_store *ms, int cls)
+{
+	return DIV_ROUND_UP(ms->bs * (cls + 1), MEM_CLASSES);
+}
+
+static inline int size_to_class(struct mem_store *ms, u32 sz)
+{
+	return max_t(int, DIV_ROUND_UP(sz * MEM_CLASSES, ms->bs), 1) - 1;
+}
+
+static inline u32 class_obj_size(struct mem_store *ms, int cls)
+{
+	return sizeof(struct mem_obj) + class_payload(ms, cls);
+}
+
+static void mem_obj_free(struct mem_store *ms, struct mem_obj *obj)
+{
+	atomic64_sub(class_obj_size(ms, obj->cls), &ms->used_bytes);
+	atomic64_sub(obj->sz, &ms->stored_bytes);
+	atomic64_dec(&ms->objs_cnt);
+
+	kmem_cache_free(ms->classes[obj->cls], obj);
+}
+
+/* ================== DATA-PATH ================== */
+
+int mem_store_write(struct mem_store *ms, u64 key, const char *data, u32 sz)
+{
+	struct mem_obj *obj, *old;
+	int cls;
+	u32 obj_sz;
+
+	if (key >= ms->nr_blocks || sz > ms->bs)
+		return -EINVAL;
+
+	cls = size_to_class(ms, sz);
+	obj_sz = class_obj_size(ms, cls);
+	old = ms->slots[key];
+
+	/* the replaced object is released after the write, count it free */
+	if (ms->limit &&
+	    atomic64_read(&ms->used_bytes) + obj_sz -
+			    (old ? class_obj_size(ms, old->cls) : 0) >
+		    ms->limit) {
+		atomic64_inc(&ms->nospace_cnt);
+		return -ENOSPC;
+	}
+
+	obj = kmem_cache_alloc(ms->classes[cls], GFP_NOIO);
+	if (!obj)
+		return -ENOMEM;
+
+	obj->sz = sz;
+	obj->cls = cls;
+	memcpy(obj->data, data, sz);
+
+	atomic64_add(obj_sz, &ms->used_bytes);
+	atomic64_add(sz, &ms->stored_bytes);
+	atomic64_inc(&ms->objs_cnt);
+
+	ms->slots[key] = obj;
+	if (old)
+		mem_obj_free(ms, old);
+
+	return 0;
+}
+
+int mem_store_read(struct mem_store *ms, u64 key, struct buffer *buf)
+{
+	struct mem_obj *obj;
+
+	if (key >= ms->nr_blocks)
+		return -EINVAL;
+
+	obj = ms->slots[key];
+	if (!obj) {
+		/* never written: a raw block of zeroes, like zram */
+		if (ms->bs > buf->buf_sz)
+			return -EIO;
+
+		memset(buf->data, 0, ms->bs);
+		buf->data_sz = ms->bs;
+		return 0;
+	}
+
+	if (obj->sz > buf->buf_sz)
+		return -EIO;
+
+	memcpy(buf->data, obj->data, obj->sz);
+	buf->data_sz = obj->sz;
+	return 0;
+}
+
+int mem_store_read_bio(struct mem_store *ms, u64 key, struct bio *bio)
+{
+	struct mem_obj *obj;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	char *ptr;
+
+	if (key >= ms->nr_blocks)
+		return -EINVAL;
+
+	obj = ms->slots[key];
+	if (!obj) {
+		zero_fill_bio(bio);
+		return 0;
+	}
+
+	if (obj->sz != bio->bi_iter.bi_size)
+		return -EIO;
+
+	ptr = obj->data;
+	bio_for_each_segment(bv, bio, iter) {
+		memcpy_to_bvec(&bv, ptr);
+		ptr += bv.bv_len;
+	}
+
+	return 0;
+}
+
+/* ================== INIT ================== */
+
+int parse_mem_path(const char *path, sector_t *nr_sects)
+{
+	u32 size_mb;
+	int ret;
+
+	ret = kstrtou32(path + strlen(MEM_PATH_PREFIX), 10, &size_mb);
+	if (ret || !size_mb) {
+		BCOMP_ERRLOG("RAM backend path should look like mem:<MiB>");
+		return -EINVAL;
+	}
+
+	*nr_sects = (sector_t)size_mb << (20 - SECTOR_SHIFT);
+	return 0;
+}
+
+struct mem_store *alloc_mem_store(u32 bs, u64 nr_blocks, u32 limit_mb)
+{
+	struct mem_store *ms;
+	char name[32];
+
+	ms = kzalloc(sizeof(*ms), GFP_KERNEL);
+	if (!ms)
+		return NULL;
+
+	ms->bs = bs;
+	ms->nr_blocks = nr_blocks;
+	ms->limit = (u64)limit_mb << 20;
+
+	ms->slots = kvcalloc(nr_blocks, sizeof(*ms->slots), GFP_KERNEL);
+	if (!ms->slots)
+		goto free_ms;
+
+	for (int i = 0; i < MEM_CLASSES; i++) {
+		snprintf(name, sizeof(name), "%s_%u", BCOMP_NAME,
+			 class_payload(ms, i));
+		ms->classes[i] = kmem_cache_create(name, class_obj_size(ms, i),
+						   0, 0, NULL);
+		if (!ms->classes[i])
+			goto free_classes;
+	}
+
+	return ms;
+
+free_classes:
+	for (int i = 0; i < MEM_CLASSES; i++)
+		kmem_cache_destroy(ms->classes[i]);
+	kvfree(ms->slots);
+free_ms:
+	kfree(ms);
+	return NULL;
+}
+
+void free_mem_store(struct mem_store *ms)
+{
+	for (u64 key = 0; key < ms->nr_blocks; key++) {
+		if (ms->slots[key])
+			mem_obj_free(ms, ms->slots[key]);
+
+		if (!(key % 4096))
+			cond_resched();
+	}
+
+	for (int i = 0; i < MEM_CLASSES; i++)
+		kmem_cache_destroy(ms->classes[i]);
+
+	kvfree(ms->slots);
+	kfree(ms);
+}
+
+/* ================== STATS ================== */
+
+int mem_store_stats_emit(char *buf, int at, struct mem_store *ms)
+{
+	return sysfs_emit_at(buf, at, PRITTY_MEM_STORE_STATS_TEMPLATE,
+			     ms->limit, atomic64_read(&ms->used_bytes),
+			     atomic64_read(&ms->stored_bytes),
+			     atomic64_read(&ms->objs_cnt),
+			     atomic64_read(&ms->nospace_cnt));
+}
+
+void reset_mem_store_stats(struct mem_store *ms)
+{
+	atomic64_set(&ms->nospace_cnt, 0);
+}
@@ -0,0 +1,733 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/crc32.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/timekeeping.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "../include/bcomp.h"
+#include "../include/meta.h"
+
+#define META_JENT_PER_BLK(meta)                          \
+	(((meta)->bs - sizeof(struct meta_jblk_hdr)) / \
+	 sizeof(struct meta_jent))
+#define META_ENT_PER_BLK(meta) ((meta)->bs / sizeof(struct meta_ent))
+
+static inline u64 meta_ckpt_blk(struct meta_ctx *meta, u32 slot)
+{
+	return META_SB_BLKS + slot * meta->ckpt_blks;
+}
+
+static inline u64 meta_journal_blk(struct meta_ctx *meta, u64 seq)
+{
+	u64 pos;
+
+	div64_u64_rem(seq, meta->journal_blks, &pos);
+	return META_SB_BLKS + 2 * meta->ckpt_blks + pos;
+}
+
+/* ================== IO ================== */
+
+struct meta_io {
+	atomic_t pending;
+	blk_status_t status;
+	struct completion done;
+};
+
+static void meta_endio(struct bio *bio)
+{
+	struct meta_io *io = bio->bi_private;
+
+	if (bio->bi_status)
+		io->status = bio->bi_status;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&io->pending))
+		complete(&io->done);
+}
+
+/*
+DOC:
+	`n` blocks of the area from `blk` on, one bs buffer each. Every block
+	goes to the member bcomp_under_map() picks for it, so the area is
+	striped like the data.
+ */
+static int meta_rw(struct meta_ctx *meta, blk_opf_t opf, u64 blk, char **bufs,
+		   u32 n)
+{
+	struct bcomp_dev *bcdev = meta->bcdev;
+	u32 bs_sects = meta->bs >> SECTOR_SHIFT;
+	struct meta_io io = { .status = BLK_STS_OK };
+	struct buffer buf = {};
+	struct under_member *m;
+	struct bio *bio;
+	sector_t sector;
+	u32 i;
+
+	atomic_set(&io.pending, 1);
+	init_completion(&io.done);
+
+	for (i = 0; i < n; i++) {
+		m = bcomp_under_map(bcdev, meta->start + (blk + i) * bs_sects,
+				    &sector);
+		bio = bio_alloc(m->bdev, DIV_ROUND_UP(meta->bs, PAGE_SIZE) + 1,
+				opf, GFP_NOIO);
+		if (!bio) {
+			io.status = BLK_STS_RESOURCE;
+			break;
+		}
+
+		link_data(meta->bs, bufs[i], false, &buf);
+		if (add_buffer_to_bio(&buf, meta->bs, bio)) {
+			bio_put(bio);
+			io.status = BLK_STS_IOERR;
+			break;
+		}
+
+		bio->bi_iter.bi_sector = sector;
+		bio->bi_end_io = meta_endio;
+		bio->bi_private = &io;
+
+		atomic_inc(&io.pending);
+		submit_bio(bio);
+	}
+
+	if (!atomic_dec_and_test(&io.pending))
+		wait_for_completion(&io.done);
+
+	return blk_status_to_errno(io.status);
+}
+
+static void meta_free_bufs(char **bufs, u32 n)
+{
+	u32 i;
+
+	for (i = 0; i < n; i++)
+		kfree(bufs[i]);
+}
+
+static int meta_alloc_bufs(struct meta_ctx *meta, char **bufs, u32 n)
+{
+	u32 i;
+
+	for (i = 0; i < n; i++) {
+		bufs[i] = kzalloc(meta->bs, GFP_KERNEL);
+		if (!bufs[i]) {
+			meta_free_bufs(bufs, i);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/* ================== ENTRIES ================== */
+
+static void meta_fill_ent(struct meta_ctx *meta, sector_t lba,
+			  struct meta_ent *ent, struct map_cell *cell)
+{
+	memset(ent, 0, sizeof(*ent));
+	if (!bcomp_blk_written(meta->bcdev, lba))
+		return;
+
+	ent->flags = META_ENT_WRITTEN;
+	if (!is_data_compressed(cell))
+		return;
+
+	ent->psize = cpu_to_le32(cell->psize);
+	ent->cprf = cell->cprf;
+	ent->comp_prf_id = cell->comp_prf_id;
+	ent->nsub = cell->nsub;
+}
+
+static int meta_apply(struct meta_ctx *meta, u64 key, struct meta_ent *ent)
+{
+	struct bcomp_dev *bcdev = meta->bcdev;
+	sector_t lba = bcomp_key_to_lba(bcdev, key);
+	u32 psize = le32_to_cpu(ent->psize);
+	struct map_cell *cell;
+	int ret;
+
+	if (key >= meta->blk_cnt || psize >= meta->bs)
+		return -EUCLEAN;
+
+	if (ent->nsub > 1 && !bcdev->split_wq) {
+		BCOMP_ERRLOG("meta: device was written with split, map it so");
+		return -EINVAL;
+	}
+
+	if (ent->flags & META_ENT_WRITTEN)
+		bcomp_mark_written(bcdev, lba);
+
+	ret = update_mapping(&cell, lba, meta->bs, psize ? psize : meta->bs,
+			     bcdev->map);
+	if (ret || !is_data_compressed(cell))
+		return ret;
+
+	cell->cprf = ent->cprf;
+	cell->comp_prf_id = ent->comp_prf_id;
+	cell->nsub = ent->nsub;
+	cell->wtime = ktime_get_seconds();
+	return 0;
+}
+
+/* ================== SUPERBLOCK ================== */
+
+static int meta_write_sb(struct meta_ctx *meta, u64 gen, u32 slot, u64 jseq,
+			 u32 ckpt_crc)
+{
+	struct meta_sb *sb;
+	char *buf;
+	int ret;
+
+	buf = kzalloc(meta->bs, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	sb = (struct meta_sb *)buf;
+	sb->magic = cpu_to_le32(META_MAGIC);
+	sb->version = cpu_to_le32(META_VERSION);
+	sb->gen = cpu_to_le64(gen);
+	sb->bs = cpu_to_le32(meta->bs);
+	sb->ckpt_slot = cpu_to_le32(slot);
+	sb->blk_cnt = cpu_to_le64(meta->blk_cnt);
+	sb->ckpt_blks = cpu_to_le64(meta->ckpt_blks);
+	sb->journal_blks = cpu_to_le64(meta->journal_blks);
+	sb->jseq = cpu_to_le64(jseq);
+	sb->ckpt_crc = cpu_to_le32(ckpt_crc);
+	sb->crc = cpu_to_le32(crc32_le(~0, (u8 *)sb, sizeof(*sb)));
+
+	/* copies alternate, a torn write leaves the previous one */
+	ret = meta_rw(meta, REQ_OP_WRITE | REQ_PREFLUSH | REQ_FUA,
+		      gen % META_SB_BLKS, &buf, 1);
+	kfree(buf);
+	return ret;
+}
+
+static bool meta_sb_valid(struct meta_ctx *meta, struct meta_sb *sb)
+{
+	u32 crc = le32_to_cpu(sb->crc);
+
+	if (le32_to_cpu(sb->magic) != META_MAGIC)
+		return false;
+
+	sb->crc = 0;
+	if (crc32_le(~0, (u8 *)sb, sizeof(*sb)) != crc)
+		return false;
+	sb->crc = cpu_to_le32(crc);
+
+	return le32_to_cpu(sb->version) == META_VERSION ||
+	       le32_to_cpu(sb->version) == META_VERSION_NO_WRITTEN;
+}
+
+/* ================== CHECKPOINT ================== */
+
+static int meta_checkpoint(struct meta_ctx *meta)
+{
+	struct bcomp_dev *bcdev = meta->bcdev;
+	u32 per_blk = META_ENT_PER_BLK(meta);
+	char *bufs[META_IO_BLKS];
+	struct map_cell *cell;
+	struct meta_ent *ent;
+	unsigned long flags;
+	u64 key = 0, blk, jseq;
+	u32 slot, crc = ~0;
+	u32 i, j, n;
+	int ret;
+
+	ret = meta_alloc_bufs(meta, bufs, META_IO_BLKS);
+	if (ret)
+		return ret;
+
+	/* blocks before jseq are in the map already */
+	spin_lock_irqsave(&meta->lock, flags);
+	jseq = meta->head;
+	slot = !meta->ckpt_slot;
+	spin_unlock_irqrestore(&meta->lock, flags);
+
+	for (blk = 0; blk < meta->ckpt_blks; blk += n) {
+		n = min_t(u64, META_IO_BLKS, meta->ckpt_blks - blk);
+
+		for (i = 0; i < n; i++) {
+			ent = (struct meta_ent *)bufs[i];
+			memset(ent, 0, meta->bs);
+
+			for (j = 0; j < per_blk && key < meta->blk_cnt;
+			     j++, key++) {
+				sector_t lba = bcomp_key_to_lba(bcdev, key);
+
+				bcomp_lock_block(bcdev, lba);
+				if (get_mapping(&cell, lba, bcdev->map))
+					cell = NULL;
+				meta_fill_ent(meta, lba, &ent[j], cell);
+				bcomp_unlock_block(bcdev, lba);
+			}
+
+			crc = crc32_le(crc, bufs[i], meta->bs);
+		}
+
+		ret = meta_rw(meta, REQ_OP_WRITE,
+			      meta_ckpt_blk(meta, slot) + blk, bufs, n);
+		if (ret)
+			goto free_bufs;
+
+		cond_resched();
+	}
+
+	/* the checkpoint and the data it describes */
+	ret = bcomp_under_flush(bcdev);
+	if (ret)
+		goto free_bufs;
+
+	ret = meta_write_sb(meta, meta->gen + 1, slot, jseq, crc);
+	if (ret)
+		goto free_bufs;
+
+	spin_lock_irqsave(&meta->lock, flags);
+	meta->gen++;
+	meta->ckpt_slot = slot;
+	meta->tail = jseq;
+	spin_unlock_irqrestore(&meta->lock, flags);
+
+	wake_up_all(&meta->wait);
+	atomic64_inc(&meta->ckpts_cnt);
+
+free_bufs:
+	meta_free_bufs(bufs, META_IO_BLKS);
+	return ret;
+}
+
+static void meta_ckpt_work(struct work_struct *work)
+{
+	struct meta_ctx *meta = container_of(work, struct meta_ctx, ckpt_work);
+	unsigned long flags;
+
+	if (meta_checkpoint(meta)) {
+		BCOMP_ERRLOG("meta: checkpoint failed");
+		atomic64_inc(&meta->errors_cnt);
+	}
+
+	spin_lock_irqsave(&meta->lock, flags);
+	meta->ckpt_queued = false;
+	spin_unlock_irqrestore(&meta->lock, flags);
+
+	/* a commit may wait for space the failed checkpoint didn't free */
+	wake_up_all(&meta->wait);
+}
+
+/* ================== JOURNAL ================== */
+
+void meta_encode(struct meta_ctx *meta, struct bcomp_req *req)
+{
+	req->ment.key =
+		cpu_to_le64(bcomp_lba_to_key(meta->bcdev, req->entity->lba));
+	meta_fill_ent(meta, req->entity->lba, &req->ment.ent,
+		      req->entity->cell);
+}
+
+void meta_journal(struct meta_ctx *meta, struct bcomp_req *req)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&meta->lock, flags);
+	list_add_tail(&req->meta_node, &meta->pending);
+	spin_unlock_irqrestore(&meta->lock, flags);
+
+	queue_work(meta->wq, &meta->commit_work);
+}
+
+/* free journal blocks, the checkpoint is kicked at half */
+static u64 meta_journal_free(struct meta_ctx *meta, bool *ckpt)
+{
+	unsigned long flags;
+	u64 used;
+
+	spin_lock_irqsave(&meta->lock, flags);
+	used = meta->head - meta->tail;
+	*ckpt = used * 2 >= meta->journal_blks && !meta->ckpt_queued;
+	if (*ckpt)
+		meta->ckpt_queued = true;
+	spin_unlock_irqrestore(&meta->lock, flags);
+
+	return meta->journal_blks - used;
+}
+
+static bool meta_journal_has_space(struct meta_ctx *meta)
+{
+	bool ckpt;
+	u64 free = meta_journal_free(meta, &ckpt);
+
+	if (ckpt)
+		queue_work(meta->wq, &meta->ckpt_work);
+
+	return free > 0;
+}
+
+static int meta_write_jblk(struct meta_ctx *meta, u32 nr)
+{
+	struct meta_jblk_hdr *hdr = (struct meta_jblk_hdr *)meta->jbuf;
+	unsigned long flags;
+	int ret;
+
+	wait_event(meta->wait, meta_journal_has_space(meta));
+
+	hdr->magic = cpu_to_le32(META_JOURNAL_MAGIC);
+	hdr->seq = cpu_to_le64(meta->head);
+	hdr->nr = cpu_to_le32(nr);
+	hdr->crc = 0;
+	hdr->crc = cpu_to_le32(crc32_le(~0, meta->jbuf, meta->bs));
+
+	ret = meta_rw(meta, REQ_OP_WRITE | REQ_FUA,
+		      meta_journal_blk(meta, meta->head), &meta->jbuf, 1);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&meta->lock, flags);
+	meta->head++;
+	spin_unlock_irqrestore(&meta->lock, flags);
+
+	return 0;
+}
+
+/*
+DOC:
+	One flush of the members makes the data of the whole batch durable,
+	then the entries go to the journal and the bios are completed.
+ */
+static int meta_commit(struct meta_ctx *meta, struct list_head *batch)
+{
+	struct meta_jent *jent = (struct meta_jent *)(meta->jbuf +
+				 sizeof(struct meta_jblk_hdr));
+	u32 per_blk = META_JENT_PER_BLK(meta);
+	struct bcomp_req *req;
+	u32 nr = 0;
+	int ret;
+
+	ret = bcomp_under_flush(meta->bcdev);
+	if (ret)
+		return ret;
+
+	memset(meta->jbuf, 0, meta->bs);
+	list_for_each_entry(req, batch, meta_node) {
+		jent[nr++] = req->ment;
+		if (nr < per_blk)
+			continue;
+
+		ret = meta_write_jblk(meta, nr);
+		if (ret)
+			return ret;
+
+		memset(meta->jbuf, 0, meta->bs);
+		nr = 0;
+	}
+
+	if (nr)
+		ret = meta_write_jblk(meta, nr);
+
+	return ret;
+}
+
+static void meta_commit_work(struct work_struct *work)
+{
+	struct meta_ctx *meta =
+		container_of(work, struct meta_ctx, commit_work);
+	struct bcomp_req *req, *tmp;
+	unsigned long flags;
+	blk_status_t status;
+	LIST_HEAD(batch);
+	u64 entries = 0;
+
+	/* everything queued meanwhile goes in one batch */
+	spin_lock_irqsave(&meta->lock, flags);
+	list_splice_init(&meta->pending, &batch);
+	spin_unlock_irqrestore(&meta->lock, flags);
+
+	if (list_empty(&batch))
+		return;
+
+	status = errno_to_blk_status(meta_commit(meta, &batch));
+	if (status != BLK_STS_OK)
+		atomic64_inc(&meta->errors_cnt);
+
+	list_for_each_entry_safe(req, tmp, &batch, meta_node) {
+		list_del(&req->meta_node);
+		bcomp_complete_req(req, status);
+		entries++;
+	}
+
+	atomic64_inc(&meta->commits_cnt);
+	atomic64_add(entries, &meta->entries_cnt);
+}
+
+/* ================== LOAD ================== */
+
+static int meta_load_ckpt(struct meta_ctx *meta, u32 slot, u32 ckpt_crc)
+{
+	u32 per_blk = META_ENT_PER_BLK(meta);
+	char *bufs[META_IO_BLKS];
+	struct meta_ent *ent;
+	u64 key = 0, blk;
+	u32 crc = ~0;
+	u32 i, j, n;
+	int ret;
+
+	ret = meta_alloc_bufs(meta, bufs, META_IO_BLKS);
+	if (ret)
+		return ret;
+
+	for (blk = 0; blk < meta->ckpt_blks; blk += n) {
+		n = min_t(u64, META_IO_BLKS, meta->ckpt_blks - blk);
+
+		ret = meta_rw(meta, REQ_OP_READ,
+			      meta_ckpt_blk(meta, slot) + blk, bufs, n);
+		if (ret)
+			goto free_bufs;
+
+		for (i = 0; i < n; i++) {
+			crc = crc32_le(crc, bufs[i], meta->bs);
+
+			ent = (struct meta_ent *)bufs[i];
+			for (j = 0; j < per_blk && key < meta->blk_cnt;
+			     j++, key++) {
+				if (!ent[j].psize && !ent[j].flags)
+					continue;
+
+				ret = meta_apply(meta, key, &ent[j]);
+				if (ret)
+					goto free_bufs;
+			}
+		}
+
+		cond_resched();
+	}
+
+	if (crc != ckpt_crc) {
+		BCOMP_ERRLOG("meta: checkpoint is corrupted");
+		ret = -EUCLEAN;
+	}
+
+free_bufs:
+	meta_free_bufs(bufs, META_IO_BLKS);
+	return ret;
+}
+
+/* returns the seq of the first block that isn't there */
+static int meta_replay(struct meta_ctx *meta, u64 jseq, u64 *head)
+{
+	struct meta_jblk_hdr *hdr = (struct meta_jblk_hdr *)meta->jbuf;
+	struct meta_jent *jent = (struct meta_jent *)(meta->jbuf +
+				 sizeof(struct meta_jblk_hdr));
+	u64 seq;
+	u32 crc, nr, i;
+	int ret;
+
+	for (seq = jseq; seq - jseq < meta->journal_blks; seq++) {
+		ret = meta_rw(meta, REQ_OP_READ, meta_journal_blk(meta, seq),
+			      &meta->jbuf, 1);
+		if (ret)
+			return ret;
+
+		/* a stale or torn block ends the journal */
+		crc = le32_to_cpu(hdr->crc);
+		hdr->crc = 0;
+		nr = le32_to_cpu(hdr->nr);
+		if (le32_to_cpu(hdr->magic) != META_JOURNAL_MAGIC ||
+		    le64_to_cpu(hdr->seq) != seq ||
+		    nr > META_JENT_PER_BLK(meta) ||
+		    crc32_le(~0, meta->jbuf, meta->bs) != crc)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			ret = meta_apply(meta, le64_to_cpu(jent[i].key),
+					 &jent[i].ent);
+			if (ret)
+				return ret;
+		}
+
+		atomic64_add(nr, &meta->replayed_cnt);
+		cond_resched();
+	}
+
+	*head = seq;
+	return 0;
+}
+
+int meta_load(struct meta_ctx *meta)
+{
+	struct meta_sb *sb, *best = NULL;
+	char *bufs[META_SB_BLKS];
+	u64 head;
+	u32 i;
+	int ret;
+
+	ret = meta_alloc_bufs(meta, bufs, META_SB_BLKS);
+	if (ret)
+		return ret;
+
+	ret = meta_rw(meta, REQ_OP_READ, 0, bufs, META_SB_BLKS);
+	if (ret)
+		goto free_bufs;
+
+	for (i = 0; i < META_SB_BLKS; i++) {
+		sb = (struct meta_sb *)bufs[i];
+		if (meta_sb_valid(meta, sb) &&
+		    (!best || le64_to_cpu(sb->gen) > le64_to_cpu(best->gen)))
+			best = sb;
+	}
+
+	/* a new device: an empty checkpoint describes it */
+	if (!best) {
+		BCOMP_LOG("meta: no superblock, formatting");
+		ret = meta_checkpoint(meta);
+		goto free_bufs;
+	}
+
+	if (le32_to_cpu(best->bs) != meta->bs ||
+	    le64_to_cpu(best->blk_cnt) != meta->blk_cnt ||
+	    le64_to_cpu(best->ckpt_blks) != meta->ckpt_blks ||
+	    le64_to_cpu(best->journal_blks) != meta->journal_blks ||
+	    le32_to_cpu(best->ckpt_slot) > 1) {
+		BCOMP_ERRLOG("meta: device was formatted with other bs/meta");
+		ret = -EINVAL;
+		goto free_bufs;
+	}
+
+	meta->gen = le64_to_cpu(best->gen);
+	meta->ckpt_slot = le32_to_cpu(best->ckpt_slot);
+
+	/* no record of what was written, the next checkpoint makes one */
+	if (le32_to_cpu(best->version) == META_VERSION_NO_WRITTEN)
+		bitmap_fill(meta->bcdev->written, meta->blk_cnt);
+
+	ret = meta_load_ckpt(meta, meta->ckpt_slot,
+			     le32_to_cpu(best->ckpt_crc));
+	if (ret)
+		goto free_bufs;
+
+	ret = meta_replay(meta, le64_to_cpu(best->jseq), &head);
+	if (ret)
+		goto free_bufs;
+
+	meta->tail = le64_to_cpu(best->jseq);
+	meta->head = head;
+
+free_bufs:
+	meta_free_bufs(bufs, META_SB_BLKS);
+	return ret;
+}
+
+/* ================== INIT ================== */
+
+static int meta_layout(struct meta_ctx *meta, u64 total_blks, u32 journal_mb)
+{
+	u32 per_blk = META_ENT_PER_BLK(meta);
+	u64 reserved;
+
+	meta->journal_blks = max_t(u64, META_MIN_JOURNAL_BLKS,
+				   div_u64((u64)journal_mb * SZ_1M, meta->bs));
+
+	reserved = META_SB_BLKS + meta->journal_blks;
+	if (total_blks <= reserved)
+		return -ENOSPC;
+
+	/* data + 2 * ceil(data / per_blk) fits the rest */
+	meta->blk_cnt = div_u64((total_blks - reserved) * per_blk,
+				per_blk + 2);
+	do {
+		meta->ckpt_blks = DIV_ROUND_UP_ULL(meta->blk_cnt, per_blk);
+		if (meta->blk_cnt + 2 * meta->ckpt_blks + reserved <=
+		    total_blks)
+			break;
+	} while (--meta->blk_cnt);
+
+	return meta->blk_cnt ? 0 : -ENOSPC;
+}
+
+struct meta_ctx *alloc_meta(struct bcomp_dev *bcdev, enum w_block_size bs,
+			    u32 journal_mb)
+{
+	struct underlying_dev *under_dev = bcdev->under_dev;
+	u32 bs_sects = bs >> SECTOR_SHIFT;
+	struct meta_ctx *meta;
+
+	meta = kzalloc(sizeof(*meta), GFP_KERNEL);
+	if (!meta)
+		return NULL;
+
+	meta->bcdev = bcdev;
+	meta->bs = bs;
+	if (meta_layout(meta, div_u64(under_dev->nr_sects, bs_sects),
+			journal_mb)) {
+		BCOMP_ERRLOG("meta: device is too small for the journal");
+		goto free_meta;
+	}
+
+	meta->jbuf = kzalloc(bs, GFP_KERNEL);
+	if (!meta->jbuf)
+		goto free_meta;
+
+	meta->wq = alloc_workqueue("%s_meta", WQ_UNBOUND | WQ_MEM_RECLAIM, 2,
+				   BCOMP_NAME);
+	if (!meta->wq)
+		goto free_jbuf;
+
+	spin_lock_init(&meta->lock);
+	INIT_LIST_HEAD(&meta->pending);
+	init_waitqueue_head(&meta->wait);
+	INIT_WORK(&meta->commit_work, meta_commit_work);
+	INIT_WORK(&meta->ckpt_work, meta_ckpt_work);
+
+	meta->start = meta->blk_cnt * bs_sects;
+	under_dev->nr_sects = meta->start;
+
+	return meta;
+
+free_jbuf:
+	kfree(meta->jbuf);
+free_meta:
+	kfree(meta);
+	return NULL;
+}
+
+void free_meta(struct meta_ctx *meta)
+{
+	flush_work(&meta->commit_work);
+	flush_work(&meta->ckpt_work);
+
+	/* remount replays nothing */
+	if (meta_checkpoint(meta))
+		BCOMP_ERRLOG("meta: last checkpoint failed, journal is kept");
+
+	destroy_workqueue(meta->wq);
+	kfree(meta->jbuf);
+	kfree(meta);
+}
+
+/* ================== STATS ================== */
+
+int meta_stats_emit(char *buf, int at, struct meta_ctx *meta)
+{
+	return sysfs_emit_at(buf, at, PRITTY_META_STATS_TEMPLATE,
+			     meta->journal_blks,
+			     READ_ONCE(meta->head) - READ_ONCE(meta->tail),
+			     atomic64_read(&meta->commits_cnt),
+			     atomic64_read(&meta->entries_cnt),
+			     atomic64_read(&meta->ckpts_cnt),
+			     atomic64_read(&meta->replayed_cnt),
+			     atomic64_read(&meta->errors_cnt));
+}
+
+void reset_meta_stats(struct meta_ctx *meta)
+{
+	atomic64_set(&meta->commits_cnt, 0);
+	atomic64_set(&meta->entries_cnt, 0);
+	atomic64_set(&meta->ckpts_cnt, 0);
+	atomic64_set(&meta->replayed_cnt, 0);
+	atomic64_set(&meta->errors_cnt, 0);
+}
@@ -0,0 +1,380 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/ioprio.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+#include "../include/bcomp_static.h"
+#include "../include/policy.h"
+#include "../include/settings.h"
+
+static const char *POLICY_CLASS_NAMES[POLICY_CLASS_N] = {
+	"meta", "fua", "sync", "rt", "be", "idle"
+};
+
+#define POLICY_RAW_STR "raw"
+#define POLICY_DEFAULT_STR "default"
+
+/* ================== PARSING ================== */
+
+static int parse_class(const char *arg, int len)
+{
+	for (int i = 0; i < POLICY_CLASS_N; i++) {
+		if (strlen(POLICY_CLASS_NAMES[i]) == len &&
+		    !strncmp(POLICY_CLASS_NAMES[i], arg, len))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+static int parse_action(const char *arg, int len, int *action)
+{
+	char buffer[MAX_PRF_ID_STR_LEN + 1];
+	int id;
+
+	if (strlen(POLICY_RAW_STR) == len && !strncmp(POLICY_RAW_STR, arg, len)) {
+		*action = POLICY_RAW;
+		return 0;
+	}
+
+	if (strlen(POLICY_DEFAULT_STR) == len &&
+	    !strncmp(POLICY_DEFAULT_STR, arg, len)) {
+		*action = POLICY_DEFAULT;
+		return 0;
+	}
+
+	if (len == 0 || len > MAX_PRF_ID_STR_LEN)
+		return -EINVAL;
+
+	memcpy(buffer, arg, len);
+	buffer[len] = '\0';
+
+	if (kstrtoint(buffer, 10, &id) || id < 0 || id > COMP_PRF_ID_MAX)
+		return -EINVAL;
+
+	*action = id;
+	return 0;
+}
+
+static int parse_rule(const char *arg, int len, struct comp_policy *pol)
+{
+	const char *action_arg;
+	int class;
+
+	action_arg = strnchr(arg, len, OPTION_RANGE_DELIMITER);
+	if (!action_arg)
+		return -EINVAL;
+
+	class = parse_class(arg, action_arg - arg);
+	if (class < 0)
+		return class;
+
+	action_arg++;
+	return parse_action(action_arg, len - (action_arg - arg),
+			    &pol->action[class]);
+}
+
+struct comp_policy *parse_comp_policy(const char *arg, int len)
+{
+	struct comp_policy *pol;
+	const char *end = arg + len;
+	const char *rule_end;
+
+	pol = kzalloc(sizeof(*pol), GFP_KERNEL);
+	if (!pol)
+		return NULL;
+
+	for (int i = 0; i < POLICY_CLASS_N; i++)
+		pol->action[i] = POLICY_DEFAULT;
+
+	while (arg < end) {
+		rule_end = strnchr(arg, end - arg, POLICY_DELIMITER);
+		if (!rule_end)
+			rule_end = end;
+
+		if (parse_rule(arg, rule_end - arg, pol)) {
+			BCOMP_ERRLOG(
+				"policy rule should look like <meta|fua|sync|rt|be|idle>:<id|raw|default>");
+			kfree(pol);
+			return NULL;
+		}
+
+		arg = rule_end + 1;
+	}
+
+	return pol;
+}
+
+static int validate_action(int action, struct comp_ctx *cctx)
+{
+	if (action < 0)
+		return 0;
+
+	if (comp_strength(action, cctx) == -EINVAL) {
+		BCOMP_ERRLOG("policy: invalid comp_prf_id for profile");
+		return -EINVAL;
+	}
+
+	if (action > cctx->max_comp_prf_id) {
+		BCOMP_ERRLOG("policy: comp_prf_id exceeds workspace");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int emit_action(char *buf, int at, int action)
+{
+	if (action == POLICY_RAW)
+		return sysfs_emit_at(buf, at, POLICY_RAW_STR);
+
+	if (action == POLICY_DEFAULT)
+		return sysfs_emit_at(buf, at, POLICY_DEFAULT_STR);
+
+	return sysfs_emit_at(buf, at, "%d", action);
+}
+
+int validate_comp_policy(struct comp_policy *pol, struct comp_ctx *cctx)
+{
+	int ret;
+
+	for (int i = 0; i < POLICY_CLASS_N; i++) {
+		ret = validate_action(pol->action[i], cctx);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int comp_policy_max_id(struct comp_policy *pol)
+{
+	int max_id = 0;
+
+	for (int i = 0; i < POLICY_CLASS_N; i++)
+		max_id = max_t(int, max_id, pol->action[i]);
+
+	return max_id;
+}
+
+/* ================== DATA-PATH ================== */
+
+static enum policy_class prio_to_class(struct bio *bio)
+{
+	switch (IOPRIO_PRIO_CLASS(bio_prio(bio))) {
+	case IOPRIO_CLASS_RT:
+		return POLICY_RT;
+	case IOPRIO_CLASS_IDLE:
+		return POLICY_IDLE;
+	default:
+		return POLICY_BE;
+	}
+}
+
+int comp_policy_action(struct comp_policy *pol, struct bio *bio)
+{
+	int action;
+
+	if ((bio->bi_opf & REQ_META) &&
+	    (action = pol->action[POLICY_META]) != POLICY_DEFAULT)
+		return action;
+
+	if ((bio->bi_opf & REQ_FUA) &&
+	    (action = pol->action[POLICY_FUA]) != POLICY_DEFAULT)
+		return action;
+
+	if ((bio->bi_opf & REQ_SYNC) &&
+	    (action = pol->action[POLICY_SYNC]) != POLICY_DEFAULT)
+		return action;
+
+	return pol->action[prio_to_class(bio)];
+}
+
+int comp_policy_emit(char *buf, int at, struct comp_policy *pol)
+{
+	int len = 0;
+
+	for (int i = 0; i < POLICY_CLASS_N; i++) {
+		if (pol->action[i] == POLICY_DEFAULT)
+			continue;
+
+		len += sysfs_emit_at(buf, at + len, "%s%s:",
+				     len ? "," : "", POLICY_CLASS_NAMES[i]);
+		len += emit_action(buf, at + len, pol->action[i]);
+	}
+
+	len += sysfs_emit_at(buf, at + len, "%s\n",
+			     len ? "" : POLICY_DEFAULT_STR);
+	return len;
+}
+
+/* ================== LBA RANGES ================== */
+
+static int parse_sector(const char *arg, int len, sector_t *sector)
+{
+	char buffer[MAX_NUM_STR_LEN + 1];
+	u64 val;
+
+	if (len == 0 || len > MAX_NUM_STR_LEN)
+		return -EINVAL;
+
+	memcpy(buffer, arg, len);
+	buffer[len] = '\0';
+
+	if (kstrtou64(buffer, 10, &val))
+		return -EINVAL;
+
+	*sector = val;
+	return 0;
+}
+
+static int parse_range(const char *arg, int len, struct comp_range *range)
+{
+	const char *last_arg, *action_arg;
+	int ret;
+
+	action_arg = strnchr(arg, len, OPTION_RANGE_DELIMITER);
+	if (!action_arg)
+		return -EINVAL;
+
+	last_arg = strnchr(arg, action_arg - arg, RANGE_DELIMITER);
+	if (!last_arg)
+		return -EINVAL;
+
+	ret = parse_sector(arg, last_arg - arg, &range->first);
+	if (ret)
+		return ret;
+
+	last_arg++;
+	ret = parse_sector(last_arg, action_arg - last_arg, &range->last);
+	if (ret)
+		return ret;
+
+	if (range->first > range->last)
+		return -EINVAL;
+
+	action_arg++;
+	return parse_action(action_arg, len - (action_arg - arg),
+			    &range->action);
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+	const struct comp_range *l = a, *r = b;
+
+	if (l->first == r->first)
+		return 0;
+
+	return l->first < r->first ? -1 : 1;
+}
+
+struct comp_range_table *parse_comp_ranges(const char *arg, int len)
+{
+	struct comp_range_table *tbl;
+	const char *end = arg + len;
+	const char *range_end;
+	int n = 1;
+
+	for (int i = 0; i < len; i++)
+		n += arg[i] == POLICY_DELIMITER;
+
+	if (n > RANGES_MAX) {
+		BCOMP_ERRLOG("too many ranges");
+		return NULL;
+	}
+
+	tbl = kvzalloc(struct_size(tbl, ranges, n), GFP_KERNEL);
+	if (!tbl)
+		return NULL;
+
+	while (arg < end) {
+		range_end = strnchr(arg, end - arg, POLICY_DELIMITER);
+		if (!range_end)
+			range_end = end;
+
+		if (parse_range(arg, range_end - arg, &tbl->ranges[tbl->len])) {
+			BCOMP_ERRLOG(
+				"range should look like <first-sector>-<last-sector>:<id|raw|default>");
+			goto free_tbl;
+		}
+
+		tbl->len++;
+		arg = range_end + 1;
+	}
+
+	sort(tbl->ranges, tbl->len, sizeof(*tbl->ranges), cmp_range, NULL);
+
+	for (int i = 1; i < tbl->len; i++) {
+		if (tbl->ranges[i].first <= tbl->ranges[i - 1].last) {
+			BCOMP_ERRLOG("ranges must not overlap");
+			goto free_tbl;
+		}
+	}
+
+	return tbl;
+
+free_tbl:
+	kvfree(tbl);
+	return NULL;
+}
+
+int validate_comp_ranges(struct comp_range_table *tbl, struct comp_ctx *cctx)
+{
+	int ret;
+
+	for (int i = 0; i < tbl->len; i++) {
+		ret = validate_action(tbl->ranges[i].action, cctx);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int comp_ranges_max_id(struct comp_range_table *tbl)
+{
+	int max_id = 0;
+
+	for (int i = 0; i < tbl->len; i++)
+		max_id = max_t(int, max_id, tbl->ranges[i].action);
+
+	return max_id;
+}
+
+int comp_ranges_action(struct comp_range_table *tbl, sector_t lba)
+{
+	int lo = 0, hi = tbl->len - 1, mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (lba < tbl->ranges[mid].first)
+			hi = mid - 1;
+		else if (lba > tbl->ranges[mid].last)
+			lo = mid + 1;
+		else
+			return tbl->ranges[mid].action;
+	}
+
+	return POLICY_DEFAULT;
+}
+
+int comp_ranges_emit(char *buf, int at, struct comp_range_table *tbl)
+{
+	int len = 0;
+
+	for (int i = 0; i < tbl->len; i++) {
+		len += sysfs_emit_at(buf, at + len, "%s%llu-%llu:",
+				     i ? "," : "",
+				     (u64)tbl->ranges[i].first,
+				     (u64)tbl->ranges[i].last);
+		len += emit_action(buf, at + len, tbl->ranges[i].action);
+	}
+
+	len += sysfs_emit_at(buf, at + len, "\n");
+	return len;
+}
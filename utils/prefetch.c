@@ -0,0 +1,307 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/wait_bit.h>
+#include <linux/workqueue.h>
+
+#include "../include/bcomp.h"
+#include "../include/blk_cache.h"
+#include "../include/map_common.h"
+#include "../include/prefetch.h"
+
+static inline sector_t bs_in_sectors(struct prefetch_ctx *pc)
+{
+	return DIV_ROUND_UP(pc->bcdev->bs, SECTOR_SIZE);
+}
+
+/* ================== DETECTION ================== */
+
+static struct prefetch_stream *find_stream(struct prefetch_ctx *pc,
+					   sector_t lba)
+{
+	struct prefetch_stream *lru = &pc->streams[0];
+
+	for (int i = 0; i < PREFETCH_STREAMS; i++) {
+		if (pc->streams[i].run && pc->streams[i].next == lba)
+			return &pc->streams[i];
+
+		if (time_before(pc->streams[i].last, lru->last))
+			lru = &pc->streams[i];
+	}
+
+	/* a new stream takes the least recently used slot */
+	lru->run = 0;
+	lru->pend_from = 0;
+	lru->issued_to = 0;
+	return lru;
+}
+
+void prefetch_read(struct prefetch_ctx *pc, sector_t lba)
+{
+	sector_t bss = bs_in_sectors(pc);
+	struct prefetch_stream *s;
+	sector_t target;
+	bool queue = false;
+
+	spin_lock(&pc->lock);
+	s = find_stream(pc, lba);
+	s->next = lba + bss;
+	s->last = jiffies;
+	s->run++;
+
+	if (s->run < PREFETCH_MIN_RUN)
+		goto unlock;
+
+	/* blocks the reader already passed are not worth it anymore */
+	target = lba + bss * (1 + pc->depth);
+	s->issued_to = max_t(sector_t, s->issued_to, lba + bss);
+	s->pend_from = clamp_t(sector_t, s->pend_from, lba + bss,
+			       s->issued_to);
+	if (target <= s->issued_to)
+		goto unlock;
+
+	s->issued_to = target;
+	queue = true;
+
+unlock:
+	spin_unlock(&pc->lock);
+
+	if (queue) {
+		atomic64_inc(&pc->triggered_cnt);
+		queue_work(pc->bcdev->wq, &pc->work);
+	}
+}
+
+/* ================== WORKER ================== */
+
+struct prefetch_io {
+	struct prefetch_ctx *pc;
+	sector_t lba;
+	struct map_cell cell; // the block is locked, a copy stays valid
+	struct chunk *stored;
+	blk_status_t status;
+	struct work_struct work;
+};
+
+static void prefetch_io_done(struct prefetch_ctx *pc)
+{
+	if (atomic_dec_and_test(&pc->inflight))
+		wake_up_var(&pc->inflight);
+}
+
+/* decompression may wait for sub-streams, so not in endio */
+static void prefetch_io_work(struct work_struct *work)
+{
+	struct prefetch_io *pio = container_of(work, struct prefetch_io,
+					       work);
+	struct prefetch_ctx *pc = pio->pc;
+	struct bcomp_dev *bcdev = pc->bcdev;
+	struct chunk *stored = pio->stored;
+
+	if (pio->status == BLK_STS_OK) {
+		stored->src.data_sz = pio->cell.psize;
+		if (!bcomp_decomp_cell(bcdev, stored, &pio->cell))
+			blk_cache_insert(bcdev->cache, pio->lba,
+					 stored->dst.data, stored->dst.data_sz,
+					 true);
+	}
+
+	bcomp_unlock_block(bcdev, pio->lba);
+	free_chunk(stored);
+	kfree(pio);
+	prefetch_io_done(pc);
+}
+
+static void prefetch_endio(struct bio *bio)
+{
+	struct prefetch_io *pio = bio->bi_private;
+
+	pio->status = bio->bi_status;
+	bio_put(bio);
+
+	INIT_WORK(&pio->work, prefetch_io_work);
+	queue_work(pio->pc->bcdev->wq, &pio->work);
+}
+
+/* RAM backend: there is no I/O to overlap */
+static bool prefetch_block_sync(struct prefetch_ctx *pc, sector_t lba,
+				struct map_cell *cell)
+{
+	struct chunk *stored;
+
+	if (bcomp_read_cell_sync(pc->bcdev, cell, &stored))
+		return false;
+
+	blk_cache_insert(pc->bcdev->cache, lba, stored->dst.data,
+			 stored->dst.data_sz, true);
+	free_chunk(stored);
+	return true;
+}
+
+static bool prefetch_block(struct prefetch_ctx *pc, sector_t lba)
+{
+	struct bcomp_dev *bcdev = pc->bcdev;
+	struct prefetch_io *pio;
+	struct map_cell *cell;
+	struct bio *bio;
+	bool issued = false;
+
+	if (!bcomp_trylock_block(bcdev, lba))
+		return false;
+
+	if (blk_cache_contains(bcdev->cache, lba))
+		goto unlock;
+
+	if (get_mapping(&cell, lba, bcdev->map) || !is_data_compressed(cell))
+		goto unlock;
+
+	if (bcdev->under_dev->mem) {
+		issued = prefetch_block_sync(pc, lba, cell);
+		goto unlock;
+	}
+
+	pio = kzalloc(sizeof(*pio), GFP_NOIO);
+	if (!pio)
+		goto unlock;
+
+	if (alloc_chunk(&pio->stored, cell->lsize, bcdev->bs, NULL, NULL))
+		goto free_pio;
+
+	if (bcomp_alloc_block_bio(bcdev, REQ_OP_READ, cell->pba,
+				  &pio->stored->src, &bio))
+		goto free_stored;
+
+	pio->pc = pc;
+	pio->lba = lba;
+	pio->cell = *cell;
+
+	bio->bi_opf |= REQ_RAHEAD;
+	bio->bi_end_io = prefetch_endio;
+	bio->bi_private = pio;
+
+	/* unlocked by prefetch_io_work() */
+	atomic_inc(&pc->inflight);
+	submit_bio(bio);
+	return true;
+
+free_stored:
+	free_chunk(pio->stored);
+free_pio:
+	kfree(pio);
+unlock:
+	bcomp_unlock_block(bcdev, lba);
+	return issued;
+}
+
+static void prefetch_adapt(struct prefetch_ctx *pc, u32 issued)
+{
+	u64 hits = atomic64_read(&pc->bcdev->cache->prefetch_hits_cnt);
+	u64 win_hits;
+
+	pc->win_issued += issued;
+	if (pc->win_issued < PREFETCH_WINDOW)
+		return;
+
+	/* stats reset can move the counter back */
+	win_hits = hits > pc->win_hits_base ? hits - pc->win_hits_base : 0;
+
+	spin_lock(&pc->lock);
+	if (win_hits * 100 >= pc->win_issued * PREFETCH_GROW_PCT)
+		pc->depth = min_t(u32, pc->depth * 2, pc->max_depth);
+	else if (win_hits * 100 < pc->win_issued * PREFETCH_SHRINK_PCT)
+		pc->depth = max_t(u32, pc->depth / 2, 1);
+	spin_unlock(&pc->lock);
+
+	pc->win_issued = 0;
+	pc->win_hits_base = hits;
+}
+
+/* takes the pending ranges of all streams, submits and doesn't wait */
+static void prefetch_work_fn(struct work_struct *work)
+{
+	struct prefetch_ctx *pc = container_of(work, struct prefetch_ctx,
+					       work);
+	sector_t bss = bs_in_sectors(pc);
+	sector_t end = pc->bcdev->blk_cnt * bss;
+	struct prefetch_stream *s;
+	struct blk_plug plug;
+	sector_t from, to;
+	u32 issued = 0;
+
+	blk_start_plug(&plug);
+	for (int i = 0; i < PREFETCH_STREAMS; i++) {
+		s = &pc->streams[i];
+
+		spin_lock(&pc->lock);
+		from = s->pend_from;
+		to = min_t(sector_t, s->issued_to, end);
+		s->pend_from = s->issued_to;
+		spin_unlock(&pc->lock);
+
+		for (sector_t lba = from; lba < to; lba += bss) {
+			if (prefetch_block(pc, lba))
+				issued++;
+			else
+				atomic64_inc(&pc->skipped_cnt);
+		}
+	}
+	blk_finish_plug(&plug);
+
+	atomic64_add(issued, &pc->issued_cnt);
+	prefetch_adapt(pc, issued);
+}
+
+/* ================== INIT ================== */
+
+struct prefetch_ctx *alloc_prefetch(struct bcomp_dev *bcdev, u32 max_depth)
+{
+	struct prefetch_ctx *pc;
+
+	if (!bcdev->cache) {
+		BCOMP_ERRLOG("prefetch: needs cache=<MiB>");
+		return NULL;
+	}
+
+	pc = kzalloc(sizeof(*pc), GFP_KERNEL);
+	if (!pc)
+		return NULL;
+
+	pc->bcdev = bcdev;
+	pc->max_depth = max_depth;
+	pc->depth = min_t(u32, 2, max_depth);
+	spin_lock_init(&pc->lock);
+	INIT_WORK(&pc->work, prefetch_work_fn);
+	atomic_set(&pc->inflight, 0);
+
+	return pc;
+}
+
+/* no reads come anymore, the completions run on bcdev->wq */
+void free_prefetch(struct prefetch_ctx *pc)
+{
+	cancel_work_sync(&pc->work);
+	wait_var_event(&pc->inflight, !atomic_read(&pc->inflight));
+	kfree(pc);
+}
+
+/* ================== STATS ================== */
+
+int prefetch_stats_emit(char *buf, int at, struct prefetch_ctx *pc)
+{
+	return sysfs_emit_at(buf, at, PRITTY_PREFETCH_STATS_TEMPLATE,
+			     READ_ONCE(pc->depth),
+			     atomic64_read(&pc->triggered_cnt),
+			     atomic64_read(&pc->issued_cnt),
+			     atomic64_read(&pc->skipped_cnt));
+}
+
+void reset_prefetch_stats(struct prefetch_ctx *pc)
+{
+	atomic64_set(&pc->triggered_cnt, 0);
+	atomic64_set(&pc->issued_cnt, 0);
+	atomic64_set(&pc->skipped_cnt, 0);
+}
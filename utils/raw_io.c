@@ -0,0 +1,229 @@
+#include <linux/types.h>
+#include <linux/blkdev.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+
+#include "../include/bcomp.h"
+#include "../include/raw_io.h"
+
+static int raw_check_lba(struct bcomp_dev *bcdev, u64 lba)
+{
+	u32 bs_sects = bcdev->bs >> SECTOR_SHIFT;
+
+	if (lba % bs_sects || bcomp_lba_to_key(bcdev, lba) >= bcdev->blk_cnt)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* -------- export -------- */
+
+static int raw_export_blk(struct bcomp_dev *bcdev, struct bcomp_raw_blk *blk,
+			  struct buffer *buf)
+{
+	struct map_cell *cell;
+	int ret;
+
+	ret = raw_check_lba(bcdev, blk->lba);
+	if (ret)
+		return ret;
+
+	bcomp_lock_block(bcdev, blk->lba);
+
+	ret = bcomp_blk_unwritten(bcdev, blk->lba) ?
+		      -ENODATA :
+		      get_mapping(&cell, blk->lba, bcdev->map);
+	if (ret == -ENODATA) {
+		/* never written: a raw block of zeroes */
+		memset(buf->data, 0, bcdev->bs);
+		cell = NULL;
+		ret = 0;
+	} else if (!ret) {
+		ret = bcomp_rw_block_sync(bcdev, REQ_OP_READ,
+					  map_cell_pba(cell, blk->lba), buf);
+	}
+
+	bcomp_unlock_block(bcdev, blk->lba);
+	if (ret)
+		return ret;
+
+	memset(blk->pad, 0, sizeof(blk->pad));
+	blk->lsize = bcdev->bs;
+	blk->psize = bcdev->bs;
+	blk->cprf = 0;
+	blk->comp_prf_id = 0;
+	blk->nsub = 0;
+
+	if (is_data_compressed(cell)) {
+		blk->psize = cell->psize;
+		blk->cprf = cell->cprf;
+		blk->comp_prf_id = cell->comp_prf_id;
+		blk->nsub = cell->nsub;
+	}
+
+	/* the trailer of hdr= (if any) stays behind psize */
+	if (copy_to_user(u64_to_user_ptr(blk->data), buf->data, blk->psize))
+		return -EFAULT;
+
+	return 0;
+}
+
+int bcomp_raw_export(struct bcomp_dev *bcdev, struct bcomp_raw_io *io)
+{
+	struct bcomp_raw_blk __user *ublks = u64_to_user_ptr(io->blks);
+	struct bcomp_raw_blk blk;
+	struct buffer buf = {};
+	char *data;
+	int ret = 0;
+
+	if (io->nr > BCOMP_RAW_MAX_NR)
+		return -EINVAL;
+
+	/* dirty blocks of the cache are newer than the stored form */
+	if (bcdev->wb) {
+		ret = wb_flush(bcdev->wb);
+		if (ret)
+			return ret;
+	}
+
+	data = kmalloc(bcdev->bs, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	for (io->done = 0; io->done < io->nr; io->done++) {
+		if (copy_from_user(&blk, &ublks[io->done], sizeof(blk))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		link_data(bcdev->bs, data, false, &buf);
+		ret = raw_export_blk(bcdev, &blk, &buf);
+		if (ret)
+			break;
+
+		if (copy_to_user(&ublks[io->done], &blk, sizeof(blk))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	kfree(data);
+	return ret;
+}
+
+/* -------- import -------- */
+
+static int raw_check_blk(struct bcomp_dev *bcdev, struct bcomp_raw_blk *blk)
+{
+	if (blk->lsize != bcdev->bs || !blk->psize || blk->psize > blk->lsize)
+		return -EINVAL;
+
+	if (blk->psize == blk->lsize)
+		return 0;
+
+	/* hdr= needs its trailer to fit, like comp_useful_size() leaves */
+	if (blk->psize > blk->lsize - SECTOR_SIZE || blk->cprf >= CPRF_N)
+		return -EINVAL;
+
+	if (blk->nsub > 1 && !bcdev->split_wq)
+		return -EOPNOTSUPP;
+
+	return 0;
+}
+
+static int raw_import_blk(struct bcomp_dev *bcdev, struct bcomp_raw_blk *blk,
+			  struct buffer *buf)
+{
+	struct map_cell *cell;
+	int ret;
+
+	ret = raw_check_lba(bcdev, blk->lba) ?: raw_check_blk(bcdev, blk);
+	if (ret)
+		return ret;
+
+	memset(buf->data, 0, bcdev->bs);
+	if (copy_from_user(buf->data, u64_to_user_ptr(blk->data), blk->psize))
+		return -EFAULT;
+	buf->data_sz = blk->psize;
+
+	bcomp_lock_block(bcdev, blk->lba);
+
+	if (bcdev->cache)
+		blk_cache_invalidate(bcdev->cache, blk->lba);
+
+	ret = update_mapping(&cell, blk->lba, blk->lsize, blk->psize,
+			     bcdev->map);
+	if (ret)
+		goto unlock;
+
+	if (cell) {
+		cell->cprf = blk->cprf;
+		cell->comp_prf_id = blk->comp_prf_id;
+		cell->nsub = blk->nsub;
+		cell->wtime = ktime_get_seconds();
+
+		if (bcdev->hdr)
+			blk_hdr_stamp(bcdev->hdr, cell, buf);
+	}
+
+	ret = bcomp_rw_block_sync(bcdev, REQ_OP_WRITE, blk->lba, buf);
+	if (ret) {
+		/* the old data may be gone too, what's there now is raw */
+		BCOMP_ERRLOG("import: write failed");
+		update_mapping(&cell, blk->lba, blk->lsize, blk->lsize,
+			       bcdev->map);
+	} else {
+		bcomp_mark_written(bcdev, blk->lba);
+	}
+
+unlock:
+	bcomp_unlock_block(bcdev, blk->lba);
+	return ret;
+}
+
+int bcomp_raw_import(struct bcomp_dev *bcdev, struct bcomp_raw_io *io)
+{
+	struct bcomp_raw_blk __user *ublks = u64_to_user_ptr(io->blks);
+	struct bcomp_raw_blk blk;
+	struct buffer buf = {};
+	char *data;
+	int ret = 0;
+
+	if (io->nr > BCOMP_RAW_MAX_NR)
+		return -EINVAL;
+
+	if (map_has_dedup(bcdev->map) || bcdev->meta)
+		return -EOPNOTSUPP;
+
+	/* a dirty block destaged later would overwrite the imported one */
+	if (bcdev->wb) {
+		ret = wb_flush(bcdev->wb);
+		if (ret)
+			return ret;
+	}
+
+	data = kmalloc(bcdev->bs, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	for (io->done = 0; io->done < io->nr; io->done++) {
+		if (copy_from_user(&blk, &ublks[io->done], sizeof(blk))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		link_data(bcdev->bs, data, false, &buf);
+		ret = raw_import_blk(bcdev, &blk, &buf);
+		if (ret)
+			break;
+
+		cond_resched();
+	}
+
+	kfree(data);
+	return ret;
+}
@@ -0,0 +1,408 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+
+#include "../include/bcomp.h"
+#include "../include/comp_common.h"
+#include "../include/map_common.h"
+#include "../include/recompress.h"
+
+/* ================== BLOCK ================== */
+
+static bool recomp_dev_idle(struct bcomp_dev *bcdev)
+{
+	return time_after(jiffies, READ_ONCE(bcdev->last_io) +
+					   msecs_to_jiffies(RECOMP_IDLE_MS));
+}
+
+static bool recomp_wanted(struct recomp_ctx *rc, struct map_cell *cell)
+{
+	if (!is_data_compressed(cell))
+		return false;
+
+	/* blocks left from a previous profile are migrated to the current */
+	if (cell->cprf == rc->cctx->prf &&
+	    comp_strength(cell->comp_prf_id, rc->cctx) >=
+	    comp_strength(rc->cctx->comp_prf_id, rc->cctx))
+		return false;
+
+	return (u32)ktime_get_seconds() - cell->wtime >= rc->cold_sec;
+}
+
+static void recomp_block(struct recomp_ctx *rc, u64 key)
+{
+	struct bcomp_dev *bcdev = rc->bcdev;
+	sector_t lba = bcomp_key_to_lba(bcdev, key);
+	struct chunk *stored = NULL, *fresh = NULL;
+	struct map_cell *cell;
+	u32 lsize, old_psize, wtime;
+
+	if (!bcomp_trylock_block(bcdev, lba))
+		return;
+
+	if (get_mapping(&cell, lba, bcdev->map) || !recomp_wanted(rc, cell))
+		goto unlock;
+
+	lsize = cell->lsize;
+	old_psize = cell->psize;
+	wtime = cell->wtime;
+
+	/* READ + DECOMPRESS */
+	if (bcomp_read_cell_sync(bcdev, cell, &stored))
+		goto unlock;
+
+	/* RECOMPRESS */
+	if (allocate_chunk_for_comp(&fresh, lsize, bcdev->bs, rc->cctx))
+		goto free_chunks;
+
+	memcpy(fresh->src.data, stored->dst.data, lsize);
+	fresh->src.data_sz = lsize;
+
+	if (comp_src_to_dst(fresh, rc->cctx))
+		goto free_chunks;
+
+	if (fresh->dst.data_sz >= old_psize)
+		goto free_chunks;
+
+	/* the cell changes only after a successful rewrite */
+	if (bcdev->hdr) {
+		struct map_cell next = *cell;
+
+		next.psize = fresh->dst.data_sz;
+		next.cprf = rc->cctx->prf;
+		next.comp_prf_id = rc->cctx->comp_prf_id;
+		next.nsub = 0;
+		blk_hdr_stamp(bcdev->hdr, &next, &fresh->dst);
+	}
+
+	/* REWRITE */
+	if (bcomp_rw_block_sync(bcdev, REQ_OP_WRITE, cell->pba, &fresh->dst)) {
+		BCOMP_ERRLOG("recompression: rewrite failed");
+		goto free_chunks;
+	}
+
+	if (update_mapping(&cell, lba, lsize, fresh->dst.data_sz, bcdev->map) ||
+	    !cell) {
+		BCOMP_ERRLOG("recompression: Map failed");
+		goto free_chunks;
+	}
+
+	cell->cprf = rc->cctx->prf;
+	cell->comp_prf_id = rc->cctx->comp_prf_id;
+	cell->nsub = 0; // background rewrites are single-stream
+	cell->wtime = wtime;
+
+	atomic64_inc(&rc->recompressed_cnt);
+	atomic64_add(old_psize - fresh->dst.data_sz, &rc->psize_delta_bytes);
+
+free_chunks:
+	if (fresh)
+		free_chunk(fresh);
+	free_chunk(stored);
+unlock:
+	bcomp_unlock_block(bcdev, lba);
+}
+
+/*
+DOC:
+	In-place conversions used by the hot/cold tracker. A raw block lives
+	at pba == lba, so both rewrite the block where it is.
+ */
+int recomp_store_raw(struct bcomp_dev *bcdev, sector_t lba)
+{
+	struct chunk *stored = NULL;
+	struct map_cell *cell;
+	u32 lsize;
+	int ret;
+
+	if (map_has_dedup(bcdev->map))
+		return -EOPNOTSUPP;
+
+	if (!bcomp_trylock_block(bcdev, lba))
+		return -EBUSY;
+
+	ret = get_mapping(&cell, lba, bcdev->map);
+	if (ret)
+		goto unlock;
+
+	if (!is_data_compressed(cell)) {
+		ret = -ENODATA;
+		goto unlock;
+	}
+
+	lsize = cell->lsize;
+
+	ret = bcomp_read_cell_sync(bcdev, cell, &stored);
+	if (ret)
+		goto unlock;
+
+	ret = bcomp_rw_block_sync(bcdev, REQ_OP_WRITE, lba, &stored->dst);
+	if (ret) {
+		BCOMP_ERRLOG("hot block: raw rewrite failed");
+		goto free_stored;
+	}
+
+	ret = update_mapping(&cell, lba, lsize, lsize, bcdev->map);
+	if (ret)
+		BCOMP_ERRLOG("hot block: Map failed");
+
+free_stored:
+	free_chunk(stored);
+unlock:
+	bcomp_unlock_block(bcdev, lba);
+	return ret;
+}
+
+int recomp_compress_raw(struct bcomp_dev *bcdev, sector_t lba)
+{
+	struct chunk *fresh = NULL;
+	struct comp_ctx *cctx;
+	struct map_cell *cell;
+	u32 lsize = bcdev->bs;
+	int ret;
+
+	if (map_has_dedup(bcdev->map))
+		return -EOPNOTSUPP;
+
+	if (!bcomp_trylock_block(bcdev, lba))
+		return -EBUSY;
+
+	ret = get_mapping(&cell, lba, bcdev->map);
+	if (ret)
+		goto unlock;
+
+	/* rewritten compressed in the meantime */
+	if (is_data_compressed(cell)) {
+		ret = -ENODATA;
+		goto unlock;
+	}
+
+	cctx = bcomp_get_comp(bcdev);
+
+	ret = allocate_chunk_for_comp(&fresh, lsize, bcdev->bs, cctx);
+	if (ret)
+		goto put_cctx;
+
+	ret = bcomp_rw_block_sync(bcdev, REQ_OP_READ, lba, &fresh->src);
+	if (ret)
+		goto free_fresh;
+	fresh->src.data_sz = lsize;
+
+	ret = comp_src_to_dst(fresh, cctx);
+	if (ret)
+		goto free_fresh;
+
+	if (fresh->dst.data_sz >= lsize) {
+		ret = -ENODATA;
+		goto free_fresh;
+	}
+
+	ret = update_mapping(&cell, lba, lsize, fresh->dst.data_sz, bcdev->map);
+	if (ret || !cell) {
+		BCOMP_ERRLOG("cold block: Map failed");
+		ret = ret ?: -EIO;
+		goto free_fresh;
+	}
+
+	cell->cprf = cctx->prf;
+	cell->comp_prf_id = cctx->comp_prf_id;
+	cell->nsub = 0;
+	cell->wtime = ktime_get_seconds();
+
+	if (bcdev->hdr)
+		blk_hdr_stamp(bcdev->hdr, cell, &fresh->dst);
+
+	ret = bcomp_rw_block_sync(bcdev, REQ_OP_WRITE, cell->pba, &fresh->dst);
+	if (ret) {
+		BCOMP_ERRLOG("cold block: rewrite failed");
+		update_mapping(&cell, lba, lsize, lsize, bcdev->map);
+		goto free_fresh;
+	}
+
+free_fresh:
+	free_chunk(fresh);
+put_cctx:
+	bcomp_put_comp(cctx);
+unlock:
+	bcomp_unlock_block(bcdev, lba);
+	return ret;
+}
+
+/* ================== WORKER ================== */
+
+static void recomp_work_fn(struct work_struct *work)
+{
+	struct recomp_ctx *rc =
+		container_of(to_delayed_work(work), struct recomp_ctx, work);
+	struct bcomp_dev *bcdev = rc->bcdev;
+	u32 quota = max_t(u32, rc->budget * RECOMP_TICK_MS / MSEC_PER_SEC, 1);
+
+	if (rc->mode == RECOMP_IDLE && !recomp_dev_idle(bcdev))
+		goto resched;
+
+	for (u32 i = 0; i < quota && rc->cursor < bcdev->blk_cnt; i++) {
+		recomp_block(rc, rc->cursor++);
+		atomic64_inc(&rc->scanned_cnt);
+		cond_resched();
+	}
+
+	if (rc->cursor >= bcdev->blk_cnt) {
+		atomic64_inc(&rc->passes_cnt);
+		WRITE_ONCE(rc->running, false);
+		return;
+	}
+
+resched:
+	queue_delayed_work(system_unbound_wq, &rc->work,
+			   msecs_to_jiffies(RECOMP_TICK_MS));
+}
+
+/* ================== TRIGGER ================== */
+
+static void stop_recomp(struct recomp_ctx *rc)
+{
+	cancel_delayed_work_sync(&rc->work);
+	WRITE_ONCE(rc->running, false);
+}
+
+static int init_recomp_comp(struct recomp_ctx *rc, int comp_id)
+{
+	struct comp_ctx *dev_cctx = bcomp_get_comp(rc->bcdev);
+	struct comp_ctx *cctx;
+	int ret;
+
+	if (rc->cctx && rc->cctx->prf == dev_cctx->prf &&
+	    rc->cctx->comp_prf_id == comp_id) {
+		ret = 0;
+		goto put_dev_cctx;
+	}
+
+	cctx = kzalloc(sizeof(*cctx), GFP_KERNEL);
+	if (!cctx) {
+		ret = -ENOMEM;
+		goto put_dev_cctx;
+	}
+
+	ret = init_comp_ops(dev_cctx->prf, cctx);
+	if (ret)
+		goto free_cctx;
+
+	ret = init_comp(cctx, comp_id, dev_cctx->decomp_prf_id);
+	if (ret)
+		goto free_cctx;
+
+	cctx->min_saving = dev_cctx->min_saving;
+	cctx->acct = dev_cctx->acct; // background work is billed too
+
+	if (comp_strength(comp_id, cctx) < 0) {
+		ret = -EINVAL;
+		goto free_cctx;
+	}
+
+	if (rc->cctx)
+		free_comp(rc->cctx);
+	rc->cctx = cctx;
+	bcomp_put_comp(dev_cctx);
+	return 0;
+
+free_cctx:
+	free_comp(cctx);
+put_dev_cctx:
+	bcomp_put_comp(dev_cctx);
+	return ret;
+}
+
+int trigger_recomp(struct bcomp_dev *bcdev, const char *arg)
+{
+	struct recomp_ctx *rc = bcdev->recomp;
+	char mode[RECOMP_MODE_STR_LEN] = { 0 };
+	u32 budget, cold_sec;
+	int comp_id, ret;
+
+	if (sysfs_streq(arg, "stop")) {
+		if (rc)
+			stop_recomp(rc);
+		return 0;
+	}
+
+	/* shared physical blocks can't be rewritten in place */
+	if (map_has_dedup(bcdev->map)) {
+		BCOMP_ERRLOG("recompression is not supported by dedup map");
+		return -EOPNOTSUPP;
+	}
+
+	/* an in-place rewrite of an acknowledged block isn't crash-safe */
+	if (bcdev->meta) {
+		BCOMP_ERRLOG("recompression is not supported with meta");
+		return -EOPNOTSUPP;
+	}
+
+	if (sscanf(arg, "%d %u %u %7s", &comp_id, &budget, &cold_sec, mode) !=
+		    4 ||
+	    !budget) {
+		BCOMP_ERRLOG(
+			"recompression trigger should look like:\n<comp-prfl-id> <blocks-per-sec> <cold-sec> <idle|always>");
+		return -EINVAL;
+	}
+
+	if (!rc) {
+		rc = kzalloc(sizeof(*rc), GFP_KERNEL);
+		if (!rc)
+			return -ENOMEM;
+
+		rc->bcdev = bcdev;
+		INIT_DELAYED_WORK(&rc->work, recomp_work_fn);
+		bcdev->recomp = rc;
+	}
+
+	stop_recomp(rc);
+
+	ret = init_recomp_comp(rc, comp_id);
+	if (ret) {
+		BCOMP_ERRLOG("recompression profile init");
+		return ret;
+	}
+
+	rc->mode = strcmp(mode, "always") ? RECOMP_IDLE : RECOMP_ALWAYS;
+	rc->budget = budget;
+	rc->cold_sec = cold_sec;
+	rc->cursor = 0;
+	rc->running = true;
+
+	queue_delayed_work(system_unbound_wq, &rc->work, 0);
+	return 0;
+}
+
+void free_recomp(struct recomp_ctx *rc)
+{
+	stop_recomp(rc);
+
+	if (rc->cctx)
+		free_comp(rc->cctx);
+
+	kfree(rc);
+}
+
+int recomp_stats_emit(char *buf, int at, struct recomp_ctx *rc)
+{
+	return sysfs_emit_at(buf, at, PRITTY_RECOMP_STATS_TEMPLATE,
+			     rc->cctx ? rc->cctx->comp_prf_id : -1,
+			     READ_ONCE(rc->running), rc->cursor,
+			     rc->bcdev->blk_cnt,
+			     atomic64_read(&rc->scanned_cnt),
+			     atomic64_read(&rc->recompressed_cnt),
+			     atomic64_read(&rc->psize_delta_bytes),
+			     atomic64_read(&rc->passes_cnt));
+}
+
+void reset_recomp_stats(struct recomp_ctx *rc)
+{
+	atomic64_set(&rc->scanned_cnt, 0);
+	atomic64_set(&rc->recompressed_cnt, 0);
+	atomic64_set(&rc->psize_delta_bytes, 0);
+	atomic64_set(&rc->passes_cnt, 0);
+}
@@ -1,8 +1,11 @@
 #include <linux/stddef.h>
 #include <linux/kstrtox.h>
+#include <linux/limits.h>
+#include <linux/sprintf.h>
 
 #include "../include/settings.h"
 #include "../include/bcomp.h"
+#include "../include/policy.h"
 
 const char NONE[NONE_LEN] = "none";
 
@@ -12,8 +15,19 @@ const char *AVAILABLE_BS_NAMES[BS_STR_LEN] = { "4k", "8k", "16k", "32k", "64k",
 const enum comp_profile AVAILABLE_CPRF[CPRF_N] = { EMPTY, LZ4 };
 const char *AVAILABLE_CPRF_NAMES[CPRF_STR_LEN] = { "empty", "lz4", NULL };
 
-const enum map_profile AVAILABLE_MPRF[MPRF_N] = { LINEAR };
-const char *AVAILABLE_MPRF_NAMES[MPRF_STR_LEN] = { "linear", NULL };
+const enum map_profile AVAILABLE_MPRF[MPRF_N] = { LINEAR, DEDUP };
+const char *AVAILABLE_MPRF_NAMES[MPRF_STR_LEN] = { "linear", "dedup", NULL };
+
+const char *AVAILABLE_OPTION_NAMES[OPT_N + 1] = { "min_saving", "adapt",
+						  "adapt_backlog",
+						  "adapt_mbps", "policy",
+						  "hot", "hot_age", "split",
+						  "cache", "prefetch",
+						  "mem_limit", "wb", "wb_rate",
+						  "log", "stripe", "meta",
+						  "hdr", "rebuild", "map_mem",
+						  "mapfile", "sparse",
+						  NULL };
 
 const char *get_none_keyword(void)
 {
@@ -50,11 +64,25 @@ const char **get_available_mprf_names(void)
 	return AVAILABLE_MPRF_NAMES;
 }
 
+const char **get_available_option_names(void)
+{
+	return AVAILABLE_OPTION_NAMES;
+}
+
 void free_user_settings(struct user_settings *settings)
 {
 	if (settings->path)
 		kfree(settings->path);
 
+	if (settings->policy)
+		kfree(settings->policy);
+
+	if (settings->log_path)
+		kfree(settings->log_path);
+
+	if (settings->mapfile_path)
+		kfree(settings->mapfile_path);
+
 	kfree(settings);
 }
 
@@ -152,6 +180,177 @@ static int get_path(const char *path_arg, int len, char **path)
 	return 0;
 }
 
+static int validate_u32(const char *num_arg, int len, u32 *res)
+{
+	char buffer[MAX_NUM_STR_LEN] = { 0 };
+
+	if (len > MAX_NUM_STR_LEN - 1)
+		return -EINVAL;
+
+	memcpy(buffer, num_arg, len);
+	return kstrtou32(buffer, 10, res);
+}
+
+static int validate_id_range(const char *range_arg, int len, int *from_id,
+			     int *to_id)
+{
+	const char *to_arg;
+	int ret;
+
+	to_arg = strnchr(range_arg, len, OPTION_RANGE_DELIMITER);
+	if (!to_arg)
+		return -EINVAL;
+
+	ret = validate_cprf_id(range_arg, to_arg - range_arg, from_id);
+	if (ret)
+		return ret;
+
+	to_arg++;
+	return validate_cprf_id(to_arg, len - (to_arg - range_arg), to_id);
+}
+
+static int option_max_len(enum option_id id)
+{
+	switch (id) {
+	case OPT_LOG:
+	case OPT_MAPFILE:
+		return PATH_MAX - 1;
+
+	default:
+		return OPTION_STR_LEN - 1;
+	}
+}
+
+static int validate_option(const char *opt_arg, int len,
+			   struct user_settings *settings)
+{
+	const char **names = get_available_option_names();
+	const char *val_arg;
+	int name_len, val_len;
+
+	val_arg = strnchr(opt_arg, len, OPTION_DELIMITER);
+	if (!val_arg) {
+		BCOMP_ERRLOG("option should look like <name>=<value>");
+		return -EINVAL;
+	}
+
+	name_len = val_arg - opt_arg;
+	val_arg++;
+	val_len = len - name_len - 1;
+
+	for (int i = 0; i < OPT_N; i++) {
+		if (strlen(names[i]) != name_len ||
+		    strncmp(names[i], opt_arg, name_len))
+			continue;
+
+		if (val_len > option_max_len((enum option_id)i)) {
+			char msg[OPTION_STR_LEN];
+
+			snprintf(msg, sizeof(msg),
+				 "value of option %s is too long", names[i]);
+			BCOMP_ERRLOG(msg);
+			return -EINVAL;
+		}
+
+		switch ((enum option_id)i) {
+		case OPT_MIN_SAVING:
+			return validate_u32(val_arg, val_len,
+					    &settings->min_saving);
+
+		case OPT_ADAPT:
+			settings->adapt = true;
+			return validate_id_range(val_arg, val_len,
+						 &settings->adapt_from_id,
+						 &settings->adapt_to_id);
+
+		case OPT_ADAPT_BACKLOG:
+			return validate_u32(val_arg, val_len,
+					    &settings->adapt_backlog);
+
+		case OPT_ADAPT_MBPS:
+			return validate_u32(val_arg, val_len,
+					    &settings->adapt_mbps);
+
+		case OPT_POLICY:
+			if (settings->policy)
+				kfree(settings->policy);
+			settings->policy = parse_comp_policy(val_arg, val_len);
+			return settings->policy ? 0 : -EINVAL;
+
+		case OPT_HOT:
+			return validate_u32(val_arg, val_len,
+					    &settings->hot_threshold);
+
+		case OPT_HOT_AGE:
+			return validate_u32(val_arg, val_len,
+					    &settings->hot_age_sec);
+
+		case OPT_SPLIT:
+			return validate_u32(val_arg, val_len, &settings->split);
+
+		case OPT_CACHE:
+			return validate_u32(val_arg, val_len,
+					    &settings->cache_mb);
+
+		case OPT_PREFETCH:
+			return validate_u32(val_arg, val_len,
+					    &settings->prefetch);
+
+		case OPT_MEM_LIMIT:
+			return validate_u32(val_arg, val_len,
+					    &settings->mem_limit_mb);
+
+		case OPT_WB:
+			return validate_u32(val_arg, val_len, &settings->wb_mb);
+
+		case OPT_WB_RATE:
+			return validate_u32(val_arg, val_len,
+					    &settings->wb_rate);
+
+		case OPT_LOG:
+			if (settings->log_path)
+				kfree(settings->log_path);
+			return get_path(val_arg, val_len, &settings->log_path);
+
+		case OPT_STRIPE:
+			return validate_u32(val_arg, val_len,
+					    &settings->stripe);
+
+		case OPT_META:
+			return validate_u32(val_arg, val_len,
+					    &settings->meta_mb);
+
+		case OPT_HDR:
+			return validate_u32(val_arg, val_len, &settings->hdr);
+
+		case OPT_REBUILD:
+			return validate_u32(val_arg, val_len,
+					    &settings->rebuild);
+
+		case OPT_MAP_MEM:
+			return validate_u32(val_arg, val_len,
+					    &settings->map_mem_mb);
+
+		case OPT_MAPFILE:
+			if (settings->mapfile_path)
+				kfree(settings->mapfile_path);
+			return get_path(val_arg, val_len,
+					&settings->mapfile_path);
+
+		case OPT_SPARSE:
+			return validate_u32(val_arg, val_len,
+					    &settings->sparse);
+
+		default:
+			BCOMP_ERRLOG("unexpected option_id");
+			return -EINVAL;
+		}
+	}
+
+	BCOMP_ERRLOG("unknown option");
+	return -EINVAL;
+}
+
 static int str_get_next_delim_idx(const char *arg, int start_idx)
 {
 	int idx = start_idx;
@@ -165,14 +364,17 @@ static int str_get_next_delim_idx(const char *arg, int start_idx)
 	return idx;
 }
 
-enum parser_stage parse_user_settings(const char *arg,
-				      struct user_settings *settings)
+/* parses stages [first, last] of the bcomp-table, last == END_STG -> all */
+static enum parser_stage parse_stages(const char *arg,
+				      struct user_settings *settings,
+				      enum parser_stage first,
+				      enum parser_stage last)
 {
-	// "<4k|...> <empty|...> <int> <linear|...> /dev/<path>"
 	int len;
 	int cur_idx = 0;
 	int sb_idx = cur_idx;
-	enum parser_stage stage = BS_STG;
+	enum parser_stage parsed;
+	enum parser_stage stage = first;
 
 	if (!arg || IS_STR_END(arg[cur_idx])) {
 		BCOMP_ERRLOG("settings table shouldn't be empty");
@@ -193,6 +395,7 @@ enum parser_stage parse_user_settings(const char *arg,
 		}
 
 		len = cur_idx - sb_idx;
+		parsed = stage;
 
 		switch (stage) {
 		case BS_STG:
@@ -234,13 +437,24 @@ enum parser_stage parse_user_settings(const char *arg,
 			if (get_path(STR_SUFFIX(arg, sb_idx), len,
 				     &settings->path))
 				goto err;
-			stage = END_STG;
+			stage = IS_STR_END(arg[cur_idx]) ? END_STG :
+							   OPTIONS_STG;
+			break;
+
+		case OPTIONS_STG:
+			if (validate_option(STR_SUFFIX(arg, sb_idx), len,
+					    settings))
+				goto err;
+			if (IS_STR_END(arg[cur_idx]))
+				stage = END_STG;
 			break;
 
 		default:
 			BCOMP_ERRLOG("unexpected stage");
 			break;
 		}
+		if (parsed == last)
+			stage = END_STG;
 		sb_idx = cur_idx + 1;
 	}
 
@@ -252,8 +466,35 @@ enum parser_stage parse_user_settings(const char *arg,
 	return stage;
 
 err:
-	BCOMP_ERRLOG(
-		"bcomp-table should look like:\n<bs> <comp-profile> <comp-prfl-id> <decomp-prfl-id> <map-profile> /dev/<path>");
 	BCOMP_ERRLOG(STAGE_PP(stage));
 	return stage;
 }
+
+enum parser_stage parse_user_settings(const char *arg,
+				      struct user_settings *settings)
+{
+	// "<4k|...> <empty|...> <int> <int> <linear|...> /dev/<path> [<opt>=<val> ...]"
+	enum parser_stage stage;
+
+	stage = parse_stages(arg, settings, BS_STG, END_STG);
+	if (stage != END_STG)
+		BCOMP_ERRLOG(
+			"bcomp-table should look like:\n<bs> <comp-profile> <comp-prfl-id> <decomp-prfl-id> <map-profile> /dev/<path> [<option>=<value> ...]");
+
+	return stage;
+}
+
+enum parser_stage parse_comp_settings(const char *arg,
+				      struct user_settings *settings)
+{
+	// "<empty|...> <int> <int>"
+	enum parser_stage stage;
+
+	stage = parse_stages(arg, settings, COMP_PROFILE_STG,
+			     DECOMP_PROFILE_ID_STG);
+	if (stage != END_STG)
+		BCOMP_ERRLOG(
+			"compression settings should look like:\n<comp-profile> <comp-prfl-id> <decomp-prfl-id>");
+
+	return stage;
+}
@@ -1,11 +1,76 @@
 #include <linux/types.h>
 #include <linux/blk_types.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
 
 #include "../include/stats.h"
 
+struct stats *alloc_stats(void)
+{
+	struct stats *stats;
+
+	stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return NULL;
+
+	stats->pcpu = alloc_percpu(struct stats_pcpu);
+	if (!stats->pcpu) {
+		kfree(stats);
+		return NULL;
+	}
+
+	return stats;
+}
+
+void free_stats(struct stats *stats)
+{
+	free_percpu(stats->pcpu);
+	kfree(stats);
+}
+
+static u64 stats_sum(struct stats *stats, enum stat_item item)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(per_cpu_ptr(stats->pcpu, cpu)->cnt[item]);
+
+	return sum;
+}
+
+u64 stats_read(struct stats *stats, enum stat_item item)
+{
+	return stats_sum(stats, item) - READ_ONCE(stats->base[item]);
+}
+
+int stats_emit(char *buf, int at, struct stats *stats)
+{
+	return sysfs_emit_at(buf, at, PRITTY_STATS_TEMPLATE,
+			     stats_read(stats, STAT_COMPRESSED_REQS_25),
+			     stats_read(stats, STAT_COMPRESSED_REQS_50),
+			     stats_read(stats, STAT_COMPRESSED_REQS_75),
+			     stats_read(stats, STAT_COMPRESSED_REQS_99),
+			     stats_read(stats, STAT_UNCOMPRESSED_REQS),
+			     stats_read(stats, STAT_ALL_REQS),
+			     stats_read(stats, STAT_DATA_IN_BYTES),
+			     stats_read(stats, STAT_COMPRESSED_DATA_IN_BYTES),
+			     stats_read(stats, STAT_READ_REQS),
+			     stats_read(stats, STAT_READ_BYTES),
+			     stats_read(stats, STAT_READ_DECOMP_REQS),
+			     stats_read(stats, STAT_READ_RAW_REQS),
+			     stats_read(stats, STAT_READ_ERRORS),
+			     stats_read(stats, STAT_UNWRITTEN_READS));
+}
+
+/* resets are serialized by the parameter lock */
 void reset_stats(struct stats *stats)
 {
-	memset(stats, 0, sizeof(struct stats));
+	int i;
+
+	for (i = 0; i < STAT_NR; i++)
+		WRITE_ONCE(stats->base[i], stats_sum(stats, i));
 }
 
 enum compression_level get_compression_level(u32 compressed_sz, u32 source_sz)
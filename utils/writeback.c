@@ -0,0 +1,455 @@
+#include <linux/types.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/jiffies.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#include "../include/bcomp.h"
+#include "../include/blk_cache.h"
+#include "../include/writeback.h"
+
+/* ================== ENTRIES ================== */
+
+static struct wb_entry *wb_alloc_entry(struct wb_ctx *wb, sector_t lba)
+{
+	struct wb_entry *e;
+	char *data;
+
+	e = kzalloc(sizeof(*e), GFP_NOIO);
+	if (!e)
+		return NULL;
+
+	data = kmalloc(wb->bcdev->bs, GFP_NOIO);
+	if (!data) {
+		kfree(e);
+		return NULL;
+	}
+
+	e->wb = wb;
+	e->lba = lba;
+	link_data(wb->bcdev->bs, data, false, &e->buf);
+
+	return e;
+}
+
+static void wb_free_entry(struct wb_entry *e)
+{
+	kfree(e->buf.data);
+	kfree_rcu(e, rcu);
+}
+
+/* the next batch right away if somebody waits for it */
+static void wb_kick(struct wb_ctx *wb)
+{
+	mod_delayed_work(wb->wq, &wb->work, 0);
+}
+
+/* ================== DATA-PATH ================== */
+
+static void wb_throttle(struct wb_ctx *wb)
+{
+	u32 bs = wb->bcdev->bs;
+
+	if (atomic64_read(&wb->dirty_bytes) + bs <= wb->cap)
+		return;
+
+	atomic64_inc(&wb->throttled_cnt);
+	atomic_inc(&wb->waiters);
+	wb_kick(wb);
+	wait_event(wb->wait, atomic64_read(&wb->dirty_bytes) + bs <= wb->cap);
+	atomic_dec(&wb->waiters);
+}
+
+/* superseded by a newer write also counts: its data is gone anyway */
+static bool wb_block_clean(struct wb_ctx *wb, u64 key, u64 seq)
+{
+	struct wb_entry *e;
+	bool clean;
+
+	rcu_read_lock();
+	e = xa_load(&wb->dirty, key);
+	clean = !e || e->seq > seq;
+	rcu_read_unlock();
+
+	return clean;
+}
+
+int wb_write(struct wb_ctx *wb, struct bio *bio)
+{
+	struct bcomp_dev *bcdev = wb->bcdev;
+	sector_t lba = bio->bi_iter.bi_sector;
+	u64 key = bcomp_lba_to_key(bcdev, lba);
+	struct wb_entry *e;
+	u64 seq;
+	int ret = 0;
+
+	wb_throttle(wb);
+
+	bcomp_lock_block(bcdev, lba);
+
+	if (bcdev->cache)
+		blk_cache_invalidate(bcdev->cache, lba);
+
+	seq = atomic64_inc_return(&wb->seq);
+	e = xa_load(&wb->dirty, key);
+	if (e && !e->destaging) {
+		copy_sg_to_buf(&e->buf, bio);
+		e->seq = seq;
+		e->opf = bio->bi_opf & WB_OPF_HINTS;
+		e->ioprio = bio->bi_ioprio;
+		atomic64_inc(&wb->absorbed_cnt);
+		goto unlock;
+	}
+
+	e = wb_alloc_entry(wb, lba);
+	if (!e) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	copy_sg_to_buf(&e->buf, bio);
+	e->seq = seq;
+	e->opf = bio->bi_opf & WB_OPF_HINTS;
+	e->ioprio = bio->bi_ioprio;
+
+	/* replaces an entry being destaged, the worker releases that one */
+	ret = xa_err(xa_store(&wb->dirty, key, e, GFP_NOIO));
+	if (ret) {
+		wb_free_entry(e);
+		goto unlock;
+	}
+
+	atomic64_add(bcdev->bs, &wb->dirty_bytes);
+	atomic64_inc(&wb->cached_cnt);
+
+unlock:
+	bcomp_unlock_block(bcdev, lba);
+	if (ret)
+		return ret;
+
+	/* no-op if already queued */
+	queue_delayed_work(wb->wq, &wb->work, msecs_to_jiffies(WB_EXPIRE_MS));
+
+	if (bio->bi_opf & REQ_FUA) {
+		atomic_inc(&wb->waiters);
+		wb_kick(wb);
+		wait_event(wb->wait, wb_block_clean(wb, key, seq));
+		atomic_dec(&wb->waiters);
+	}
+
+	bio_endio(bio);
+	return 0;
+}
+
+bool wb_read(struct wb_ctx *wb, sector_t lba, struct bio *bio)
+{
+	struct wb_entry *e;
+
+	e = xa_load(&wb->dirty, bcomp_lba_to_key(wb->bcdev, lba));
+	if (!e)
+		return false;
+
+	copy_buf_to_sg(&e->buf, bio);
+	atomic64_inc(&wb->read_hits_cnt);
+	return true;
+}
+
+/*
+DOC:
+	An entry being destaged is left to the worker, which releases the
+	entry and its dirty bytes. wb_dropped() drops its bio. The same
+	happens to the bio of an older entry that this one replaced: the
+	worker can't pick the newer entry before that batch completes.
+ */
+void wb_discard(struct wb_ctx *wb, sector_t lba)
+{
+	u64 key = bcomp_lba_to_key(wb->bcdev, lba);
+	struct wb_entry *e;
+
+	e = xa_erase(&wb->dirty, key);
+	if (!e || e->destaging)
+		return;
+
+	atomic64_sub(wb->bcdev->bs, &wb->dirty_bytes);
+	wb_free_entry(e);
+
+	/* throttled writers and FUA waiters of the block */
+	wake_up_all(&wb->wait);
+}
+
+static bool wb_clean_upto(struct wb_ctx *wb, u64 seq)
+{
+	struct wb_entry *e;
+	unsigned long key;
+	bool clean = true;
+
+	rcu_read_lock();
+	xa_for_each(&wb->dirty, key, e) {
+		if (e->seq <= seq) {
+			clean = false;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return clean;
+}
+
+int wb_flush(struct wb_ctx *wb)
+{
+	u64 seq = atomic64_read(&wb->seq);
+
+	atomic64_inc(&wb->flushes_cnt);
+
+	atomic_inc(&wb->waiters);
+	wb_kick(wb);
+	wait_event(wb->wait, wb_clean_upto(wb, seq));
+	atomic_dec(&wb->waiters);
+
+	if (atomic_xchg(&wb->failed, 0))
+		return -EIO;
+
+	return bcomp_under_flush(wb->bcdev);
+}
+
+/* ================== DESTAGE ================== */
+
+static void wb_destage_endio(struct bio *bio)
+{
+	struct wb_entry *e = bio->bi_private;
+	struct wb_ctx *wb = e->wb;
+
+	e->status = bio->bi_status;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&wb->inflight))
+		wake_up_all(&wb->wait);
+}
+
+bool wb_owns_bio(struct bio *bio)
+{
+	return bio->bi_end_io == wb_destage_endio;
+}
+
+bool wb_dropped(struct wb_ctx *wb, struct bio *bio)
+{
+	u64 key = bcomp_lba_to_key(wb->bcdev, bio->bi_iter.bi_sector);
+
+	return wb_owns_bio(bio) && !xa_load(&wb->dirty, key);
+}
+
+static int wb_submit_entry(struct wb_ctx *wb, struct wb_entry *e)
+{
+	struct bcomp_dev *bcdev = wb->bcdev;
+	struct bio *bio;
+
+	/* REQ_FUA only classifies here: the write path doesn't pass it on */
+	bio = bio_alloc(bcdev->bcomp_disk->part0,
+			DIV_ROUND_UP(bcdev->bs, PAGE_SIZE) + 1,
+			REQ_OP_WRITE | e->opf, GFP_NOIO);
+	if (!bio)
+		return -ENOMEM;
+
+	if (add_buffer_to_bio(&e->buf, bcdev->bs, bio)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	bio->bi_iter.bi_sector = e->lba;
+	bio->bi_ioprio = e->ioprio;
+	bio->bi_end_io = wb_destage_endio;
+	bio->bi_private = e;
+
+	/* not submit_bio(): destaging goes on after del_gendisk() */
+	atomic_inc(&wb->inflight);
+	bcomp_submit_bio(bio);
+	return 0;
+}
+
+/*
+DOC:
+	A failed entry is dropped as well (retrying could block flushes
+	forever), the error is reported by the next flush like
+	a writeback error of the page cache.
+ */
+static void wb_finish_entry(struct wb_ctx *wb, struct wb_entry *e)
+{
+	struct bcomp_dev *bcdev = wb->bcdev;
+	u64 key = bcomp_lba_to_key(bcdev, e->lba);
+
+	bcomp_lock_block(bcdev, e->lba);
+	if (xa_load(&wb->dirty, key) == e)
+		xa_erase(&wb->dirty, key);
+	bcomp_unlock_block(bcdev, e->lba);
+
+	if (e->status == BLK_STS_OK) {
+		atomic64_inc(&wb->destaged_cnt);
+	} else {
+		BCOMP_ERRLOG("wb: destage failed");
+		atomic64_inc(&wb->errors_cnt);
+		atomic_set(&wb->failed, 1);
+	}
+
+	atomic64_sub(bcdev->bs, &wb->dirty_bytes);
+	wb_free_entry(e);
+}
+
+static u32 wb_collect_batch(struct wb_ctx *wb, struct wb_entry **batch)
+{
+	struct bcomp_dev *bcdev = wb->bcdev;
+	struct wb_entry *e;
+	unsigned long key;
+	u32 n = 0;
+
+	xa_for_each(&wb->dirty, key, e) {
+		sector_t lba = bcomp_key_to_lba(bcdev, key);
+
+		/* foreground I/O on the block -- next pass */
+		if (!bcomp_trylock_block(bcdev, lba))
+			continue;
+
+		/* out of rcu: e may be discarded and freed until locked */
+		e = xa_load(&wb->dirty, key);
+		if (e && !e->destaging) {
+			e->destaging = true;
+			batch[n++] = e;
+		}
+		bcomp_unlock_block(bcdev, lba);
+
+		if (n == WB_BATCH)
+			break;
+	}
+
+	return n;
+}
+
+static void wb_destage_work(struct work_struct *work)
+{
+	struct wb_ctx *wb = container_of(to_delayed_work(work), struct wb_ctx,
+					 work);
+	struct wb_entry *batch[WB_BATCH];
+	struct blk_plug plug;
+	unsigned long delay;
+	u32 n;
+
+	n = wb_collect_batch(wb, batch);
+
+	blk_start_plug(&plug);
+	for (u32 i = 0; i < n; i++)
+		if (wb_submit_entry(wb, batch[i]))
+			batch[i]->status = BLK_STS_RESOURCE;
+	blk_finish_plug(&plug);
+
+	wait_event(wb->wait, !atomic_read(&wb->inflight));
+
+	for (u32 i = 0; i < n; i++)
+		wb_finish_entry(wb, batch[i]);
+
+	wake_up_all(&wb->wait);
+
+	if (xa_empty(&wb->dirty))
+		return;
+
+	/* hurry only for waiters, otherwise let overwrites accumulate */
+	if (!atomic_read(&wb->waiters))
+		delay = msecs_to_jiffies(WB_EXPIRE_MS);
+	else if (wb->rate)
+		delay = msecs_to_jiffies(div_u64((u64)n * wb->bcdev->bs *
+							 MSEC_PER_SEC,
+						 (u64)wb->rate << 20));
+	else
+		delay = 0;
+
+	/* every dirty block was busy, don't spin on them */
+	if (!n)
+		delay = max_t(unsigned long, delay, 1);
+
+	queue_delayed_work(wb->wq, &wb->work, delay);
+}
+
+/* ================== INIT ================== */
+
+struct wb_ctx *alloc_wb(struct bcomp_dev *bcdev, u32 cap_mb, u32 rate)
+{
+	struct wb_ctx *wb;
+
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return NULL;
+
+	wb->bcdev = bcdev;
+	wb->cap = (u64)cap_mb << 20;
+	wb->rate = rate;
+	if (wb->cap < bcdev->bs) {
+		BCOMP_ERRLOG("wb: cap is too small for the block size");
+		goto free_wb;
+	}
+
+	wb->wq = alloc_workqueue("%s_wb", WQ_UNBOUND | WQ_MEM_RECLAIM, 1,
+				 BCOMP_NAME);
+	if (!wb->wq)
+		goto free_wb;
+
+	xa_init(&wb->dirty);
+	init_waitqueue_head(&wb->wait);
+	INIT_DELAYED_WORK(&wb->work, wb_destage_work);
+
+	return wb;
+
+free_wb:
+	kfree(wb);
+	return NULL;
+}
+
+void free_wb(struct wb_ctx *wb)
+{
+	struct wb_entry *e;
+	unsigned long key;
+
+	if (!xa_empty(&wb->dirty))
+		wb_flush(wb);
+
+	cancel_delayed_work_sync(&wb->work);
+	destroy_workqueue(wb->wq);
+
+	/* the flush waits for every entry, nothing should be left */
+	xa_for_each(&wb->dirty, key, e) {
+		BCOMP_ERRLOG("wb: dirty block dropped");
+		kfree(e->buf.data);
+		kfree(e);
+	}
+	xa_destroy(&wb->dirty);
+
+	kfree(wb);
+}
+
+/* ================== STATS ================== */
+
+int wb_stats_emit(char *buf, int at, struct wb_ctx *wb)
+{
+	return sysfs_emit_at(buf, at, PRITTY_WB_STATS_TEMPLATE, wb->cap,
+			     atomic64_read(&wb->dirty_bytes),
+			     atomic64_read(&wb->cached_cnt),
+			     atomic64_read(&wb->absorbed_cnt),
+			     atomic64_read(&wb->destaged_cnt),
+			     atomic64_read(&wb->throttled_cnt),
+			     atomic64_read(&wb->flushes_cnt),
+			     atomic64_read(&wb->read_hits_cnt),
+			     atomic64_read(&wb->errors_cnt));
+}
+
+void reset_wb_stats(struct wb_ctx *wb)
+{
+	atomic64_set(&wb->cached_cnt, 0);
+	atomic64_set(&wb->absorbed_cnt, 0);
+	atomic64_set(&wb->destaged_cnt, 0);
+	atomic64_set(&wb->throttled_cnt, 0);
+	atomic64_set(&wb->flushes_cnt, 0);
+	atomic64_set(&wb->read_hits_cnt, 0);
+	atomic64_set(&wb->errors_cnt, 0);
+}